@@ -16,13 +16,25 @@
 #include <sstream>
 #include <string>
 #include <thread>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
 
 
 #include <iostream>
 #include <vector>
 #include <regex>
 #include <fstream>
+#include <map>
 
+#include "bitmap_kernels.h"
+#include "grid_sieve.h"
+#include "kd_refine.h"
+#include "zorder_index.h"
+#include "hugepage.h"
+#include "reorder.h"
+#include "result_cache.h"
+#include "topology.h"
 
 #define THREAD_NUM 20
 #define MAX_BINDEX_NUM 256
@@ -195,6 +207,7 @@ class Timer{
 };
 
 Timer timer;
+Timer append_timer;  // Used by the appender thread only, timer is reset by the scans
 
 typedef int POSTYPE;  // Data type for positions
 // typedef int CODE;           // Codes are stored as int
@@ -216,6 +229,8 @@ const int BITSSHIFT = 5;  // x / BITSWIDTH == x >> BITSSHIFT
 const int SIMD_ALIGEN = 32;
 const int SIMD_JOB_UNIT = 8;  // 8 * BITSWIDTH == __m256i
 
+BitmapKernels bitmap_kernels;  // ISA of the copy/combine kernels, chosen at startup
+
 const int blockInitSize = 3276;  // 2048  
 const int blockMaxSize = 4096; // blockInitSize * 2;
 const int K = VAREA_N;  // Number of virtual areas
@@ -223,14 +238,10 @@ const int N = (int)DATA_N;
 // const int MAXCODE = INT_MAX;
 // const int MINCODE = INT_MIN;
 const int blockNumMax = (N / (K * blockInitSize)) * 4;
-int prefetch_stride = 6;
 
 std::vector<CODE> target_numbers_l;  // left target numbers
 std::vector<CODE> target_numbers_r;  // right target numbers
 
-BITS *result1;
-BITS *result2;
-
 CODE *current_raw_data;
 char scan_file[256];
 
@@ -252,7 +263,9 @@ POSTYPE *argsort(const T *v, POSTYPE n) {
   for (POSTYPE i = 0; i < n; i++) {
     idx[i] = i;
   }
-  __gnu_parallel::sort(idx, idx + n, [&v](size_t i1, size_t i2) { return v[i1] < v[i2]; });
+  // Equal values in row order, so clustered columns keep their runs (see PosRun)
+  __gnu_parallel::sort(idx, idx + n,
+                       [&v](size_t i1, size_t i2) { return v[i1] < v[i2] || (v[i1] == v[i2] && i1 < i2); });
   return idx;
 }
 
@@ -272,6 +285,16 @@ BITS gen_less_bits(const CODE *val, CODE compare, int n) {
   return result;
 }
 
+// Positions of clustered columns come in runs of consecutive rows, a block
+// whose runs are at least RUN_MIN_LENGTH long on average keeps them next to
+// its positions, so refine flips whole words instead of single bits
+#define RUN_MIN_LENGTH 8
+
+typedef struct {
+  POSTYPE start;  // First row of the run
+  int offset;     // Block-local index of that row in pos[]
+} PosRun;
+
 typedef struct {
   // Struct for a position block
   POSTYPE *pos;  // Position array in a block
@@ -279,6 +302,8 @@ typedef struct {
   // removed in future implementation for saving
   // space (emmmm... actually we don't need
   // to remove it for experimental evaluations).
+  PosRun *runs;  // runNum runs and a {0, length} sentinel, NULL: too many runs
+  int runNum;
   int length;
 } pos_block;
 
@@ -290,22 +315,120 @@ typedef struct {
 
 
 
+// Zone maps: min/max code of every ZONE_ROWS consecutive rows, a scan decides
+// a zone lying entirely inside or outside the predicate without filter vectors
+#define ZONE_ROWS 65536
+#define ZONE_WORDS (ZONE_ROWS / BITSWIDTH)
+
+typedef struct {
+  CODE min, max;
+} Zone;
+
 typedef struct {
   Area *areas[K];
   BITS *filterVectors[K - 1];
+  BITS *fvReplicas[MAX_NUMA_NODES][K - 1];  // Per-node copies of hot filter vectors, NULL: not replicated
+  int fvHits[K - 1];                        // Times each filter vector has been copied by a scan
   POSTYPE area_counts[K];  // Counts of values contained in the first i areas
+  Zone *zones;             // ROUNDUP_DIVIDE(length, ZONE_ROWS) used, zoneCapacity allocated
+  int zoneCapacity;
   POSTYPE length;
 } BinDex;
 
+/*
+  NUMA placement
+*/
+Topology topology;
+MEM_POLICY fv_mem_policy = MEM_LOCAL;      // Placement of filter vectors
+MEM_POLICY bitmap_mem_policy = MEM_LOCAL;  // Placement of result bitmaps
+int fv_mem_node = 0;                       // Node for MEM_BIND
+int bitmap_mem_node = 0;
+
+/*
+  Page sizes, filter vectors, result bitmaps and the pos/val arrays of the
+  position blocks can be backed by huge pages to cut TLB misses of random refine
+*/
+PageAllocator page_allocator;
+PAGE_POLICY page_policy = PAGE_NORMAL;
+SlabPool block_pool(blockMaxSize * (sizeof(POSTYPE) > sizeof(CODE) ? sizeof(POSTYPE) : sizeof(CODE)), 32UL << 20);
+
+void *placed_alloc(size_t bytes, MEM_POLICY mem_policy, int node) {
+  void *p = page_allocator.alloc(bytes, page_policy);
+  assert(p);
+  numa_place(p, bytes, mem_policy, node, topology);
+  return p;
+}
+
+BITS *alloc_filter_vector(int bitmap_len) {
+  return (BITS *)placed_alloc(bitmap_len * sizeof(BITS), fv_mem_policy, fv_mem_node);
+}
+
+BITS *alloc_bitmap(int bitmap_len) {
+  return (BITS *)placed_alloc(bitmap_len * sizeof(BITS), bitmap_mem_policy, bitmap_mem_node);
+}
+
+// Release filter vectors and bitmaps from alloc_filter_vector(..)/alloc_bitmap(..)
+void free_bitmap(BITS *bitmap) { page_allocator.release(bitmap); }
+
+void free_fv_replicas(BinDex *bindex, int k) {
+  for (int node = 0; node < MAX_NUMA_NODES; node++) {
+    free_bitmap(bindex->fvReplicas[node][k]);
+    bindex->fvReplicas[node][k] = NULL;
+  }
+}
+
+void replicate_hot_filter_vectors(BinDex *bindex, int top_n) {
+  // Keep a copy of the top_n most copied filter vectors on every node, so
+  // copy workers read them locally. Must not run concurrently with scans on
+  // this bindex.
+  if (topology.node_num <= 1) return;
+  int order[K - 1];
+  for (int k = 0; k < K - 1; k++) order[k] = k;
+  std::stable_sort(order, order + K - 1, [bindex](int a, int b) { return bindex->fvHits[a] > bindex->fvHits[b]; });
+  int bitmap_len = bits_num_needed(bindex->length);
+  for (int i = 0; i < K - 1; i++) {
+    int k = order[i];
+    bool hot = i < top_n && bindex->fvHits[k] > 0;
+    if (!hot) {
+      free_fv_replicas(bindex, k);
+      continue;
+    }
+    if (bindex->fvReplicas[0][k]) continue;
+    for (int node = 0; node < topology.node_num; node++) {
+      BITS *replica = (BITS *)placed_alloc(bitmap_len * sizeof(BITS), MEM_BIND, node);
+      memcpy(replica, bindex->filterVectors[k], bitmap_len * sizeof(BITS));
+      bindex->fvReplicas[node][k] = replica;
+    }
+  }
+}
+
+void build_block_runs(pos_block *pb) {
+  // (Re)detect the runs of pb->pos, called whenever the positions change
+  free(pb->runs);
+  pb->runs = NULL;
+  int run_num = pb->length > 0;
+  for (int i = 1; i < pb->length; i++) run_num += pb->pos[i] != pb->pos[i - 1] + 1;
+  pb->runNum = run_num;
+  if ((long)run_num * RUN_MIN_LENGTH > pb->length) return;
+  pb->runs = (PosRun *)malloc((run_num + 1) * sizeof(PosRun));
+  int r = 0;
+  for (int i = 0; i < pb->length; i++) {
+    if (i == 0 || pb->pos[i] != pb->pos[i - 1] + 1) pb->runs[r++] = {pb->pos[i], i};
+  }
+  pb->runs[r] = {0, pb->length};
+}
+
 void init_pos_block(pos_block *pb, CODE *val_f, POSTYPE *pos_f, int n) {
   assert(n <= blockInitSize);
   pb->length = n;
-  pb->pos = (POSTYPE *)malloc(blockMaxSize * sizeof(POSTYPE));
-  pb->val = (CODE *)malloc(blockMaxSize * sizeof(CODE));
+  pb->pos = (POSTYPE *)block_pool.alloc();
+  pb->val = (CODE *)block_pool.alloc();
   for (int i = 0; i < n; i++) {
     pb->pos[i] = pos_f[i];
     pb->val[i] = val_f[i];
   }
+  pb->runs = NULL;
+  build_block_runs(pb);
 }
 
 CODE block_start_value(pos_block *pb) { return pb->val[0]; }
@@ -341,6 +464,7 @@ int insert_to_block(pos_block *pb, CODE *val_f, POSTYPE *pos_f, int n) {
     pb->pos[k--] = pos_f[j--];
   }
   pb->length = length_new;
+  build_block_runs(pb);
 
   if (DEBUG_TIME_COUNT) timer.commonGetEndTime(2);
   return flagNum;
@@ -399,9 +523,8 @@ int insert_to_block_without_val(pos_block *pb, CODE *val_f, POSTYPE *pos_f, int
     }
 
 
-
-
   pb->length = length_new;
+  build_block_runs(pb);
 
   if (DEBUG_TIME_COUNT) timer.commonGetEndTime(2);
   return flagNum;
@@ -438,6 +561,7 @@ void area_split_block(Area *area, int block_idx) {
   // Fill values into new block
   pos_block *pb_new = (pos_block *)malloc(sizeof(pos_block));
   init_pos_block(pb_new, pb_old->val + blockInitSize, pb_old->pos + blockInitSize, blockMaxSize - blockInitSize);
+  build_block_runs(pb_old);
 
   // Update blocks in area
   for (int i = area->blockNum; i > (block_idx + 1); i--) {
@@ -530,6 +654,24 @@ void display_area(Area *area) {
   }
 }
 
+void report_runs(BinDex *bindex, int column) {
+  // Share of the blocks refined by runs
+  int blocks = 0, run_blocks = 0;
+  long runs = 0, run_rows = 0;
+  for (int k = 0; k < K; k++) {
+    for (int b = 0; b < bindex->areas[k]->blockNum; b++) {
+      pos_block *pb = bindex->areas[k]->blocks[b];
+      blocks++;
+      if (!pb->runs) continue;
+      run_blocks++;
+      runs += pb->runNum;
+      run_rows += pb->length;
+    }
+  }
+  printf("[RUNS] column %d: %d/%d blocks as runs, %ld runs of %.1f rows on average\n", column, run_blocks, blocks,
+         runs, runs ? (double)run_rows / runs : 0.0);
+}
+
 void display_bindex(BinDex *bindex, CODE *raw_data) {
   for (int i = 0; i < K; i++) {
     printf("Area%d:\n", i);
@@ -573,11 +715,15 @@ int padding_fv_val_less(BITS *bitmap, POSTYPE length_old, const CODE *val_new, C
     result_bits_count = n;  // Too little new data, still not filled up,
     // return the number of actually appended bits
   }
+  // Readers of older versions load this word meanwhile, the new bits past
+  // their length are ORed in at once
+  BITS bits = 0;
   for (int i = 0; i < result_bits_count; i++) {
     if (val_new[i] < compare) {
-      bitmap[bitmap_insert_pos] += (1 << (padding - i - 1));
+      bits |= (1U << (padding - i - 1));
     }
   }
+  if (bits) __atomic_fetch_or(&bitmap[bitmap_insert_pos], bits, __ATOMIC_RELAXED);
   return result_bits_count;
 }
 
@@ -595,15 +741,38 @@ inline POSTYPE num_insert_to_area(POSTYPE *areaStartIdx, int k, int n) {
   }
 }
 
-CODE *data_sorted;
+void update_zones(Zone *zones, const CODE *data, POSTYPE from, POSTYPE n) {
+  // Fold rows [from, from + n) into their zones, data[i] is row from + i. A
+  // zone already holding rows is only widened
+  POSTYPE i = 0;
+  while (i < n) {
+    POSTYPE row = from + i;
+    int z = row / ZONE_ROWS;
+    POSTYPE end = (POSTYPE)std::min((long)n, (long)(z + 1) * ZONE_ROWS - from);
+    CODE lo = data[i], hi = data[i];
+    if (row % ZONE_ROWS) {
+      lo = std::min(lo, zones[z].min);
+      hi = std::max(hi, zones[z].max);
+    }
+    for (; i < end; i++) {
+      lo = std::min(lo, data[i]);
+      hi = std::max(hi, data[i]);
+    }
+    zones[z].min = lo;
+    zones[z].max = hi;
+  }
+}
+
 void init_bindex(BinDex *bindex, CODE *data, POSTYPE n) {
   bindex->length = n;
+  memset(bindex->fvReplicas, 0, sizeof(bindex->fvReplicas));
+  memset(bindex->fvHits, 0, sizeof(bindex->fvHits));
   POSTYPE avgAreaSize = n / K;
 
   CODE areaStartValues[K];
   POSTYPE areaStartIdx[K];
 
-  data_sorted = (CODE *)malloc(n * sizeof(CODE));  // Sorted codes
+  CODE *data_sorted = (CODE *)malloc(n * sizeof(CODE));  // Sorted codes
 
   POSTYPE *pos = argsort(data, n);
   for (int i = 0; i < n; i++) {
@@ -656,8 +825,7 @@ void init_bindex(BinDex *bindex, CODE *data, POSTYPE n) {
   for (int k = 0; k * THREAD_NUM < K - 1; k++) {
     for (int j = 0; j < THREAD_NUM && (k * THREAD_NUM + j) < (K - 1); j++) {
       // Malloc 2 times of space, prepared for future appending
-      bindex->filterVectors[k * THREAD_NUM + j] =
-          (BITS *)aligned_alloc(SIMD_ALIGEN, 2 * bits_num_needed(n) * sizeof(BITS));
+      bindex->filterVectors[k * THREAD_NUM + j] = alloc_filter_vector(2 * bits_num_needed(n));
       threads[j] = std::thread(set_fv_val_less, bindex->filterVectors[k * THREAD_NUM + j], data,
                                area_start_value(bindex->areas[k * THREAD_NUM + j + 1]), n);
     }
@@ -666,6 +834,20 @@ void init_bindex(BinDex *bindex, CODE *data, POSTYPE n) {
     }
   }
 
+  // Build the zone maps, 2 times of space as well
+  int zone_num = ROUNDUP_DIVIDE(n, ZONE_ROWS);
+  bindex->zoneCapacity = 2 * zone_num;
+  bindex->zones = (Zone *)malloc(bindex->zoneCapacity * sizeof(Zone));
+  int zones_per_thread = ROUNDUP_DIVIDE(zone_num, THREAD_NUM);
+  for (int j = 0; j < THREAD_NUM; j++) {
+    POSTYPE from = (POSTYPE)std::min((long)n, (long)j * zones_per_thread * ZONE_ROWS);
+    POSTYPE to = (POSTYPE)std::min((long)n, (long)(j + 1) * zones_per_thread * ZONE_ROWS);
+    threads[j] = std::thread(update_zones, bindex->zones, data + from, from, to - from);
+  }
+  for (int j = 0; j < THREAD_NUM; j++) {
+    threads[j].join();
+  }
+
   free(pos);
   free(data_sorted);
 }
@@ -714,7 +896,10 @@ void append_to_bindex(BinDex *bindex, CODE *new_data, POSTYPE n, CODE *raw_data)
     if (DEBUG_TIME_COUNT) timer.commonGetEndTime(4);
   }
 
-  // Append to the filter vectors
+  // Append to the filter vectors, replicas are rebuilt by the next replicate_hot_filter_vectors(..)
+  for (i = 0; i < K - 1; i++) {
+    free_fv_replicas(bindex, i);
+  }
   for (k = 0; k * THREAD_NUM < (K - 1); k++) {
     if (DEBUG_TIME_COUNT) timer.commonGetStartTime(6);
     for (j = 0; j < THREAD_NUM && (k * THREAD_NUM + j) < (K - 1); j++) {
@@ -728,12 +913,336 @@ void append_to_bindex(BinDex *bindex, CODE *new_data, POSTYPE n, CODE *raw_data)
     if (DEBUG_TIME_COUNT) timer.commonGetEndTime(6);
   }
 
+  int zone_num = ROUNDUP_DIVIDE(bindex->length + n, ZONE_ROWS);
+  if (zone_num > bindex->zoneCapacity) {
+    bindex->zoneCapacity = 2 * zone_num;
+    bindex->zones = (Zone *)realloc(bindex->zones, bindex->zoneCapacity * sizeof(Zone));
+  }
+  update_zones(bindex->zones, new_data, bindex->length, n);
+
   bindex->length += n;
 
   free(idx);
   if (DEBUG_TIME_COUNT) timer.commonGetEndTime(1);
 }
 
+/*
+  snapshot-isolated appends
+
+  Readers pin the current BinDex version and scan it as an ordinary BinDex,
+  while append_to_bindex_snapshot() builds the next version copy-on-write:
+  touched areas and blocks are cloned, untouched ones stay shared. Filter
+  vectors are shared too: an append writes whole words behind the old
+  length, except for the word holding the old last row, whose new bits are
+  ORed in atomically while older readers may load it (those bits are past
+  their length). The zone maps are cloned whenever the old last zone is partly
+  filled, as its min/max change. Replaced objects are retired with the epoch of the version that
+  dropped them and freed once no pinned reader can still see them.
+*/
+#define MAX_SNAPSHOT_READERS 128
+
+enum RETIRED_KIND {
+  RETIRED_BINDEX = 0,  // BinDex struct of an old version
+  RETIRED_AREA,        // Area struct, its blocks are retired separately
+  RETIRED_BLOCK,       // pos_block with its pos/val arrays
+  RETIRED_FV,          // filter vector replaced by a larger one
+  RETIRED_ZONES,       // zone map array replaced by a larger one
+};
+
+typedef struct {
+  void *ptr;
+  RETIRED_KIND kind;
+  uint64_t epoch;  // Reclaimable once every pinned reader is at this epoch
+} retired_obj;
+
+struct VersionedBinDex {
+  std::atomic<BinDex *> current;
+  std::atomic<uint64_t> epoch;
+  std::atomic<uint64_t> reader_epochs[MAX_SNAPSHOT_READERS];  // 0: free slot
+  std::mutex writer_lock;                                      // Appends are serialized
+  std::vector<retired_obj> retired;
+  POSTYPE fv_capacity;  // Bits each (shared) filter vector can hold
+};
+
+void free_pos_block(pos_block *pb);
+void free_area(Area *area);
+
+void init_versioned_bindex(VersionedBinDex *vb, CODE *data, POSTYPE n) {
+  BinDex *bindex = (BinDex *)malloc(sizeof(BinDex));
+  init_bindex(bindex, data, n);
+  vb->fv_capacity = 2 * bits_num_needed(n) * BITSWIDTH;  // init_bindex mallocs 2 times of space
+  vb->epoch.store(1);
+  for (int i = 0; i < MAX_SNAPSHOT_READERS; i++) {
+    vb->reader_epochs[i].store(0);
+  }
+  vb->current.store(bindex);
+}
+
+BinDex *bindex_pin(VersionedBinDex *vb, int *slot) {
+  // Announce the epoch before loading the version, so a writer that retires
+  // this version afterwards always sees the announcement
+  uint64_t e = vb->epoch.load();
+  // All slots taken: back off between sweeps, give up after about 10 s
+  useconds_t backoff = 1, waited = 0;
+  for (;;) {
+    for (int i = 0; i < MAX_SNAPSHOT_READERS; i++) {
+      uint64_t expected = 0;
+      if (vb->reader_epochs[i].compare_exchange_strong(expected, e)) {
+        *slot = i;
+        return vb->current.load();
+      }
+    }
+    if (waited > 10000000) {
+      printf("Error: no free snapshot reader slot out of %d\n", MAX_SNAPSHOT_READERS);
+      exit(-1);
+    }
+    usleep(backoff);
+    waited += backoff;
+    backoff = std::min(backoff * 2, (useconds_t)1000);
+  }
+}
+
+void bindex_unpin(VersionedBinDex *vb, int slot) { vb->reader_epochs[slot].store(0); }
+
+void free_retired(retired_obj *obj) {
+  switch (obj->kind) {
+    case RETIRED_BLOCK:
+      free_pos_block((pos_block *)obj->ptr);
+      break;
+    case RETIRED_FV:
+      free_bitmap((BITS *)obj->ptr);
+      break;
+    default:
+      free(obj->ptr);
+  }
+}
+
+int reclaim_retired(VersionedBinDex *vb) {
+  // Must be called with writer_lock held, return the number of freed objects
+  uint64_t min_epoch = vb->epoch.load();
+  for (int i = 0; i < MAX_SNAPSHOT_READERS; i++) {
+    uint64_t e = vb->reader_epochs[i].load();
+    if (e && e < min_epoch) min_epoch = e;
+  }
+  int freed = 0;
+  size_t kept = 0;
+  for (size_t i = 0; i < vb->retired.size(); i++) {
+    if (vb->retired[i].epoch <= min_epoch) {
+      free_retired(&vb->retired[i]);
+      freed++;
+    } else {
+      vb->retired[kept++] = vb->retired[i];
+    }
+  }
+  vb->retired.resize(kept);
+  return freed;
+}
+
+pos_block *new_pos_block(CODE *val_f, POSTYPE *pos_f, int n) {
+  // Like init_pos_block(..), but a merged block may be filled up to blockMaxSize
+  assert(n <= blockMaxSize);
+  pos_block *pb = (pos_block *)malloc(sizeof(pos_block));
+  pb->length = n;
+  pb->pos = (POSTYPE *)block_pool.alloc();
+  pb->val = (CODE *)block_pool.alloc();
+  memcpy(pb->pos, pos_f, n * sizeof(POSTYPE));
+  memcpy(pb->val, val_f, n * sizeof(CODE));
+  pb->runs = NULL;
+  build_block_runs(pb);
+  return pb;
+}
+
+void merge_block_cow(Area *area, pos_block *pb, CODE *val_f, POSTYPE *pos_f, int n) {
+  // Merge a shared block with sorted new values into freshly allocated blocks
+  // appended to 'area', pb itself is never modified
+  int total = pb->length + n;
+  CODE *val = (CODE *)malloc(total * sizeof(CODE));
+  POSTYPE *pos = (POSTYPE *)malloc(total * sizeof(POSTYPE));
+  int i = 0, j = 0, k = 0;
+  while (i < pb->length && j < n) {
+    if (val_f[j] < pb->val[i]) {
+      val[k] = val_f[j];
+      pos[k++] = pos_f[j++];
+    } else {
+      val[k] = pb->val[i];
+      pos[k++] = pb->pos[i++];
+    }
+  }
+  for (; i < pb->length; i++, k++) {
+    val[k] = pb->val[i];
+    pos[k] = pb->pos[i];
+  }
+  for (; j < n; j++, k++) {
+    val[k] = val_f[j];
+    pos[k] = pos_f[j];
+  }
+
+  int piece_num = total <= blockMaxSize ? 1 : ROUNDUP_DIVIDE(total, blockInitSize);
+  int start = 0;
+  for (int p = 0; p < piece_num; p++) {
+    int end = (int)((long)total * (p + 1) / piece_num);
+    assert(area->blockNum < blockNumMax);
+    area->blocks[area->blockNum++] = new_pos_block(val + start, pos + start, end - start);
+    start = end;
+  }
+  free(val);
+  free(pos);
+}
+
+void insert_to_area_cow(Area *old_area, Area **new_area, CODE *val, POSTYPE *pos, int n,
+                        std::vector<pos_block *> *replaced) {
+  // Build a new version of 'old_area' containing n more sorted values, blocks
+  // receiving no value are shared with the old version
+  Area *area = (Area *)malloc(sizeof(Area));
+  area->blockNum = 0;
+  area->length = old_area->length + n;
+  int i = 0;
+  for (int b = 0; b < old_area->blockNum; b++) {
+    pos_block *pb = old_area->blocks[b];
+    int start = i;
+    if (b == old_area->blockNum - 1) {
+      i = n;
+    } else {
+      while (i < n && val[i] < block_start_value(old_area->blocks[b + 1])) i++;
+    }
+    if (i == start) {
+      assert(area->blockNum < blockNumMax);
+      area->blocks[area->blockNum++] = pb;
+      continue;
+    }
+    merge_block_cow(area, pb, val + start, pos + start, i - start);
+    replaced->push_back(pb);
+  }
+  *new_area = area;
+}
+
+void append_to_bindex_snapshot(VersionedBinDex *vb, CODE *new_data, POSTYPE n, CODE *raw_data) {
+  // Same result as append_to_bindex(..), but the pinned versions stay intact
+  if (DEBUG_TIME_COUNT) append_timer.commonGetStartTime(1);
+  lock_guard<mutex> lock(vb->writer_lock);
+  BinDex *old = vb->current.load();
+  BinDex *bindex = (BinDex *)malloc(sizeof(BinDex));
+  memcpy(bindex, old, sizeof(BinDex));
+
+  POSTYPE *idx = argsort(new_data, n);
+  CODE *data_sorted = (CODE *)malloc(n * sizeof(CODE));
+  POSTYPE *new_pos = (POSTYPE *)malloc(n * sizeof(POSTYPE));
+  POSTYPE areaStartIdx[K];
+  areaStartIdx[0] = 0;
+  int k = 1;
+  for (POSTYPE i = 0; i < n; i++) {
+    data_sorted[i] = new_data[idx[i]];
+    new_pos[i] = idx[i] + old->length;
+    raw_data[old->length + i] = new_data[i];  // Invisible to readers of old versions
+    while (k < K && data_sorted[i] >= area_start_value(old->areas[k])) {
+      areaStartIdx[k++] = i;
+    }
+  }
+  while (k < K) {
+    areaStartIdx[k++] = n;
+  }
+
+  // Update the touched areas
+  std::thread threads[THREAD_NUM];
+  std::vector<pos_block *> replaced[K];
+  int accum_add_count = 0;
+  for (k = 0; k * THREAD_NUM < K; k++) {
+    for (int j = 0; j < THREAD_NUM && (k * THREAD_NUM + j) < K; j++) {
+      int i = k * THREAD_NUM + j;
+      int num_added = num_insert_to_area(areaStartIdx, i, n);
+      accum_add_count += num_added;
+      bindex->area_counts[i] += accum_add_count;
+      if (num_added) {
+        threads[j] = std::thread(insert_to_area_cow, old->areas[i], &bindex->areas[i], data_sorted + areaStartIdx[i],
+                                 new_pos + areaStartIdx[i], num_added, &replaced[i]);
+      }
+    }
+    for (int j = 0; j < THREAD_NUM && (k * THREAD_NUM + j) < K; j++) {
+      if (threads[j].joinable()) threads[j].join();
+    }
+  }
+
+  // Grow the filter vectors if needed, then append to them
+  std::vector<BITS *> replaced_fv;
+  if (old->length + n > vb->fv_capacity) {
+    POSTYPE capacity = ROUNDUP(2 * bits_num_needed(old->length + n), SIMD_JOB_UNIT) * BITSWIDTH;
+    for (int i = 0; i < K - 1; i++) {
+      bindex->filterVectors[i] = alloc_filter_vector(capacity / BITSWIDTH);
+      memcpy(bindex->filterVectors[i], old->filterVectors[i], bits_num_needed(old->length) * sizeof(BITS));
+      replaced_fv.push_back(old->filterVectors[i]);
+    }
+    vb->fv_capacity = capacity;
+  }
+  for (int node = 0; node < MAX_NUMA_NODES; node++) {
+    for (int i = 0; i < K - 1; i++) {
+      if (bindex->fvReplicas[node][i]) replaced_fv.push_back(bindex->fvReplicas[node][i]);
+      bindex->fvReplicas[node][i] = NULL;
+    }
+  }
+  for (k = 0; k * THREAD_NUM < (K - 1); k++) {
+    for (int j = 0; j < THREAD_NUM && (k * THREAD_NUM + j) < (K - 1); j++) {
+      int i = k * THREAD_NUM + j;
+      threads[j] = std::thread(append_fv_val_less, bindex->filterVectors[i], old->length, new_data,
+                               area_start_value(bindex->areas[i + 1]), n);
+    }
+    for (int j = 0; j < THREAD_NUM && (k * THREAD_NUM + j) < (K - 1); j++) {
+      threads[j].join();
+    }
+  }
+
+  // Zones are shared while the append starts a new zone, old readers never
+  // look past their length. A partly filled last zone is widened in a copy.
+  int zone_num = ROUNDUP_DIVIDE(old->length + n, ZONE_ROWS);
+  if (zone_num > old->zoneCapacity || old->length % ZONE_ROWS) {
+    bindex->zoneCapacity = std::max(2 * zone_num, old->zoneCapacity);
+    bindex->zones = (Zone *)malloc(bindex->zoneCapacity * sizeof(Zone));
+    memcpy(bindex->zones, old->zones, ROUNDUP_DIVIDE(old->length, ZONE_ROWS) * sizeof(Zone));
+  }
+  update_zones(bindex->zones, new_data, old->length, n);
+  bindex->length = old->length + n;
+
+  // Publish, then retire what only the old versions can reach
+  vb->current.store(bindex);
+  uint64_t e = vb->epoch.fetch_add(1) + 1;
+  vb->retired.push_back({old, RETIRED_BINDEX, e});
+  for (int i = 0; i < K; i++) {
+    if (bindex->areas[i] == old->areas[i]) continue;
+    vb->retired.push_back({old->areas[i], RETIRED_AREA, e});
+    for (size_t b = 0; b < replaced[i].size(); b++) {
+      vb->retired.push_back({replaced[i][b], RETIRED_BLOCK, e});
+    }
+  }
+  for (size_t i = 0; i < replaced_fv.size(); i++) {
+    vb->retired.push_back({replaced_fv[i], RETIRED_FV, e});
+  }
+  if (bindex->zones != old->zones) vb->retired.push_back({old->zones, RETIRED_ZONES, e});
+  reclaim_retired(vb);
+
+  free(idx);
+  free(data_sorted);
+  free(new_pos);
+  if (DEBUG_TIME_COUNT) append_timer.commonGetEndTime(1);
+}
+
+void free_versioned_bindex(VersionedBinDex *vb) {
+  // No reader may be pinned any more
+  lock_guard<mutex> lock(vb->writer_lock);
+  for (size_t i = 0; i < vb->retired.size(); i++) {
+    free_retired(&vb->retired[i]);
+  }
+  vb->retired.clear();
+  BinDex *bindex = vb->current.load();
+  for (int i = 0; i < K - 1; i++) {
+    free_bitmap(bindex->filterVectors[i]);
+    free_fv_replicas(bindex, i);
+  }
+  for (int i = 0; i < K; i++) {
+    free_area(bindex->areas[i]);
+  }
+  free(bindex->zones);
+  free(bindex);
+}
+
 char *bin_repr(BITS x) {
   // Generate binary representation of a BITS variable
   int len = BITSWIDTH + BITSWIDTH / 4 + 1;
@@ -758,13 +1267,113 @@ void display_bitmap(BITS *bitmap, int bitmap_len) {
   }
 }
 
-void copy_bitmap(BITS *result, BITS *ref, int n, int t_id) {
+/*
+  per-query execution context
+
+  Everything a scan needs besides the BinDex and the result bitmap, so
+  queries issued by several client threads never share mutable state. The
+  workers of a query only use the cores granted to its context.
+*/
+typedef struct {
+  int thread_num;         // Number of workers of this query, <= THREAD_NUM
+  int cores[THREAD_NUM];  // Core worker t_id is pinned to, -1: not pinned
+  int prefetch_stride;    // Refine prefetch distance, 0: no prefetch
+} ScanContext;
+
+ScanContext default_scan_context() {
+  // One query owning the whole machine, worker t_id on core t_id * 2
+  ScanContext ctx;
+  ctx.thread_num = THREAD_NUM;
+  for (int t_id = 0; t_id < THREAD_NUM; t_id++) {
+    ctx.cores[t_id] = t_id * 2;
+  }
+  ctx.prefetch_stride = 6;
+  return ctx;
+}
+
+ScanContext default_ctx = default_scan_context();
+
+void pin_worker(const ScanContext *ctx, int t_id) {
+  if (ctx->cores[t_id] < 0) return;
   cpu_set_t mask;
   CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
+  CPU_SET(ctx->cores[t_id], &mask);
   if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
     fprintf(stderr, "set thread affinity failed\n");
   }
+}
+
+BITS *local_fv(BinDex *bindex, int k, const ScanContext *ctx, int t_id) {
+  // The copy of filter vector k on the node worker t_id runs on
+  BITS *replica = bindex->fvReplicas[topology.node_of_cpu(ctx->cores[t_id])][k];
+  return replica ? replica : bindex->filterVectors[k];
+}
+
+class QueryScheduler {
+  // Split a fixed set of cores between concurrent queries: a query arriving
+  // on an idle machine gets all cores (intra-query parallelism), with more
+  // queries in flight every query gets an equal share, down to one core each
+  // (inter-query parallelism). Cores are never shared by two queries.
+  public:
+
+  QueryScheduler(const int *core_list, int core_num) {
+    for (int i = 0; i < core_num; i++) {
+      cores.push_back(core_list[i]);
+      busy.push_back(false);
+    }
+    free_num = core_num;
+    active = 0;
+    waiting = 0;
+  }
+
+  void acquire(ScanContext *ctx) {
+    unique_lock<mutex> lock(schedLock);
+    waiting++;
+    schedCond.wait(lock, [this] { return free_num > 0; });
+    waiting--;
+    int share = std::max((int)cores.size() / (active + waiting + 1), 1);
+    share = std::min(std::min(share, free_num), THREAD_NUM);
+    ctx->thread_num = 0;
+    for (int i = 0; i < (int)cores.size() && ctx->thread_num < share; i++) {
+      if (busy[i]) continue;
+      busy[i] = true;
+      ctx->cores[ctx->thread_num++] = cores[i];
+    }
+    for (int t_id = ctx->thread_num; t_id < THREAD_NUM; t_id++) {
+      ctx->cores[t_id] = -1;
+    }
+    ctx->prefetch_stride = default_ctx.prefetch_stride;
+    free_num -= ctx->thread_num;
+    active++;
+  }
+
+  void release(ScanContext *ctx) {
+    {
+      lock_guard<mutex> lock(schedLock);
+      for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+        for (int i = 0; i < (int)cores.size(); i++) {
+          if (cores[i] == ctx->cores[t_id]) busy[i] = false;
+        }
+      }
+      free_num += ctx->thread_num;
+      active--;
+    }
+    schedCond.notify_all();
+  }
+
+  private:
+
+  vector<int> cores;
+  vector<bool> busy;
+  int free_num;
+  int active;   // Queries holding cores
+  int waiting;  // Queries waiting for cores
+  mutex schedLock;
+  condition_variable schedCond;
+};
+
+void copy_bitmap(BITS *result, BITS *ref, int n, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
   memcpy(result, ref, n * sizeof(BITS));
 
   // for (int i = 0; i < n; i++) {
@@ -772,17 +1381,12 @@ void copy_bitmap(BITS *result, BITS *ref, int n, int t_id) {
   // }
 }
 
-void copy_bitmap_not(BITS *result, BITS *ref, int start_n, int end_n, int t_id) {
-  int jobs = ROUNDUP_DIVIDE(end_n - start_n, THREAD_NUM);
+void copy_bitmap_not(BITS *result, BITS *ref, int start_n, int end_n, const ScanContext *ctx, int t_id) {
+  int jobs = ROUNDUP_DIVIDE(end_n - start_n, ctx->thread_num);
   int start = start_n + t_id * jobs;
   int end = start_n + (t_id + 1) * jobs;
   if (end > end_n) end = end_n;
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
+  pin_worker(ctx, t_id);
   // memcpy(result, ref, n * sizeof(BITS));
 
   // TODO: bitwise operation on large memory block?
@@ -791,18 +1395,13 @@ void copy_bitmap_not(BITS *result, BITS *ref, int start_n, int end_n, int t_id)
   }
 }
 
-void copy_bitmap_bt(BITS *result, BITS *ref_l, BITS *ref_r, int start_n, int end_n, int t_id) {
-  int jobs = ROUNDUP_DIVIDE(end_n - start_n, THREAD_NUM);
+void copy_bitmap_bt(BITS *result, BITS *ref_l, BITS *ref_r, int start_n, int end_n, const ScanContext *ctx, int t_id) {
+  int jobs = ROUNDUP_DIVIDE(end_n - start_n, ctx->thread_num);
   int start = start_n + t_id * jobs;
   int end = start_n + (t_id + 1) * jobs;
   if (end > end_n) end = end_n;
 
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
+  pin_worker(ctx, t_id);
   // memcpy(result, ref, n * sizeof(BITS));
 
   // TODO: bitwise operation on large memory block?
@@ -811,95 +1410,63 @@ void copy_bitmap_bt(BITS *result, BITS *ref_l, BITS *ref_r, int start_n, int end
   }
 }
 
-void copy_bitmap_bt_simd(BITS *to, BITS *from_l, BITS *from_r, int bitmap_len, int t_id) {
-  int jobs = ((bitmap_len / SIMD_JOB_UNIT - 1) / THREAD_NUM + 1) * SIMD_JOB_UNIT;
+void copy_bitmap_bt_simd(BITS *to, BITS *from_l, BITS *from_r, int bitmap_len, const ScanContext *ctx, int t_id) {
+  int jobs = ((bitmap_len / SIMD_JOB_UNIT - 1) / ctx->thread_num + 1) * SIMD_JOB_UNIT;
 
   assert(jobs % SIMD_JOB_UNIT == 0);
   assert(bitmap_len % SIMD_JOB_UNIT == 0);
-  assert(jobs * THREAD_NUM >= bitmap_len);
+  assert(jobs * ctx->thread_num >= bitmap_len);
 
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
+  pin_worker(ctx, t_id);
 
   int cur = t_id * jobs;
   int end = (t_id + 1) * jobs;
   if (end > bitmap_len) end = bitmap_len;
+  bool stream = bitmap_kernels.stream(bitmap_len * sizeof(BITS));
 
-  while (cur < end) {
-    __m256i buf_l = _mm256_load_si256((__m256i *)(from_l + cur));
-    __m256i buf_r = _mm256_load_si256((__m256i *)(from_r + cur));
-    __m256i buf = _mm256_andnot_si256(buf_l, buf_r);
-    _mm256_store_si256((__m256i *)(to + cur), buf);
-    cur += SIMD_JOB_UNIT;
-  }
+  if (cur < end) bitmap_kernels.andnot(to + cur, from_l + cur, from_r + cur, end - cur, stream);
 }
 
-void copy_bitmap_simd(BITS *to, BITS *from, int bitmap_len, int t_id) {
-  int jobs = ((bitmap_len / SIMD_JOB_UNIT - 1) / THREAD_NUM + 1) * SIMD_JOB_UNIT;
+void copy_bitmap_simd(BITS *to, BITS *from, int bitmap_len, const ScanContext *ctx, int t_id) {
+  int jobs = ((bitmap_len / SIMD_JOB_UNIT - 1) / ctx->thread_num + 1) * SIMD_JOB_UNIT;
 
   assert(jobs % SIMD_JOB_UNIT == 0);
   assert(bitmap_len % SIMD_JOB_UNIT == 0);
-  assert(jobs * THREAD_NUM >= bitmap_len);
+  assert(jobs * ctx->thread_num >= bitmap_len);
 
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
+  pin_worker(ctx, t_id);
 
   int cur = t_id * jobs;
   int end = (t_id + 1) * jobs;
   if (end > bitmap_len) end = bitmap_len;
+  bool stream = bitmap_kernels.stream(bitmap_len * sizeof(BITS));
 
-  while (cur < end) {
-    __m256i buf = _mm256_load_si256((__m256i *)(from + cur));
-    _mm256_store_si256((__m256i *)(to + cur), buf);
-    cur += SIMD_JOB_UNIT;
-  }
+  if (cur < end) bitmap_kernels.copy(to + cur, from + cur, NULL, end - cur, stream);
 }
 
-void copy_bitmap_not_simd(BITS *to, BITS *from, int bitmap_len, int t_id) {
-  int jobs = ((bitmap_len / SIMD_JOB_UNIT - 1) / THREAD_NUM + 1) * SIMD_JOB_UNIT;
+void copy_bitmap_not_simd(BITS *to, BITS *from, int bitmap_len, const ScanContext *ctx, int t_id) {
+  int jobs = ((bitmap_len / SIMD_JOB_UNIT - 1) / ctx->thread_num + 1) * SIMD_JOB_UNIT;
 
   assert(jobs % SIMD_JOB_UNIT == 0);
   assert(bitmap_len % SIMD_JOB_UNIT == 0);
-  assert(jobs * THREAD_NUM >= bitmap_len);
+  assert(jobs * ctx->thread_num >= bitmap_len);
 
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
+  pin_worker(ctx, t_id);
 
   int cur = t_id * jobs;
   int end = (t_id + 1) * jobs;
   if (end > bitmap_len) end = bitmap_len;
+  bool stream = bitmap_kernels.stream(bitmap_len * sizeof(BITS));
 
-  while (cur < end) {
-    __m256i buf = _mm256_load_si256((__m256i *)(from + cur));
-    buf = ~buf;
-    _mm256_store_si256((__m256i *)(to + cur), buf);
-    cur += SIMD_JOB_UNIT;
-  }
+  if (cur < end) bitmap_kernels.not_(to + cur, from + cur, NULL, end - cur, stream);
 }
 
-void memset_numa0(BITS *p, int val, int n, int t_id) {
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
-  int avg_workload = (n / (THREAD_NUM * SIMD_ALIGEN)) * SIMD_ALIGEN;
+void memset_numa0(BITS *p, int val, int n, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  int avg_workload = (n / (ctx->thread_num * SIMD_ALIGEN)) * SIMD_ALIGEN;
   int start = t_id * avg_workload;
   // int end = start + avg_workload;
-  int end = t_id == (THREAD_NUM - 1) ? n : start + avg_workload;
+  int end = t_id == (ctx->thread_num - 1) ? n : start + avg_workload;
   memset(p + start, val, (end - start) * sizeof(BITS));
   // if (t_id == THREAD_NUM) {
   //   BITS val_bits = 0U;
@@ -912,29 +1479,29 @@ void memset_numa0(BITS *p, int val, int n, int t_id) {
   // }
 }
 
-void memset_mt(BITS *p, int val, int n) {
+void memset_mt(BITS *p, int val, int n, const ScanContext *ctx = &default_ctx) {
   std::thread threads[THREAD_NUM];
-  for (int t_id = 0; t_id < THREAD_NUM; t_id++) {
-    threads[t_id] = std::thread(memset_numa0, p, val, n, t_id);
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(memset_numa0, p, val, n, ctx, t_id);
   }
-  for (int t_id = 0; t_id < THREAD_NUM; t_id++) {
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
     threads[t_id].join();
   }
 }
 
-void copy_filter_vector(BinDex *bindex, BITS *result, int k) {
+void copy_filter_vector(BinDex *bindex, BITS *result, int k, const ScanContext *ctx = &default_ctx) {
   std::thread threads[THREAD_NUM];
   int bitmap_len = bits_num_needed(bindex->length);
   // BITS* result = (BITS*)aligned_alloc(SIMD_ALIGEN, bitmap_len *
   // sizeof(BITS));
 
   if (k < 0) {
-    memset_mt(result, 0, bitmap_len);
+    memset_mt(result, 0, bitmap_len, ctx);
     return;
   }
 
   if (k >= (K - 1)) {
-    memset_mt(result, 0xFF, bitmap_len);  // Slower(?) than a loop
+    memset_mt(result, 0xFF, bitmap_len, ctx);  // Slower(?) than a loop
     return;
   }
 
@@ -948,42 +1515,37 @@ void copy_filter_vector(BinDex *bindex, BITS *result, int k) {
   // memcpy(result + mt_bitmap_n, bindex->filterVectors[k] + mt_bitmap_n,
   // bitmap_len - mt_bitmap_n);
 
-  // naive copy
-  int avg_workload = bitmap_len / THREAD_NUM;
-  int i;
-  for (i = 0; i < THREAD_NUM - 1; i++) {
-    threads[i] = std::thread(copy_bitmap, result + (i * avg_workload), bindex->filterVectors[k] + (i * avg_workload),
-                             avg_workload, i);
-  }
-  threads[i] = std::thread(copy_bitmap, result + (i * avg_workload), bindex->filterVectors[k] + (i * avg_workload),
-                           bitmap_len - (i * avg_workload), i);
-
-  for (i = 0; i < THREAD_NUM; i++) {
-    threads[i].join();
-  }
+  // simd copy
+  __sync_fetch_and_add(&bindex->fvHits[k], 1);
+  int mt_bitmap_n = (bitmap_len / SIMD_JOB_UNIT) * SIMD_JOB_UNIT;  // must be SIMD_JOB_UNIT aligened
+  for (int i = 0; i < ctx->thread_num; i++)
+    threads[i] = std::thread(copy_bitmap_simd, result, local_fv(bindex, k, ctx, i), mt_bitmap_n, ctx, i);
+  for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
+  memcpy(result + mt_bitmap_n, bindex->filterVectors[k] + mt_bitmap_n, (bitmap_len - mt_bitmap_n) * sizeof(BITS));
 }
 
-void copy_filter_vector_not(BinDex *bindex, BITS *result, int k) {
+void copy_filter_vector_not(BinDex *bindex, BITS *result, int k, const ScanContext *ctx = &default_ctx) {
   std::thread threads[THREAD_NUM];
   int bitmap_len = bits_num_needed(bindex->length);
   // BITS* result = (BITS*)aligned_alloc(SIMD_ALIGEN, bitmap_len *
   // sizeof(BITS));
 
   if (k < 0) {
-    memset_mt(result, 0xFF, bitmap_len);
+    memset_mt(result, 0xFF, bitmap_len, ctx);
     return;
   }
 
   if (k >= (K - 1)) {
-    memset_mt(result, 0, bitmap_len);  // Slower(?) than a loop
+    memset_mt(result, 0, bitmap_len, ctx);  // Slower(?) than a loop
     return;
   }
 
   // simd copy not
+  __sync_fetch_and_add(&bindex->fvHits[k], 1);
   int mt_bitmap_n = (bitmap_len / SIMD_JOB_UNIT) * SIMD_JOB_UNIT;  // must be SIMD_JOB_UNIT aligened
-  for (int i = 0; i < THREAD_NUM; i++)
-    threads[i] = std::thread(copy_bitmap_not_simd, result, bindex->filterVectors[k], mt_bitmap_n, i);
-  for (int i = 0; i < THREAD_NUM; i++) threads[i].join();
+  for (int i = 0; i < ctx->thread_num; i++)
+    threads[i] = std::thread(copy_bitmap_not_simd, result, local_fv(bindex, k, ctx, i), mt_bitmap_n, ctx, i);
+  for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
   for (int i = 0; i < bitmap_len - mt_bitmap_n; i++) {
     (result + mt_bitmap_n)[i] = ~((bindex->filterVectors[k] + mt_bitmap_n)[i]);
   }
@@ -1002,7 +1564,7 @@ void copy_filter_vector_not(BinDex *bindex, BITS *result, int k) {
   return;
 }
 
-void copy_filter_vector_bt(BinDex *bindex, BITS *result, int kl, int kr) {
+void copy_filter_vector_bt(BinDex *bindex, BITS *result, int kl, int kr, const ScanContext *ctx = &default_ctx) {
   std::thread threads[THREAD_NUM];
   int bitmap_len = bits_num_needed(bindex->length);
 
@@ -1010,32 +1572,34 @@ void copy_filter_vector_bt(BinDex *bindex, BITS *result, int kl, int kr) {
   if (kr < 0) {
     // assert(0);
     // printf("1\n");
-    memset_mt(result, 0, bitmap_len);
+    memset_mt(result, 0, bitmap_len, ctx);
     return;
   } else if (kr >= (K - 1)) {
     // assert(0);
     // printf("2\n");
-    copy_filter_vector_not(bindex, result, kl);
+    copy_filter_vector_not(bindex, result, kl, ctx);
     return;
   }
   if (kl < 0) {
     // assert(0);
     // printf("3\n");
-    copy_filter_vector(bindex, result, kr);
+    copy_filter_vector(bindex, result, kr, ctx);
     return;
   } else if (kl >= (K - 1)) {
     // assert(0);
     // printf("4\n");
-    memset_mt(result, 0, bitmap_len);  // Slower(?) than a loop
+    memset_mt(result, 0, bitmap_len, ctx);  // Slower(?) than a loop
     return;
   }
 
   // simd copy_bt
+  __sync_fetch_and_add(&bindex->fvHits[kl], 1);
+  __sync_fetch_and_add(&bindex->fvHits[kr], 1);
   int mt_bitmap_n = (bitmap_len / SIMD_JOB_UNIT) * SIMD_JOB_UNIT;  // must be SIMD_JOB_UNIT aligened
-  for (int i = 0; i < THREAD_NUM; i++)
-    threads[i] =
-        std::thread(copy_bitmap_bt_simd, result, bindex->filterVectors[kl], bindex->filterVectors[kr], mt_bitmap_n, i);
-  for (int i = 0; i < THREAD_NUM; i++) threads[i].join();
+  for (int i = 0; i < ctx->thread_num; i++)
+    threads[i] = std::thread(copy_bitmap_bt_simd, result, local_fv(bindex, kl, ctx, i), local_fv(bindex, kr, ctx, i),
+                             mt_bitmap_n, ctx, i);
+  for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
   for (int i = 0; i < bitmap_len - mt_bitmap_n; i++) {
     (result + mt_bitmap_n)[i] =
         (~((bindex->filterVectors[kl] + mt_bitmap_n)[i])) & ((bindex->filterVectors[kr] + mt_bitmap_n)[i]);
@@ -1054,35 +1618,26 @@ void copy_filter_vector_bt(BinDex *bindex, BITS *result, int kl, int kr) {
 }
 
 void copy_bitmap_xor_simd(BITS *to, BITS *bitmap1, BITS *bitmap2,
-                          int bitmap_len, int t_id) {
+                          int bitmap_len, const ScanContext *ctx, int t_id) {
   int jobs =
-      ((bitmap_len / SIMD_JOB_UNIT - 1) / THREAD_NUM + 1) * SIMD_JOB_UNIT;
+      ((bitmap_len / SIMD_JOB_UNIT - 1) / ctx->thread_num + 1) * SIMD_JOB_UNIT;
 
   assert(jobs % SIMD_JOB_UNIT == 0);
   assert(bitmap_len % SIMD_JOB_UNIT == 0);
-  assert(jobs * THREAD_NUM >= bitmap_len);
+  assert(jobs * ctx->thread_num >= bitmap_len);
 
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
+  pin_worker(ctx, t_id);
 
   int cur = t_id * jobs;
   int end = (t_id + 1) * jobs;
   if (end > bitmap_len) end = bitmap_len;
+  bool stream = bitmap_kernels.stream(bitmap_len * sizeof(BITS));
 
-  while (cur < end) {
-    __m256i buf1 = _mm256_load_si256((__m256i *)(bitmap1 + cur));
-    __m256i buf2 = _mm256_load_si256((__m256i *)(bitmap2 + cur));
-    __m256i buf = _mm256_andnot_si256(buf1, buf2);
-    _mm256_store_si256((__m256i *)(to + cur), buf);
-    cur += SIMD_JOB_UNIT;
-  }
+  // fv kl is a subset of fv kr, so xor == andnot
+  if (cur < end) bitmap_kernels.andnot(to + cur, bitmap1 + cur, bitmap2 + cur, end - cur, stream);
 }
 
-void copy_filter_vector_xor(BinDex *bindex, BITS *result, int kl, int kr) {
+void copy_filter_vector_xor(BinDex *bindex, BITS *result, int kl, int kr, const ScanContext *ctx = &default_ctx) {
   std::thread threads[THREAD_NUM];
   int bitmap_len = bits_num_needed(bindex->length);
 
@@ -1090,34 +1645,36 @@ void copy_filter_vector_xor(BinDex *bindex, BITS *result, int kl, int kr) {
   if (kr < 0) {
     assert(0);
     // printf("1\n");
-    memset_mt(result, 0, bitmap_len);
+    memset_mt(result, 0, bitmap_len, ctx);
     return;
   } else if (kr >= (K - 1)) {
     assert(0);
     // printf("2\n");
-    copy_filter_vector_not(bindex, result, kl);
+    copy_filter_vector_not(bindex, result, kl, ctx);
     return;
   }
   if (kl < 0) {
     // assert(0);
     // printf("3\n");
-    copy_filter_vector(bindex, result, kr);
+    copy_filter_vector(bindex, result, kr, ctx);
     return;
   } else if (kl >= (K - 1)) {
     assert(0);
     // printf("4\n");
-    memset_mt(result, 0, bitmap_len);  // Slower(?) than a loop
+    memset_mt(result, 0, bitmap_len, ctx);  // Slower(?) than a loop
     return;
   }
 
   // simd copy_xor
+  __sync_fetch_and_add(&bindex->fvHits[kl], 1);
+  __sync_fetch_and_add(&bindex->fvHits[kr], 1);
   int mt_bitmap_n = (bitmap_len / SIMD_JOB_UNIT) *
                     SIMD_JOB_UNIT;  // must be SIMD_JOB_UNIT aligened
-  for (int i = 0; i < THREAD_NUM; i++)
+  for (int i = 0; i < ctx->thread_num; i++)
     threads[i] =
-        std::thread(copy_bitmap_xor_simd, result, bindex->filterVectors[kl],
-                    bindex->filterVectors[kr], mt_bitmap_n, i);
-  for (int i = 0; i < THREAD_NUM; i++) threads[i].join();
+        std::thread(copy_bitmap_xor_simd, result, local_fv(bindex, kl, ctx, i),
+                    local_fv(bindex, kr, ctx, i), mt_bitmap_n, ctx, i);
+  for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
   for (int i = 0; i < bitmap_len - mt_bitmap_n; i++) {
     (result + mt_bitmap_n)[i] = ((bindex->filterVectors[kl] + mt_bitmap_n)[i]) ^
                                 ((bindex->filterVectors[kr] + mt_bitmap_n)[i]);
@@ -1222,26 +1779,70 @@ void refine_positions(BITS *bitmap, POSTYPE *pos, POSTYPE n) {
   }
 }
 
-void refine_positions_mt(BITS *bitmap, Area *area, int start_blk_idx, int end_blk_idx, int t_id) {
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
+template <class WORD>
+inline void for_each_row_word(POSTYPE start, POSTYPE n, WORD word) {
+  // word(w, mask) for the bitmap words covering the rows [start, start + n)
+  POSTYPE end = start + n;
+  while (start < end) {
+    int w = start >> BITSSHIFT;
+    int lo = start % BITSWIDTH;
+    int hi = (int)std::min((long)BITSWIDTH, (long)end - (long)w * BITSWIDTH);
+    word(w, hi - lo == BITSWIDTH ? ~0U : ((1U << (hi - lo)) - 1) << (BITSWIDTH - hi));
+    start = w * BITSWIDTH + hi;
   }
-  int jobs = ROUNDUP_DIVIDE(end_blk_idx - start_blk_idx, THREAD_NUM);
-  int cur = start_blk_idx + t_id * jobs;
-  int end = start_blk_idx + (t_id + 1) * jobs;
+}
+
+inline void refine_rows(BITS *bitmap, POSTYPE start, POSTYPE n) {
+  // Flip the rows [start, start + n) a word at a time. Atomic, as border
+  // words are shared with other runs and overlapping segments of a range
+  // scan may flip the same run twice
+  for_each_row_word(start, n, [bitmap](int w, BITS mask) { __atomic_fetch_xor(&bitmap[w], mask, __ATOMIC_RELAXED); });
+}
+
+template <class FLIP>
+void for_each_run(const pos_block *pb, int from, int to, FLIP flip) {
+  // flip(start, n) for the row runs of the block-local indexes [from, to),
+  // pb->runs must be set
+  const PosRun *runs = pb->runs;
+  int r = std::upper_bound(runs, runs + pb->runNum, from, [](int v, const PosRun &run) { return v < run.offset; }) -
+          runs - 1;
+  for (; r < pb->runNum && runs[r].offset < to; r++) {
+    int lo = std::max(from, runs[r].offset), hi = std::min(to, runs[r + 1].offset);
+    flip(runs[r].start + (lo - runs[r].offset), (POSTYPE)(hi - lo));
+  }
+}
+
+void refine_block(BITS *bitmap, const pos_block *pb, int from, int to) {
+  // Flip the positions pb->pos[from, to), by runs when the block has them
+  if (pb->runs) {
+    for_each_run(pb, from, to, [bitmap](POSTYPE start, POSTYPE n) { refine_rows(bitmap, start, n); });
+    return;
+  }
+  for (int i = from; i < to; i++) {
+    POSTYPE pos = pb->pos[i];
+    __sync_fetch_and_xor(&bitmap[pos >> BITSSHIFT], (1U << (BITSWIDTH - 1 - pos % BITSWIDTH)));
+  }
+}
+
+void refine_positions_mt(BITS *bitmap, Area *area, int start_blk_idx, int end_blk_idx, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  int jobs = ROUNDUP_DIVIDE(end_blk_idx - start_blk_idx, ctx->thread_num);
+  int cur = start_blk_idx + t_id * jobs;
+  int end = start_blk_idx + (t_id + 1) * jobs;
   if (end > end_blk_idx) end = end_blk_idx;
 
-  // int prefetch_stride = 6;
   while (cur < end) {
+    if (area->blocks[cur]->runs) {
+      refine_block(bitmap, area->blocks[cur], 0, area->blocks[cur]->length);
+      cur++;
+      continue;
+    }
     POSTYPE *pos_list = area->blocks[cur]->pos;
     POSTYPE n = area->blocks[cur]->length;
     int i;
-    for (i = 0; i + prefetch_stride < n; i++) {
-      if(prefetch_stride) {
-        __builtin_prefetch(&bitmap[*(pos_list + i + prefetch_stride) >> BITSSHIFT], 1, 1);
+    for (i = 0; i + ctx->prefetch_stride < n; i++) {
+      if(ctx->prefetch_stride) {
+        __builtin_prefetch(&bitmap[*(pos_list + i + ctx->prefetch_stride) >> BITSSHIFT], 1, 1);
       }
       POSTYPE pos = *(pos_list + i);
       __sync_fetch_and_xor(&bitmap[pos >> BITSSHIFT], (1U << (BITSWIDTH - 1 - pos % BITSWIDTH)));
@@ -1256,17 +1857,11 @@ void refine_positions_mt(BITS *bitmap, Area *area, int start_blk_idx, int end_bl
 }
 
 
-void refine_result_bitmap(BITS *bitmap_a, BITS *bitmap_b, int start_idx, int end_idx, int t_id) {
+void refine_result_bitmap(BITS *bitmap_a, BITS *bitmap_b, int start_idx, int end_idx, const ScanContext *ctx, int t_id) {
 
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
-  // int prefetch_stride = 6;
+  pin_worker(ctx, t_id);
   int i;
-  for (i = start_idx; i + prefetch_stride < end_idx; i++) {
+  for (i = start_idx; i + ctx->prefetch_stride < end_idx; i++) {
     /* if(prefetch_stride) {
       __builtin_prefetch(&bitmap_a[*(pos_list + i + prefetch_stride) >> BITSSHIFT], 1, 1);
     } */
@@ -1280,18 +1875,44 @@ void refine_result_bitmap(BITS *bitmap_a, BITS *bitmap_b, int start_idx, int end
 
 }
 
-void xor_bitmap_mt(BITS *bitmap, BITS *bitmap1, BITS *bitmap2, int start_n, int end_n, int t_id) {
-  int jobs = ROUNDUP_DIVIDE(end_n - start_n, THREAD_NUM);
+void merge_worker(BITS *to, BITS **bitmaps, const int *order, int k, bool is_or, int bitmap_len,
+                  const ScanContext *ctx, int t_id) {
+  // Each worker owns a MERGE_CHUNK_WORDS aligned share, no atomics needed
+  int jobs = ROUNDUP_DIVIDE(ROUNDUP_DIVIDE(bitmap_len, MERGE_CHUNK_WORDS), ctx->thread_num) * MERGE_CHUNK_WORDS;
+  pin_worker(ctx, t_id);
+  int cur = t_id * jobs;
+  int end = std::min((t_id + 1) * jobs, bitmap_len);
+  if (cur >= end) return;
+  const uint32_t *srcs[MAX_BINDEX_NUM];
+  for (int i = 0; i < k; i++) srcs[i] = bitmaps[order[i]] + cur;
+  (is_or ? bitmap_kernels.or_merge : bitmap_kernels.and_merge)(to + cur, srcs, k, end - cur);
+}
+
+void bitmap_merge(BITS *to, BITS **bitmaps, const POSTYPE *counts, int k, POSTYPE n, bool is_or,
+                  const ScanContext *ctx = &default_ctx) {
+  // AND (OR) of k bitmaps in one pass. counts are estimated selected rows of
+  // each bitmap, the sparsest (densest) one is read first so chunks it
+  // already decides skip the others.
+  assert(k >= 1 && k <= MAX_BINDEX_NUM);
+  int order[MAX_BINDEX_NUM];
+  for (int i = 0; i < k; i++) order[i] = i;
+  std::stable_sort(order, order + k, [counts, is_or](int a, int b) {
+    return is_or ? counts[a] > counts[b] : counts[a] < counts[b];
+  });
+  std::thread threads[THREAD_NUM];
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(merge_worker, to, bitmaps, order, k, is_or, bits_num_needed(n), ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+}
+
+void xor_bitmap_mt(BITS *bitmap, BITS *bitmap1, BITS *bitmap2, int start_n, int end_n, const ScanContext *ctx, int t_id) {
+  int jobs = ROUNDUP_DIVIDE(end_n - start_n, ctx->thread_num);
   int start = start_n + t_id * jobs;
   int end = start_n + (t_id + 1) * jobs;
   if (end > end_n) end = end_n;
 
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
+  pin_worker(ctx, t_id);
 
   // TODO: bitwise operation on large memory block?
   for (int i = start; i < end; i++) {
@@ -1299,15 +1920,10 @@ void xor_bitmap_mt(BITS *bitmap, BITS *bitmap1, BITS *bitmap2, int start_n, int
   }
 }
 
-void set_eq_bitmap_mt(BITS *bitmap, Area *area, CODE compare, int start_blk_idx, int end_blk_idx, int t_id) {
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
+void set_eq_bitmap_mt(BITS *bitmap, Area *area, CODE compare, int start_blk_idx, int end_blk_idx, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
 
-  int jobs = ROUNDUP_DIVIDE(end_blk_idx - start_blk_idx, THREAD_NUM);
+  int jobs = ROUNDUP_DIVIDE(end_blk_idx - start_blk_idx, ctx->thread_num);
   int start = start_blk_idx + t_id * jobs;
   int end = start_blk_idx + (t_id + 1) * jobs;
   if (end > end_blk_idx) end = end_blk_idx;
@@ -1328,20 +1944,20 @@ void set_eq_bitmap_mt(BITS *bitmap, Area *area, CODE compare, int start_blk_idx,
 }
 
 void refine_positions_in_blks_mt(BITS *bitmap, Area *area, int start_blk_idx,
-                                 int end_blk_idx, int t_id) {
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
-  }
-  int jobs = ROUNDUP_DIVIDE(end_blk_idx - start_blk_idx, THREAD_NUM);
+                                 int end_blk_idx, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  int jobs = ROUNDUP_DIVIDE(end_blk_idx - start_blk_idx, ctx->thread_num);
   int cur = start_blk_idx + t_id * jobs;
   int end = start_blk_idx + (t_id + 1) * jobs;
   if (end > end_blk_idx) end = end_blk_idx;
 
   int prefetch_stride = 6;
   while (cur < end) {
+    if (area->blocks[cur]->runs) {
+      refine_block(bitmap, area->blocks[cur], 0, area->blocks[cur]->length);
+      cur++;
+      continue;
+    }
     POSTYPE *pos_list = area->blocks[cur]->pos;
     POSTYPE n = area->blocks[cur]->length;
     int i;
@@ -1362,14 +1978,14 @@ void refine_positions_in_blks_mt(BITS *bitmap, Area *area, int start_blk_idx,
   }
 }
 
-void bindex_scan_lt(BinDex *bindex, BITS *result, CODE compare) {
+void bindex_scan_lt(BinDex *bindex, BITS *result, CODE compare, const ScanContext *ctx = &default_ctx) {
   std::thread threads[THREAD_NUM];
   int bitmap_len = bits_num_needed(bindex->length);
   int area_idx = in_which_area(bindex, compare);
   if (area_idx < 0) {
     // 'compare' less than all raw_data, return all zero result
     // BITS* result = (BITS*)malloc(sizeof(BITS) * bitmap_len);
-    memset_mt(result, 0, bitmap_len);
+    memset_mt(result, 0, bitmap_len, ctx);
     return;
   }
   Area *area = bindex->areas[area_idx];
@@ -1397,31 +2013,32 @@ void bindex_scan_lt(BinDex *bindex, BITS *result, CODE compare) {
   PRINT_EXCECUTION_TIME("copy",
                         copy_filter_vector(bindex,
                                             result,
-                                            is_upper_fv ? (area_idx - 1) : (area_idx)))
+                                            is_upper_fv ? (area_idx - 1) : (area_idx),
+                                            ctx))
 
   PRINT_EXCECUTION_TIME("refine",
-                        for (int i = 0; i < THREAD_NUM; i++) {
-                          threads[i] = std::thread(refine_positions_mt, result, area, start_blk_idx, end_blk_idx, i);
+                        for (int i = 0; i < ctx->thread_num; i++) {
+                          threads[i] = std::thread(refine_positions_mt, result, area, start_blk_idx, end_blk_idx, ctx, i);
                         }
 
-                        for (int i = 0; i < THREAD_NUM; i++) {
+                        for (int i = 0; i < ctx->thread_num; i++) {
                           threads[i].join();
                         }
 
                         if (is_upper_fv) {
-                          refine_positions(result, area->blocks[block_idx]->pos, pos_idx);
+                          refine_block(result, area->blocks[block_idx], 0, pos_idx);
                         } else {
-                          refine_positions(result, area->blocks[block_idx]->pos + pos_idx, area->blocks[block_idx]->length - pos_idx);
+                          refine_block(result, area->blocks[block_idx], pos_idx, area->blocks[block_idx]->length);
                         })
   // clang-format on
 }
 
-void bindex_scan_le(BinDex *bindex, BITS *result, CODE compare) {
+void bindex_scan_le(BinDex *bindex, BITS *result, CODE compare, const ScanContext *ctx = &default_ctx) {
   // TODO: (compare + 1) overflow
-  bindex_scan_lt(bindex, result, compare + 1);
+  bindex_scan_lt(bindex, result, compare + 1, ctx);
 }
 
-void bindex_scan_gt(BinDex *bindex, BITS *result, CODE compare) {
+void bindex_scan_gt(BinDex *bindex, BITS *result, CODE compare, const ScanContext *ctx = &default_ctx) {
   // TODO: (compare + 1) overflow
   compare = compare + 1;
 
@@ -1431,7 +2048,7 @@ void bindex_scan_gt(BinDex *bindex, BITS *result, CODE compare) {
   if (area_idx < 0) {
     // 'compare' less than all raw_data, return all 1 result
     // BITS* result = (BITS*)malloc(sizeof(BITS) * bitmap_len);
-    memset_mt(result, 0xFF, bitmap_len);
+    memset_mt(result, 0xFF, bitmap_len, ctx);
     return;
   }
   Area *area = bindex->areas[area_idx];
@@ -1456,31 +2073,32 @@ void bindex_scan_gt(BinDex *bindex, BITS *result, CODE compare) {
   PRINT_EXCECUTION_TIME("copy",
                         copy_filter_vector_not(bindex,
                                                 result,
-                                                is_upper_fv ? (area_idx - 1) : (area_idx)))
+                                                is_upper_fv ? (area_idx - 1) : (area_idx),
+                                                ctx))
 
   PRINT_EXCECUTION_TIME("refine",
-                        for (int i = 0; i < THREAD_NUM; i++) {
-                          threads[i] = std::thread(refine_positions_mt, result, area, start_blk_idx, end_blk_idx, i);
+                        for (int i = 0; i < ctx->thread_num; i++) {
+                          threads[i] = std::thread(refine_positions_mt, result, area, start_blk_idx, end_blk_idx, ctx, i);
                         }
 
-                        for (int i = 0; i < THREAD_NUM; i++) {
+                        for (int i = 0; i < ctx->thread_num; i++) {
                           threads[i].join();
                         }
 
                         if (is_upper_fv) {
-                          refine_positions(result, area->blocks[block_idx]->pos, pos_idx);
+                          refine_block(result, area->blocks[block_idx], 0, pos_idx);
                         } else {
-                          refine_positions(result, area->blocks[block_idx]->pos + pos_idx, area->blocks[block_idx]->length - pos_idx);
+                          refine_block(result, area->blocks[block_idx], pos_idx, area->blocks[block_idx]->length);
                         })
   // clang-format on
 }
 
-void bindex_scan_ge(BinDex *bindex, BITS *result, CODE compare) {
+void bindex_scan_ge(BinDex *bindex, BITS *result, CODE compare, const ScanContext *ctx = &default_ctx) {
   // TODO: (compare - 1) overflow
-  bindex_scan_gt(bindex, result, compare - 1);
+  bindex_scan_gt(bindex, result, compare - 1, ctx);
 }
 
-void bindex_scan_bt(BinDex *bindex, BITS *result, CODE compare1, CODE compare2) {
+void bindex_scan_bt(BinDex *bindex, BITS *result, CODE compare1, CODE compare2, const ScanContext *ctx = &default_ctx) {
   assert(compare2 > compare1);
   // TODO: (compare1 + 1) overflow
   compare1 = compare1 + 1;
@@ -1495,7 +2113,7 @@ void bindex_scan_bt(BinDex *bindex, BITS *result, CODE compare1, CODE compare2)
     // assert(0);
     // 'compare' less than all raw_data, return all 1 result
     // BITS* result = (BITS*)malloc(sizeof(BITS) * bitmap_len);
-    memset_mt(result, 0xFF, bitmap_len);
+    memset_mt(result, 0xFF, bitmap_len, ctx);
     return;
   }
   Area *area_l = bindex->areas[area_idx_l];
@@ -1523,7 +2141,7 @@ void bindex_scan_bt(BinDex *bindex, BITS *result, CODE compare1, CODE compare2)
     assert(0);
     // 'compare' less than all raw_data, return all zero result
     // BITS* result = (BITS*)malloc(sizeof(BITS) * bitmap_len);
-    memset_mt(result, 0, bitmap_len);
+    memset_mt(result, 0, bitmap_len, ctx);
     return;
   }
   Area *area_r = bindex->areas[area_idx_r];
@@ -1548,34 +2166,35 @@ void bindex_scan_bt(BinDex *bindex, BITS *result, CODE compare1, CODE compare2)
                         copy_filter_vector_bt(bindex,
                                               result,
                                               is_upper_fv_l ? (area_idx_l - 1) : (area_idx_l),
-                                              is_upper_fv_r ? (area_idx_r - 1) : (area_idx_r))
+                                              is_upper_fv_r ? (area_idx_r - 1) : (area_idx_r),
+                                              ctx)
                         )
 
   PRINT_EXCECUTION_TIME("refine",
                         // refine left part
-                        for (int i = 0; i < THREAD_NUM; i++)
-                          threads[i] = std::thread(refine_positions_mt, result, area_l, start_blk_idx_l, end_blk_idx_l, i);
-                        for (int i = 0; i < THREAD_NUM; i++) threads[i].join();
+                        for (int i = 0; i < ctx->thread_num; i++)
+                          threads[i] = std::thread(refine_positions_mt, result, area_l, start_blk_idx_l, end_blk_idx_l, ctx, i);
+                        for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
 
                         if (is_upper_fv_l)
-                          refine_positions(result, area_l->blocks[block_idx_l]->pos, pos_idx_l);
+                          refine_block(result, area_l->blocks[block_idx_l], 0, pos_idx_l);
                         else
-                          refine_positions(result, area_l->blocks[block_idx_l]->pos + pos_idx_l, area_l->blocks[block_idx_l]->length - pos_idx_l);
+                          refine_block(result, area_l->blocks[block_idx_l], pos_idx_l, area_l->blocks[block_idx_l]->length);
 
                         // refine right part
-                        for (int i = 0; i < THREAD_NUM; i++)
-                          threads[i] = std::thread(refine_positions_mt, result, area_r, start_blk_idx_r, end_blk_idx_r, i);
-                        for (int i = 0; i < THREAD_NUM; i++) threads[i].join();
+                        for (int i = 0; i < ctx->thread_num; i++)
+                          threads[i] = std::thread(refine_positions_mt, result, area_r, start_blk_idx_r, end_blk_idx_r, ctx, i);
+                        for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
 
                         if (is_upper_fv_r)
-                          refine_positions(result, area_r->blocks[block_idx_r]->pos, pos_idx_r);
+                          refine_block(result, area_r->blocks[block_idx_r], 0, pos_idx_r);
                         else
-                          refine_positions(result, area_r->blocks[block_idx_r]->pos + pos_idx_r, area_r->blocks[block_idx_r]->length - pos_idx_r);
+                          refine_block(result, area_r->blocks[block_idx_r], pos_idx_r, area_r->blocks[block_idx_r]->length);
                         )
   // clang-format on
 }
 
-void bindex_scan_eq(BinDex *bindex, BITS *result, CODE compare) {
+void bindex_scan_eq(BinDex *bindex, BITS *result, CODE compare, const ScanContext *ctx = &default_ctx) {
   int bitmap_len = bits_num_needed(bindex->length);
   std::thread threads[THREAD_NUM];
 
@@ -1595,7 +2214,7 @@ void bindex_scan_eq(BinDex *bindex, BITS *result, CODE compare) {
     // compare
     int area_idx = in_which_area(bindex, compare);
     if (area_idx < 0) {
-      bindex_scan_lt(bindex, result2, compare + 1);
+      bindex_scan_lt(bindex, result, compare + 1, ctx);
       return;
     }
     Area *area = bindex->areas[area_idx];
@@ -1646,60 +2265,639 @@ void bindex_scan_eq(BinDex *bindex, BITS *result, CODE compare) {
                         copy_filter_vector_xor(bindex,
                                               result,
                                               is_upper_fv ? (area_idx - 1) : (area_idx),
-                                              is_upper_fv1 ? (area_idx1 - 1) : (area_idx1))
+                                              is_upper_fv1 ? (area_idx1 - 1) : (area_idx1),
+                                              ctx)
                         )
 
     PRINT_EXCECUTION_TIME("refine",
                         // refine left part
-                        for (int i = 0; i < THREAD_NUM; i++)
-                          threads[i] = std::thread(refine_positions_in_blks_mt, result, area, start_blk_idx, end_blk_idx, i);
-                        for (int i = 0; i < THREAD_NUM; i++) threads[i].join();
+                        for (int i = 0; i < ctx->thread_num; i++)
+                          threads[i] = std::thread(refine_positions_in_blks_mt, result, area, start_blk_idx, end_blk_idx, ctx, i);
+                        for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
 
                         if (is_upper_fv)
-                          refine_positions(result, area->blocks[block_idx]->pos, pos_idx);
+                          refine_block(result, area->blocks[block_idx], 0, pos_idx);
                         else
-                          refine_positions(result, area->blocks[block_idx]->pos + pos_idx, area->blocks[block_idx]->length - pos_idx);
+                          refine_block(result, area->blocks[block_idx], pos_idx, area->blocks[block_idx]->length);
 
                         // refine right part
-                        for (int i = 0; i < THREAD_NUM; i++)
-                          threads[i] = std::thread(refine_positions_in_blks_mt, result, area1, start_blk_idx1, end_blk_idx1, i);
-                        for (int i = 0; i < THREAD_NUM; i++) threads[i].join();
+                        for (int i = 0; i < ctx->thread_num; i++)
+                          threads[i] = std::thread(refine_positions_in_blks_mt, result, area1, start_blk_idx1, end_blk_idx1, ctx, i);
+                        for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
 
                         if (is_upper_fv1)
-                          refine_positions(result, area1->blocks[block_idx1]->pos, pos_idx1);
+                          refine_block(result, area1->blocks[block_idx1], 0, pos_idx1);
                         else
-                          refine_positions(result, area1->blocks[block_idx1]->pos + pos_idx1, area1->blocks[block_idx1]->length - pos_idx1);
+                          refine_block(result, area1->blocks[block_idx1], pos_idx1, area1->blocks[block_idx1]->length);
                         )
     // clang-format on
   } else {
     // nm < N / K
-    memset_mt(result, 0, bitmap_len);
+    memset_mt(result, 0, bitmap_len, ctx);
 
     Area *area = bindex->areas[area_idx];
     int block_idx = in_which_block(area, compare);
     // int pos_idx = on_which_pos(area->blocks[block_idx], compare);
 
-    for (int i = 0; i < THREAD_NUM; i++) {
+    for (int i = 0; i < ctx->thread_num; i++) {
       threads[i] = std::thread(set_eq_bitmap_mt, result, area, compare,
-                               block_idx, area->blockNum, i);
+                               block_idx, area->blockNum, ctx, i);
     }
 
-    for (int i = 0; i < THREAD_NUM; i++) {
+    for (int i = 0; i < ctx->thread_num; i++) {
       threads[i].join();
     }
   }
 }
 
-void check_worker(CODE *codes, int n, BITS *bitmap, CODE target1, CODE target2, OPERATOR OP, int t_id) {
-  cpu_set_t mask;
-  CPU_ZERO(&mask);
-  CPU_SET(t_id * 2, &mask);
-  if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) < 0) {
-    fprintf(stderr, "set thread affinity failed\n");
+/*
+  Index-only counts, answered from area_counts, block lengths and one binary
+  search per bound without touching filter vectors or bitmaps
+*/
+POSTYPE bindex_locate_lt(BinDex *bindex, CODE compare, int *area_idx, int *block_idx, int *pos_idx) {
+  // Number of values less than 'compare', and the area/block/pos right after
+  // the last of them (pos may be the block length). Unlike in_which_area(..)
+  // and in_which_block(..) this takes the last area/block starting strictly
+  // below 'compare', so duplicates spanning area or block borders are counted exactly
+  if (compare <= area_start_value(bindex->areas[0])) {
+    *area_idx = *block_idx = *pos_idx = 0;
+    return 0;
+  }
+  int low = 0, high = K - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (area_start_value(bindex->areas[mid]) < compare) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  Area *area = bindex->areas[low];
+  POSTYPE rank = low ? bindex->area_counts[low - 1] : 0;
+
+  int block_low = 0, block_high = area->blockNum - 1;
+  while (block_low < block_high) {
+    int mid = (block_low + block_high + 1) / 2;
+    if (block_start_value(area->blocks[mid]) < compare) {
+      block_low = mid;
+    } else {
+      block_high = mid - 1;
+    }
+  }
+  for (int i = 0; i < block_low; i++) {
+    rank += area->blocks[i]->length;
+  }
+  *area_idx = low;
+  *block_idx = block_low;
+  *pos_idx = on_which_pos(area->blocks[block_low], compare);
+  return rank + *pos_idx;
+}
+
+POSTYPE bindex_rank_lt(BinDex *bindex, CODE compare) {
+  int area_idx, block_idx, pos_idx;
+  return bindex_locate_lt(bindex, compare, &area_idx, &block_idx, &pos_idx);
+}
+
+POSTYPE bindex_rank_le(BinDex *bindex, CODE compare) {
+  if (compare == (CODE)~(CODE)0) return bindex->length;
+  return bindex_rank_lt(bindex, compare + 1);
+}
+
+POSTYPE bindex_count_lt(BinDex *bindex, CODE compare) { return bindex_rank_lt(bindex, compare); }
+
+POSTYPE bindex_count_le(BinDex *bindex, CODE compare) { return bindex_rank_le(bindex, compare); }
+
+POSTYPE bindex_count_gt(BinDex *bindex, CODE compare) { return bindex->length - bindex_rank_le(bindex, compare); }
+
+POSTYPE bindex_count_ge(BinDex *bindex, CODE compare) { return bindex->length - bindex_rank_lt(bindex, compare); }
+
+POSTYPE bindex_count_bt(BinDex *bindex, CODE compare1, CODE compare2) {
+  // compare1 < x < compare2, like bindex_scan_bt(..)
+  if (compare2 <= compare1) return 0;
+  return bindex_rank_lt(bindex, compare2) - bindex_rank_le(bindex, compare1);
+}
+
+POSTYPE bindex_count_eq(BinDex *bindex, CODE compare) {
+  return bindex_rank_le(bindex, compare) - bindex_rank_lt(bindex, compare);
+}
+
+POSTYPE raw_count(CODE *raw_data, POSTYPE n, const string &search_cmd, CODE target1, CODE target2) {
+  POSTYPE count = 0;
+  for (POSTYPE i = 0; i < n; i++) {
+    CODE v = raw_data[i];
+    if (search_cmd == "lt") count += v < target1;
+    else if (search_cmd == "le") count += v <= target1;
+    else if (search_cmd == "gt") count += v > target1;
+    else if (search_cmd == "ge") count += v >= target1;
+    else if (search_cmd == "eq") count += v == target1;
+    else if (search_cmd == "bt") count += v > target1 && v < target2;
+  }
+  return count;
+}
+
+POSTYPE bindex_count(BinDex *bindex, const string &search_cmd, CODE target1, CODE target2) {
+  if (search_cmd == "lt") return bindex_count_lt(bindex, target1);
+  if (search_cmd == "le") return bindex_count_le(bindex, target1);
+  if (search_cmd == "gt") return bindex_count_gt(bindex, target1);
+  if (search_cmd == "ge") return bindex_count_ge(bindex, target1);
+  if (search_cmd == "eq") return bindex_count_eq(bindex, target1);
+  if (search_cmd == "bt") return bindex_count_bt(bindex, target1, target2);
+  assert(0);
+  return 0;
+}
+
+/*
+  Index-ordered retrieval: position blocks list row ids in value order, so
+  ORDER BY <column> LIMIT k walks areas and blocks from either end and stops
+  after k qualifying rows, without a full bitmap or a sort
+*/
+typedef struct {
+  int col;          // Indexed column to order by
+  bool descending;
+  int k;
+} OrderSpec;
+
+int bindex_walk_ordered(BinDex *bindex, POSTYPE from_rank, POSTYPE to_rank, bool descending, int k,
+                        const BITS *filter, POSTYPE *rows, CODE *vals, POSTYPE row_end = INT_MAX) {
+  // The first k rows of the global ranks [from_rank, to_rank) in value order
+  // (or reversed), skipping rows not set in 'filter' if given and rows >=
+  // row_end. Returns the number of rows found, < k if the range runs out.
+  int found = 0;
+  if (k <= 0 || from_rank >= to_rank) return 0;
+  int a = descending ? std::lower_bound(bindex->area_counts, bindex->area_counts + K, to_rank) - bindex->area_counts
+                     : std::upper_bound(bindex->area_counts, bindex->area_counts + K, from_rank) - bindex->area_counts;
+  for (; a >= 0 && a < K && found < k; a += descending ? -1 : 1) {
+    Area *area = bindex->areas[a];
+    POSTYPE area_begin = bindex->area_counts[a] - area->length;
+    if (descending ? bindex->area_counts[a] <= from_rank : area_begin >= to_rank) break;
+    // Blocks of the area in walk order, block_begin is the rank of blocks[b][0]
+    POSTYPE block_begin = descending ? bindex->area_counts[a] : area_begin;
+    for (int i = 0; i < area->blockNum && found < k; i++) {
+      int b = descending ? area->blockNum - 1 - i : i;
+      pos_block *blk = area->blocks[b];
+      if (descending) block_begin -= blk->length;
+      int lo = std::max(from_rank - block_begin, (POSTYPE)0);
+      int hi = std::min(to_rank - block_begin, (POSTYPE)blk->length);
+      for (int j = 0; j < hi - lo && found < k; j++) {
+        int p = descending ? hi - 1 - j : lo + j;
+        POSTYPE pos = blk->pos[p];
+        if (pos >= row_end) continue;
+        if (filter && !(filter[pos >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - pos % BITSWIDTH)))) continue;
+        rows[found] = pos;
+        if (vals) vals[found] = blk->val[p];
+        found++;
+      }
+      if (!descending) block_begin += blk->length;
+    }
+  }
+  return found;
+}
+
+int bindex_k_smallest(BinDex *bindex, int k, const BITS *filter, POSTYPE *rows, CODE *vals = NULL) {
+  return bindex_walk_ordered(bindex, 0, bindex->length, false, k, filter, rows, vals);
+}
+
+int bindex_k_largest(BinDex *bindex, int k, const BITS *filter, POSTYPE *rows, CODE *vals = NULL) {
+  return bindex_walk_ordered(bindex, 0, bindex->length, true, k, filter, rows, vals);
+}
+
+int bindex_order_by_range(BinDex *bindex, CODE lo, CODE hi, bool descending, int k, const BITS *filter,
+                          POSTYPE *rows, CODE *vals = NULL) {
+  // ORDER BY col LIMIT k WHERE lo <= col <= hi, the range comes from the ranks
+  POSTYPE to_rank = hi == (CODE)~(CODE)0 ? bindex->length : bindex_rank_lt(bindex, hi + 1);
+  return bindex_walk_ordered(bindex, bindex_rank_lt(bindex, lo), to_rank, descending, k, filter, rows, vals);
+}
+
+OrderSpec parse_order_spec(const char *s) {
+  // <col>:asc|desc:<k>
+  std::vector<std::string> items = stringSplit(s, ':');
+  if (items.size() != 3 || (items[1] != "asc" && items[1] != "desc")) {
+    printf("Error: bad order %s\n", s);
+    exit(-1);
+  }
+  OrderSpec spec = {atoi(items[0].c_str()), items[1] == "desc", atoi(items[2].c_str())};
+  return spec;
+}
+
+void check_order_by(const OrderSpec &spec, const BITS *filter, POSTYPE n, CODE *column, const POSTYPE *rows,
+                    const CODE *vals, int found) {
+  // Same values as sorting all qualifying rows, ties may come in any row order
+  std::vector<CODE> ref;
+  for (POSTYPE i = 0; i < n; i++) {
+    if (filter[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH))) ref.push_back(column[i]);
+  }
+  int k = std::min((int)ref.size(), spec.k);
+  if (spec.descending) {
+    std::partial_sort(ref.begin(), ref.begin() + k, ref.end(), std::greater<CODE>());
+  } else {
+    std::partial_sort(ref.begin(), ref.begin() + k, ref.end());
+  }
+  bool ok = found == k;
+  for (int i = 0; ok && i < k; i++) {
+    ok = vals[i] == ref[i] && column[rows[i]] == vals[i] &&
+         (filter[rows[i] >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - rows[i] % BITSWIDTH)));
+  }
+  if (!ok) {
+    printf("[ERROR] order by c%d mismatch\n", spec.col);
+    assert(0);
+  }
+  printf("[CHECK]order by %d/%d\n", found, k);
+}
+
+/*
+  Rank statistics from index metadata: area_counts and block lengths locate a
+  rank, one val[] read gives the value
+*/
+CODE bindex_select(BinDex *bindex, POSTYPE rank) {
+  // Value of the given rank (0-based, in sorted order)
+  assert(rank >= 0 && rank < bindex->length);
+  int a = std::upper_bound(bindex->area_counts, bindex->area_counts + K, rank) - bindex->area_counts;
+  Area *area = bindex->areas[a];
+  rank -= bindex->area_counts[a] - area->length;
+  int b = 0;
+  while (rank >= area->blocks[b]->length) rank -= area->blocks[b++]->length;
+  return area->blocks[b]->val[rank];
+}
+
+CODE bindex_quantile(BinDex *bindex, double q) {
+  // Nearest-rank quantile, the smallest value with at least q * length values <= it
+  POSTYPE rank = (POSTYPE)std::ceil(q * bindex->length) - 1;
+  return bindex_select(bindex, std::min(std::max(rank, (POSTYPE)0), bindex->length - 1));
+}
+
+void bindex_histogram_width(BinDex *bindex, CODE lo, CODE hi, int buckets, std::vector<POSTYPE> &counts) {
+  // Equi-width: bucket i holds lo + i * width <= x < lo + (i + 1) * width, the last one up to hi inclusive
+  counts.assign(buckets, 0);
+  uint64_t width = ((uint64_t)hi - lo) / buckets + 1;
+  POSTYPE prev = bindex_rank_lt(bindex, lo);
+  for (int i = 0; i < buckets; i++) {
+    uint64_t end = std::min((uint64_t)lo + (i + 1) * width, (uint64_t)hi + 1);
+    POSTYPE rank = end > (CODE)~(CODE)0 ? bindex->length : bindex_rank_lt(bindex, (CODE)end);
+    counts[i] = rank - prev;
+    prev = rank;
+  }
+}
+
+void bindex_histogram_depth(BinDex *bindex, int buckets, std::vector<CODE> &bounds, std::vector<POSTYPE> &counts) {
+  // Equi-depth: bucket i starts at bounds[i], the value of rank i * length / buckets.
+  // Duplicates never straddle a bound, so buckets are only approximately equal.
+  bounds.clear();
+  counts.clear();
+  for (int i = 0; i < buckets; i++) {
+    CODE bound = bindex_select(bindex, (POSTYPE)((int64_t)bindex->length * i / buckets));
+    if (bounds.size() && bounds.back() == bound) continue;
+    bounds.push_back(bound);
+  }
+  for (size_t i = 0; i < bounds.size(); i++) {
+    POSTYPE end = i + 1 < bounds.size() ? bindex_rank_lt(bindex, bounds[i + 1]) : bindex->length;
+    counts.push_back(end - bindex_rank_lt(bindex, bounds[i]));
+  }
+}
+
+void report_rank_statistics(BinDex *bindex, int bindex_id, const std::vector<double> &quantiles, int buckets,
+                            CODE *raw_data) {
+  // [QUANTILE] / [HISTOGRAM] of one column, checked against a sorted copy
+  std::vector<CODE> sorted(raw_data, raw_data + bindex->length);
+  std::sort(sorted.begin(), sorted.end());
+  for (size_t i = 0; i < quantiles.size(); i++) {
+    CODE v;
+    PRINT_EXCECUTION_TIME("quantile", v = bindex_quantile(bindex, quantiles[i]));
+    POSTYPE rank = std::min(std::max((POSTYPE)std::ceil(quantiles[i] * bindex->length) - 1, (POSTYPE)0),
+                            bindex->length - 1);
+    printf("[QUANTILE] c%d q%g: %u\n", bindex_id, quantiles[i], v);
+    printf("[CHECK]quantile %u/%u\n", v, sorted[rank]);
+    assert(v == sorted[rank]);
+  }
+  if (buckets <= 0) return;
+
+  std::vector<POSTYPE> counts;
+  PRINT_EXCECUTION_TIME("equi-width histogram",
+                        bindex_histogram_width(bindex, sorted.front(), sorted.back(), buckets, counts));
+  uint64_t width = ((uint64_t)sorted.back() - sorted.front()) / buckets + 1;
+  for (int i = 0; i < buckets; i++) {
+    uint64_t lo = sorted.front() + i * width;
+    uint64_t end = std::min(lo + width, (uint64_t)sorted.back() + 1);
+    POSTYPE truth = std::lower_bound(sorted.begin(), sorted.end(), end) - std::lower_bound(sorted.begin(), sorted.end(), lo);
+    printf("[HISTOGRAM] c%d width bucket %d [%lu, %lu): %d\n", bindex_id, i, (unsigned long)lo, (unsigned long)end,
+           counts[i]);
+    assert(counts[i] == truth);
+  }
+
+  std::vector<CODE> bounds;
+  PRINT_EXCECUTION_TIME("equi-depth histogram", bindex_histogram_depth(bindex, buckets, bounds, counts));
+  POSTYPE total = 0;
+  for (size_t i = 0; i < bounds.size(); i++) {
+    POSTYPE truth = (i + 1 < bounds.size() ? std::lower_bound(sorted.begin(), sorted.end(), bounds[i + 1])
+                                           : sorted.end()) -
+                    std::lower_bound(sorted.begin(), sorted.end(), bounds[i]);
+    printf("[HISTOGRAM] c%d depth bucket %d from %u: %d\n", bindex_id, (int)i, bounds[i], counts[i]);
+    assert(counts[i] == truth);
+    total += counts[i];
+  }
+  printf("[CHECK]histogram %d/%d\n", total, bindex->length);
+}
+
+/*
+  Aggregation over result bitmaps
+*/
+#define AGG_TILE_WORDS 4096  // 128K rows per tile
+
+enum AGG_FUNC { AGG_COUNT = 0, AGG_SUM, AGG_MIN, AGG_MAX, AGG_AVG, AGG_SUMPROD };
+
+typedef struct {
+  AGG_FUNC func;
+  int col;   // value column, -1 for count
+  int col2;  // second factor of sumprod, -1 otherwise
+} AggSpec;
+
+void init_masked_agg(MaskedAgg *agg) {
+  agg->count = 0;
+  agg->sum = 0;
+  agg->min = UINT32_MAX;
+  agg->max = 0;
+}
+
+void merge_masked_agg(MaskedAgg *to, const MaskedAgg *from) {
+  to->count += from->count;
+  to->sum += from->sum;
+  if (from->min < to->min) to->min = from->min;
+  if (from->max > to->max) to->max = from->max;
+}
+
+void aggregate_worker(BITS *bitmap, int full_words, CODE *a, CODE *b, std::atomic<int> *next_tile, MaskedAgg *agg,
+                      const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  init_masked_agg(agg);
+  // Tiles are handed out dynamically, selected rows are rarely spread evenly
+  for (;;) {
+    int start = next_tile->fetch_add(1) * AGG_TILE_WORDS;
+    if (start >= full_words) break;
+    int end = std::min(start + AGG_TILE_WORDS, full_words);
+    if (!a) {
+      for (int i = start; i < end; i++) agg->count += __builtin_popcount(bitmap[i]);
+    } else {
+      bitmap_kernels.masked_agg(bitmap, start, end, (const uint32_t *)a, (const uint32_t *)b, agg);
+    }
+  }
+}
+
+MaskedAgg bitmap_aggregate(BITS *bitmap, POSTYPE n, CODE *a, CODE *b, const ScanContext *ctx = &default_ctx) {
+  // COUNT of the first n rows of 'bitmap' and, with a value column a, the
+  // SUM/MIN/MAX of a (SUM of a * b with b) over them
+  assert(sizeof(CODE) == sizeof(uint32_t) || !a);
+  std::thread threads[THREAD_NUM];
+  MaskedAgg aggs[THREAD_NUM];
+  std::atomic<int> next_tile(0);
+  int full_words = n / BITSWIDTH;
+  for (int i = 0; i < ctx->thread_num; i++) {
+    threads[i] = std::thread(aggregate_worker, bitmap, full_words, a, b, &next_tile, &aggs[i], ctx, i);
+  }
+  for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
+
+  MaskedAgg res;
+  init_masked_agg(&res);
+  for (int i = 0; i < ctx->thread_num; i++) merge_masked_agg(&res, &aggs[i]);
+  int rest = n % BITSWIDTH;
+  if (rest) {
+    BITS w = bitmap[full_words] & (~0U << (BITSWIDTH - rest));
+    if (!a) {
+      res.count += __builtin_popcount(w);
+    } else {
+      masked_agg_word(w, (const uint32_t *)a + full_words * BITSWIDTH,
+                      b ? (const uint32_t *)b + full_words * BITSWIDTH : NULL, &res);
+    }
+  }
+  return res;
+}
+
+MaskedAgg bitmap_aggregate_ref(BITS *bitmap, POSTYPE n, CODE *a, CODE *b) {
+  // Row at a time reference for checking bitmap_aggregate(..)
+  MaskedAgg res;
+  init_masked_agg(&res);
+  for (POSTYPE i = 0; i < n; i++) {
+    if (!(bitmap[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH)))) continue;
+    res.count++;
+    if (!a) continue;
+    res.sum += b ? (uint64_t)a[i] * b[i] : a[i];
+    if (a[i] < res.min) res.min = a[i];
+    if (a[i] > res.max) res.max = a[i];
+  }
+  return res;
+}
+
+std::vector<AggSpec> parse_agg_specs(const char *s) {
+  // count,sum:<col>,min:<col>,max:<col>,avg:<col>,sumprod:<col>*<col>
+  std::vector<AggSpec> specs;
+  std::vector<std::string> items = stringSplit(s, ',');
+  for (size_t i = 0; i < items.size(); i++) {
+    std::string name = items[i].substr(0, items[i].find(':'));
+    std::string arg = items[i].find(':') == std::string::npos ? "" : items[i].substr(items[i].find(':') + 1);
+    AggSpec spec = {AGG_COUNT, -1, -1};
+    if (name == "count") {
+      specs.push_back(spec);
+      continue;
+    } else if (name == "sum") {
+      spec.func = AGG_SUM;
+    } else if (name == "min") {
+      spec.func = AGG_MIN;
+    } else if (name == "max") {
+      spec.func = AGG_MAX;
+    } else if (name == "avg") {
+      spec.func = AGG_AVG;
+    } else if (name == "sumprod") {
+      spec.func = AGG_SUMPROD;
+      assert(arg.find('*') != std::string::npos);
+      spec.col2 = atoi(arg.c_str() + arg.find('*') + 1);
+    } else {
+      printf("Error: unknown aggregate %s\n", items[i].c_str());
+      exit(-1);
+    }
+    assert(!arg.empty());
+    spec.col = atoi(arg.c_str());
+    specs.push_back(spec);
+  }
+  return specs;
+}
+
+typedef std::map<std::pair<int, int>, MaskedAgg> AggPasses;  // (col, col2) -> aggregates
+
+void run_aggregates(const std::vector<AggSpec> &specs, BITS *bitmap, POSTYPE n, CODE **columns, AggPasses &passes) {
+  // One pass per distinct (col, col2), shared by sum/min/max/avg of a column
+  passes.clear();
+  for (size_t i = 0; i < specs.size(); i++) {
+    std::pair<int, int> key(specs[i].col, specs[i].func == AGG_SUMPROD ? specs[i].col2 : -1);
+    if (passes.count(key)) continue;
+    CODE *a = key.first < 0 ? NULL : columns[key.first];
+    CODE *b = key.second < 0 ? NULL : columns[key.second];
+    passes[key] = bitmap_aggregate(bitmap, n, a, b);
+  }
+  for (size_t i = 0; i < specs.size(); i++) {
+    const AggSpec &spec = specs[i];
+    MaskedAgg &agg = passes[std::make_pair(spec.col, spec.func == AGG_SUMPROD ? spec.col2 : -1)];
+    switch (spec.func) {
+      case AGG_COUNT:
+        printf("[AGG] count = %lu\n", agg.count);
+        break;
+      case AGG_SUM:
+        printf("[AGG] sum(c%d) = %lu\n", spec.col, agg.sum);
+        break;
+      case AGG_MIN:
+        if (agg.count) printf("[AGG] min(c%d) = %u\n", spec.col, agg.min);
+        else printf("[AGG] min(c%d) = NULL\n", spec.col);
+        break;
+      case AGG_MAX:
+        if (agg.count) printf("[AGG] max(c%d) = %u\n", spec.col, agg.max);
+        else printf("[AGG] max(c%d) = NULL\n", spec.col);
+        break;
+      case AGG_AVG:
+        if (agg.count) printf("[AGG] avg(c%d) = %f\n", spec.col, (double)agg.sum / agg.count);
+        else printf("[AGG] avg(c%d) = NULL\n", spec.col);
+        break;
+      case AGG_SUMPROD:
+        printf("[AGG] sum(c%d*c%d) = %lu\n", spec.col, spec.col2, agg.sum);
+        break;
+    }
+  }
+}
+
+void check_aggregates(const AggPasses &passes, BITS *bitmap, POSTYPE n, CODE **columns) {
+  for (AggPasses::const_iterator it = passes.begin(); it != passes.end(); it++) {
+    CODE *a = it->first.first < 0 ? NULL : columns[it->first.first];
+    CODE *b = it->first.second < 0 ? NULL : columns[it->first.second];
+    MaskedAgg ref = bitmap_aggregate_ref(bitmap, n, a, b);
+    const MaskedAgg &agg = it->second;
+    if (agg.count != ref.count || agg.sum != ref.sum || (agg.count && a && (agg.min != ref.min || agg.max != ref.max))) {
+      printf("[ERROR] aggregate over c%d mismatch\n", it->first.first);
+      assert(0);
+    }
+  }
+  printf("[CHECK]aggregates passed\n");
+}
+
+/*
+  Materialization: result bitmaps to ascending row ids and projected columns.
+  A first pass counts the selected rows per tile so every tile knows where its
+  output starts, then tiles are decoded in parallel. Dense tiles compress the
+  projected columns straight from the bitmap with sequential reads, sparse
+  ones gather the values of their row ids.
+*/
+#define MATERIALIZE_TILE_WORDS 4096  // 128K rows
+#define MATERIALIZE_DENSE 8          // Tiles with at least 1 in 8 rows selected are dense
+
+typedef struct {
+  POSTYPE count;
+  POSTYPE *rows;                 // Selected row ids, ascending
+  int column_num;
+  int columns[MAX_BINDEX_NUM];   // Projected columns
+  CODE *values[MAX_BINDEX_NUM];  // values[c][i]: column columns[c] of row rows[i]
+  int dense_tiles, sparse_tiles;
+} Materialized;
+
+void count_tiles_worker(BITS *bitmap, int full_words, POSTYPE *tile_counts, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  int tile_num = ROUNDUP_DIVIDE(full_words, MATERIALIZE_TILE_WORDS);
+  for (int tile = t_id; tile < tile_num; tile += ctx->thread_num) {
+    int end = std::min((tile + 1) * MATERIALIZE_TILE_WORDS, full_words);
+    POSTYPE count = 0;
+    for (int i = tile * MATERIALIZE_TILE_WORDS; i < end; i++) count += __builtin_popcount(bitmap[i]);
+    tile_counts[tile] = count;
+  }
+}
+
+void materialize_worker(BITS *bitmap, int full_words, CODE **columns, const POSTYPE *tile_offsets,
+                        std::atomic<int> *next_tile, Materialized *res, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  int tile_num = ROUNDUP_DIVIDE(full_words, MATERIALIZE_TILE_WORDS);
+  for (;;) {
+    int tile = next_tile->fetch_add(1);
+    if (tile >= tile_num) break;
+    int start = tile * MATERIALIZE_TILE_WORDS, end = std::min(start + MATERIALIZE_TILE_WORDS, full_words);
+    POSTYPE offset = tile_offsets[tile], count = tile_offsets[tile + 1] - offset;
+    if (!count) continue;
+    uint32_t *rows = (uint32_t *)(res->rows + offset);
+    bitmap_kernels.compress(bitmap, start, end, NULL, rows, count);
+    bool dense = (POSTYPE)(end - start) * BITSWIDTH <= count * MATERIALIZE_DENSE;
+    for (int c = 0; c < res->column_num; c++) {
+      const uint32_t *column = (const uint32_t *)columns[res->columns[c]];
+      uint32_t *out = (uint32_t *)(res->values[c] + offset);
+      if (dense) {
+        bitmap_kernels.compress(bitmap, start, end, column, out, count);
+      } else {
+        bitmap_kernels.gather(column, rows, count, out);
+      }
+    }
+    __sync_fetch_and_add(dense ? &res->dense_tiles : &res->sparse_tiles, 1);
+  }
+}
+
+void bitmap_materialize(BITS *bitmap, POSTYPE n, CODE **columns, const std::vector<int> &project, Materialized *res,
+                        const ScanContext *ctx = &default_ctx) {
+  // Row ids of the first n rows of 'bitmap' and the values of the 'project'
+  // columns in them, free with free_materialized(..)
+  assert(sizeof(CODE) == sizeof(uint32_t) && sizeof(POSTYPE) == sizeof(uint32_t));
+  assert(project.size() <= MAX_BINDEX_NUM);
+  int full_words = n / BITSWIDTH, rest = n % BITSWIDTH;
+  int tile_num = ROUNDUP_DIVIDE(full_words, MATERIALIZE_TILE_WORDS);
+  std::vector<POSTYPE> tile_offsets(tile_num + 1, 0);
+  std::thread threads[THREAD_NUM];
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(count_tiles_worker, bitmap, full_words, tile_offsets.data() + 1, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+  for (int tile = 0; tile < tile_num; tile++) tile_offsets[tile + 1] += tile_offsets[tile];
+  BITS tail = rest ? bitmap[full_words] & (~0U << (BITSWIDTH - rest)) : 0;
+
+  res->count = tile_offsets[tile_num] + __builtin_popcount(tail);
+  res->rows = (POSTYPE *)malloc(std::max(res->count, 1) * sizeof(POSTYPE));
+  res->column_num = project.size();
+  for (int c = 0; c < res->column_num; c++) {
+    res->columns[c] = project[c];
+    res->values[c] = (CODE *)malloc(std::max(res->count, 1) * sizeof(CODE));
+  }
+  res->dense_tiles = res->sparse_tiles = 0;
+
+  std::atomic<int> next_tile(0);
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(materialize_worker, bitmap, full_words, columns, tile_offsets.data(), &next_tile, res,
+                                ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+  if (tail) {
+    POSTYPE offset = tile_offsets[tile_num];
+    compress_word_exact(tail, full_words * BITSWIDTH, NULL, (uint32_t *)res->rows + offset);
+    for (int c = 0; c < res->column_num; c++) {
+      compress_word_exact(tail, full_words * BITSWIDTH, (const uint32_t *)columns[project[c]],
+                          (uint32_t *)res->values[c] + offset);
+    }
+  }
+}
+
+void free_materialized(Materialized *res) {
+  free(res->rows);
+  for (int c = 0; c < res->column_num; c++) free(res->values[c]);
+}
+
+void check_materialized(const Materialized *res, BITS *bitmap, POSTYPE n, CODE **columns) {
+  POSTYPE j = 0;
+  for (POSTYPE i = 0; i < n; i++) {
+    if (!(bitmap[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH)))) continue;
+    bool ok = j < res->count && res->rows[j] == i;
+    for (int c = 0; ok && c < res->column_num; c++) ok = res->values[c][j] == columns[res->columns[c]][i];
+    if (!ok) {
+      printf("[ERROR] materialized row %d mismatch at row %d\n", j, i);
+      assert(0);
+    }
+    j++;
   }
-  int avg_workload = n / THREAD_NUM;
+  printf("[CHECK]materialize %d/%d\n", res->count, j);
+  assert(j == res->count);
+}
+
+void check_worker(CODE *codes, int n, BITS *bitmap, CODE target1, CODE target2, OPERATOR OP, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  int avg_workload = n / ctx->thread_num;
   int start = t_id * avg_workload;
-  int end = t_id == (THREAD_NUM - 1) ? n : start + avg_workload;
+  int end = t_id == (ctx->thread_num - 1) ? n : start + avg_workload;
   for (int i = start; i < end; i++) {
     int data = codes[i];
     int truth;
@@ -1736,10 +2934,10 @@ void check_worker(CODE *codes, int n, BITS *bitmap, CODE target1, CODE target2,
 void check(BinDex *bindex, BITS *bitmap, CODE target1, CODE target2, OPERATOR OP, CODE *raw_data) {
   std::cout << "checking, target1: " << target1 << " target2: " << target2 << std::endl;
   std::thread threads[THREAD_NUM];
-  for (int t_id = 0; t_id < THREAD_NUM; t_id++) {
-    threads[t_id] = std::thread(check_worker, raw_data, bindex->length, bitmap, target1, target2, OP, t_id);
+  for (int t_id = 0; t_id < default_ctx.thread_num; t_id++) {
+    threads[t_id] = std::thread(check_worker, raw_data, bindex->length, bitmap, target1, target2, OP, &default_ctx, t_id);
   }
-  for (int t_id = 0; t_id < THREAD_NUM; t_id++) {
+  for (int t_id = 0; t_id < default_ctx.thread_num; t_id++) {
     threads[t_id].join();
   }
   std::cout << "CHECK PASSED!" << std::endl;
@@ -1784,8 +2982,9 @@ void check_st(BinDex *bindex, BITS *bitmap, CODE target1, CODE target2, OPERATOR
 }
 
 void free_pos_block(pos_block *pb) {
-  free(pb->pos);
-  free(pb->val);
+  block_pool.release(pb->pos);
+  block_pool.release(pb->val);
+  free(pb->runs);
 
   free(pb);
 }
@@ -1804,7 +3003,8 @@ void free_bindex(BinDex *bindex, CODE *raw_data) {
 
   // BITS *filterVectors[K - 1]
   for (int i = 0; i < K - 1; i++) {
-    free(bindex->filterVectors[i]);
+    free_bitmap(bindex->filterVectors[i]);
+    free_fv_replicas(bindex, i);
   }
 
   // Area *areas[K]
@@ -1812,6 +3012,9 @@ void free_bindex(BinDex *bindex, CODE *raw_data) {
     free_area(bindex->areas[i]);
   }
 
+  // Zone *zones
+  free(bindex->zones);
+
   free(bindex);
 }
 
@@ -1848,143 +3051,1662 @@ std::vector<CODE> get_target_numbers(string s) {
   return result;
 }
 
-void raw_scan(BinDex *bindex, BITS *bitmap, CODE target1, CODE target2, OPERATOR OP, CODE *raw_data, BITS* compare_bitmap = NULL)
-{
-  for(int i = 0; i < bindex->length; i++) {
-    bool hit = false;
-    switch (OP)
-    {
-    case LT:
-      if (raw_data[i] < target1) hit = true;
-      break;
-    case LE:
-      if (raw_data[i] <= target1) hit = true;
-      break;
-    case GT:
-      if (raw_data[i] > target1) hit = true;
-      break;
-    case GE:
-      if (raw_data[i] >= target1) hit = true;
-      break;
-    case EQ:
-      if (raw_data[i] == target1) hit = true;
-      break;
-    case BT:
-      if (raw_data[i] > target1 && raw_data[i] < target2) hit = true;
-      break;
-    default:
-      break;
-    }
-    if (hit) {
-      // bitmap[i >> BITSSHIFT] |= (1U << (BITSWIDTH - 1 - i % BITSWIDTH));
-      if (compare_bitmap != NULL) {
-        int compare_bit = (compare_bitmap[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH)));
-        if(compare_bitmap == 0) {
-          printf("[ERROR] check error in raw_data[%d]=", i);
-          printf(" %u\n", raw_data[i]);
-          break;
-        }
-      } else {
-        refine(bitmap, i);
-      }
+/*
+  Predicate trees: OR / AND / NOT / IN over one column are normalized to a
+  set of disjoint value ranges, then answered with a single bitmap pass.
+  A row is in [lo, hi) iff lt(hi) ^ lt(lo), so the result is the XOR of lt(b)
+  over all range borders, with lt(0) = no rows and lt(CODE_SPACE) = all rows.
+  Borders falling into the same
+  area cancel pairwise into the positions between them, the others cost one
+  filter vector plus the positions up to the border (or from the border to
+  the end of the area, on the complemented vector).
+*/
+#define CODE_SPACE ((uint64_t)(CODE)~(CODE)0 + 1)
+
+typedef std::vector<std::pair<uint64_t, uint64_t> > RangeSet;  // Sorted disjoint [lo, hi) in [0, CODE_SPACE)
+
+RangeSet range_normalize(RangeSet ranges) {
+  std::sort(ranges.begin(), ranges.end());
+  RangeSet res;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (ranges[i].first >= ranges[i].second) continue;
+    if (res.size() && ranges[i].first <= res.back().second) {
+      res.back().second = std::max(res.back().second, ranges[i].second);
+    } else {
+      res.push_back(ranges[i]);
     }
   }
+  return res;
 }
 
-void raw_scan_entry(std::vector<CODE>* target_l, std::vector<CODE>* target_r, std::string search_cmd, BinDex* bindex, BITS* bitmap, BITS* mergeBitmap, CODE* raw_data) {
-  CODE target1, target2;
-  
-  for (int pi = 0; pi < target_l->size(); pi++) {
-    target1 = (*target_l)[pi];
+RangeSet range_union(const RangeSet &a, const RangeSet &b) {
+  RangeSet res(a);
+  res.insert(res.end(), b.begin(), b.end());
+  return range_normalize(res);
+}
+
+RangeSet range_complement(const RangeSet &a) {
+  RangeSet res;
+  uint64_t lo = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].first > lo) res.push_back(std::make_pair(lo, a[i].first));
+    lo = a[i].second;
+  }
+  if (lo < CODE_SPACE) res.push_back(std::make_pair(lo, CODE_SPACE));
+  return res;
+}
+
+RangeSet range_intersect(const RangeSet &a, const RangeSet &b) {
+  RangeSet res;
+  size_t i = 0, j = 0;
+  while (i < a.size() && j < b.size()) {
+    uint64_t lo = std::max(a[i].first, b[j].first);
+    uint64_t hi = std::min(a[i].second, b[j].second);
+    if (lo < hi) res.push_back(std::make_pair(lo, hi));
+    if (a[i].second < b[j].second) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  return res;
+}
+
+bool range_contains(const RangeSet &ranges, CODE v) {
+  RangeSet::const_iterator it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair((uint64_t)v, CODE_SPACE));
+  return it != ranges.begin() && (--it)->second > v;
+}
+
+RangeSet comparison_range(const string &op, CODE target1, CODE target2) {
+  // Same semantics as the single-predicate scans, bt is exclusive on both ends
+  RangeSet res;
+  uint64_t t1 = target1, t2 = target2;
+  if (op == "lt") res.push_back(std::make_pair((uint64_t)0, t1));
+  else if (op == "le") res.push_back(std::make_pair((uint64_t)0, t1 + 1));
+  else if (op == "gt") res.push_back(std::make_pair(t1 + 1, CODE_SPACE));
+  else if (op == "ge") res.push_back(std::make_pair(t1, CODE_SPACE));
+  else if (op == "eq") res.push_back(std::make_pair(t1, t1 + 1));
+  else if (op == "bt") {
+    if (t1 > t2) std::swap(t1, t2);
+    res.push_back(std::make_pair(t1 + 1, t2));
+  } else {
+    printf("Error: unknown operator %s in predicate\n", op.c_str());
+    exit(-1);
+  }
+  return range_normalize(res);
+}
+
+bool is_predicate_tree(const std::vector<std::string> &tokens) {
+  for (size_t i = 0; i < tokens.size(); i++) {
+    const std::string &t = tokens[i];
+    if (t == "or" || t == "and" || t == "not" || t == "in" || t == "(" || t == ")") return true;
+  }
+  return false;
+}
+
+class PredicateParser {
+  // expr   := term ('or' term)*
+  // term   := factor ('and' factor)*
+  // factor := 'not' factor | '(' expr ')' | 'in' v1,v2,... | op value [value]
+  // Tokens are separated by single spaces, e.g. "( lt 10 or gt 40 ) and not in 45,47"
+  public:
+
+  PredicateParser(const std::vector<std::string> &tokens) : tokens(tokens), cur(0) {}
+
+  RangeSet parse() {
+    RangeSet res = expr();
+    if (cur != tokens.size()) {
+      printf("Error: unexpected %s in predicate at token %zu\n", tokens[cur].c_str(), cur);
+      exit(-1);
+    }
+    return res;
+  }
+
+  private:
+
+  const std::vector<std::string> &tokens;
+  size_t cur;
+
+  const std::string &next() {
+    if (cur >= tokens.size()) {
+      printf("Error: predicate ends early at token %zu\n", cur);
+      exit(-1);
+    }
+    return tokens[cur++];
+  }
+
+  bool accept(const char *token) {
+    if (cur < tokens.size() && tokens[cur] == token) {
+      cur++;
+      return true;
+    }
+    return false;
+  }
+
+  RangeSet expr() {
+    RangeSet res = term();
+    while (accept("or")) res = range_union(res, term());
+    return res;
+  }
+
+  RangeSet term() {
+    RangeSet res = factor();
+    while (accept("and")) res = range_intersect(res, factor());
+    return res;
+  }
+
+  RangeSet factor() {
+    if (accept("not")) return range_complement(factor());
+    if (accept("(")) {
+      RangeSet res = expr();
+      if (!accept(")")) {
+        printf("Error: missing ) in predicate at token %zu\n", cur);
+        exit(-1);
+      }
+      return res;
+    }
+    if (accept("in")) {
+      std::vector<CODE> values = get_target_numbers(next());
+      RangeSet res;
+      for (size_t i = 0; i < values.size(); i++) res.push_back(std::make_pair((uint64_t)values[i], (uint64_t)values[i] + 1));
+      return range_normalize(res);
+    }
+    std::string op = next();
+    CODE target1 = (CODE)stod(next());
+    CODE target2 = op == "bt" ? (CODE)stod(next()) : 0;
+    return comparison_range(op, target1, target2);
+  }
+};
+
+POSTYPE bindex_count_ranges(BinDex *bindex, const RangeSet &ranges) {
+  POSTYPE count = 0;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    POSTYPE hi = ranges[i].second == CODE_SPACE ? bindex->length : bindex_rank_lt(bindex, (CODE)ranges[i].second);
+    count += hi - bindex_rank_lt(bindex, (CODE)ranges[i].first);
+  }
+  return count;
+}
+
+POSTYPE raw_count_ranges(CODE *raw_data, POSTYPE n, const RangeSet &ranges) {
+  POSTYPE count = 0;
+  for (POSTYPE i = 0; i < n; i++) count += range_contains(ranges, raw_data[i]);
+  return count;
+}
+
+typedef struct {
+  POSTYPE *pos;
+  int n;
+  const pos_block *blk;  // Block holding pos, pos - blk->pos is the block-local index
+} PosSegment;
+
+void add_area_segments(Area *area, POSTYPE from, POSTYPE to, std::vector<PosSegment> &segs) {
+  // Positions of the area-local ranks [from, to)
+  POSTYPE offset = 0;
+  for (int i = 0; i < area->blockNum && offset < to; i++) {
+    pos_block *blk = area->blocks[i];
+    POSTYPE lo = std::max(from, offset), hi = std::min(to, offset + blk->length);
+    if (lo < hi) {
+      PosSegment seg = {blk->pos + (lo - offset), (int)(hi - lo), blk};
+      segs.push_back(seg);
+    }
+    offset += blk->length;
+  }
+}
+
+void combine_fv_words(BinDex *bindex, BITS *result, const std::vector<int> *fvs, bool invert, int cur, int end,
+                      bool stream, const ScanContext *ctx, int t_id) {
+  // result = (~)fv[0] ^ fv[1] ^ ... on the words [cur, end)
+  if (fvs->empty()) {
+    memset(result + cur, invert ? 0xFF : 0, (end - cur) * sizeof(BITS));
+    return;
+  }
+  BITS *first = local_fv(bindex, (*fvs)[0], ctx, t_id) + cur;
+  if (invert) {
+    bitmap_kernels.not_(result + cur, first, NULL, end - cur, stream);
+  } else {
+    bitmap_kernels.copy(result + cur, first, NULL, end - cur, stream);
+  }
+  for (size_t i = 1; i < fvs->size(); i++) {
+    bitmap_kernels.xor_(result + cur, result + cur, local_fv(bindex, (*fvs)[i], ctx, t_id) + cur, end - cur, false);
+  }
+}
+
+void combine_fv_worker(BinDex *bindex, BITS *result, const std::vector<int> *fvs, bool invert, int bitmap_len,
+                       const ScanContext *ctx, int t_id) {
+  // combine_fv_words(..) on the SIMD_JOB_UNIT aligned share of this worker
+  int jobs = ((bitmap_len / SIMD_JOB_UNIT - 1) / ctx->thread_num + 1) * SIMD_JOB_UNIT;
+  pin_worker(ctx, t_id);
+  int cur = t_id * jobs;
+  int end = std::min((t_id + 1) * jobs, bitmap_len);
+  if (cur >= end) return;
+  bool stream = fvs->size() == 1 && bitmap_kernels.stream(bitmap_len * sizeof(BITS));
+  combine_fv_words(bindex, result, fvs, invert, cur, end, stream, ctx, t_id);
+}
+
+void refine_segments_worker(BITS *result, const std::vector<PosSegment> *segs, const ScanContext *ctx, int t_id) {
+  // Segments of different borders may hit the same word, so flip bits atomically
+  pin_worker(ctx, t_id);
+  for (size_t i = t_id; i < segs->size(); i += ctx->thread_num) {
+    const PosSegment &seg = (*segs)[i];
+    if (seg.blk->runs) {
+      int from = seg.pos - seg.blk->pos;
+      refine_block(result, seg.blk, from, from + seg.n);
+      continue;
+    }
+    for (int j = 0; j < seg.n; j++) {
+      POSTYPE pos = seg.pos[j];
+      __atomic_fetch_xor(&result[pos >> BITSSHIFT], 1U << (BITSWIDTH - 1 - pos % BITSWIDTH), __ATOMIC_RELAXED);
+    }
+  }
+}
+
+typedef struct {
+  std::vector<int> fvs;          // Filter vectors XORed into the result
+  bool invert;                   // Complement of that
+  std::vector<PosSegment> segs;  // Positions to flip afterwards
+} RangeScanPlan;
+
+void plan_range_scan(BinDex *bindex, const RangeSet &ranges, RangeScanPlan &plan) {
+  // Borders in ascending order, each located once
+  std::vector<uint64_t> borders;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (ranges[i].first > 0) borders.push_back(ranges[i].first);
+    if (ranges[i].second < CODE_SPACE) borders.push_back(ranges[i].second);
+  }
+  std::vector<int> b_area(borders.size());
+  std::vector<POSTYPE> b_rank(borders.size());
+  for (size_t i = 0; i < borders.size(); i++) {
+    int block_idx, pos_idx;
+    POSTYPE rank = bindex_locate_lt(bindex, (CODE)borders[i], &b_area[i], &block_idx, &pos_idx);
+    b_rank[i] = rank - (b_area[i] ? bindex->area_counts[b_area[i] - 1] : 0);  // Area-local rank
+  }
+
+  bool fv_parity[K + 1] = {false};  // fv_parity[k + 1]: filter vector k (-1: none, K - 1: all rows) toggled
+  std::vector<PosSegment> &segs = plan.segs;
+  segs.clear();
+  size_t i = 0;
+  while (i < borders.size()) {
+    size_t j = i;
+    while (j < borders.size() && b_area[j] == b_area[i]) j++;
+    int a = b_area[i];
+    Area *area = bindex->areas[a];
+    // First area of a run of areas starting with the same value, only the
+    // areas before it are covered by filter vector first - 1
+    int first = a;
+    while (first > 0 && area_start_value(bindex->areas[first - 1]) == area_start_value(area)) first--;
+    POSTYPE area_begin = first ? bindex->area_counts[first - 1] : 0;
+    POSTYPE area_len = bindex->area_counts[a] - area_begin;
+    POSTYPE skipped = bindex->area_counts[a] - area->length - area_begin;  // Rows of areas [first, a)
+
+    // An odd group keeps one border that needs a filter vector, use the
+    // first or the last one, whichever leaves fewer positions to refine
+    size_t lone = borders.size();
+    if ((j - i) % 2) {
+      POSTYPE cost_first = std::min(skipped + b_rank[i], area_len - skipped - b_rank[i]);
+      POSTYPE cost_last = std::min(skipped + b_rank[j - 1], area_len - skipped - b_rank[j - 1]);
+      for (size_t p = i + 1; p + 1 < j; p += 2) cost_first += b_rank[p + 1] - b_rank[p];
+      for (size_t p = i; p + 1 < j - 1; p += 2) cost_last += b_rank[p + 1] - b_rank[p];
+      lone = cost_first <= cost_last ? i : j - 1;
+    }
+    std::vector<size_t> paired;
+    for (size_t p = i; p < j; p++) {
+      if (p != lone) paired.push_back(p);
+    }
+    for (size_t p = 0; p < paired.size(); p += 2) {
+      add_area_segments(area, b_rank[paired[p]], b_rank[paired[p + 1]], segs);
+    }
+    if (lone < borders.size()) {
+      POSTYPE prefix = skipped + b_rank[lone];
+      if (prefix <= area_len - prefix) {
+        fv_parity[first] ^= true;  // filter vector first - 1
+        for (int k = first; k < a; k++) add_area_segments(bindex->areas[k], 0, bindex->areas[k]->length, segs);
+        add_area_segments(area, 0, b_rank[lone], segs);
+      } else {
+        fv_parity[a + 1] ^= true;  // filter vector a
+        add_area_segments(area, b_rank[lone], area->length, segs);
+      }
+    }
+    i = j;
+  }
+
+  plan.fvs.clear();
+  for (int k = 0; k < K - 1; k++) {
+    if (fv_parity[k + 1]) plan.fvs.push_back(k);
+  }
+  plan.invert = fv_parity[K] ^ (ranges.size() && ranges.back().second == CODE_SPACE);
+}
+
+void combine_plan_fvs(BinDex *bindex, BITS *result, const RangeScanPlan &plan, const ScanContext *ctx) {
+  for (size_t i = 0; i < plan.fvs.size(); i++) __sync_fetch_and_add(&bindex->fvHits[plan.fvs[i]], 1);
+  int bitmap_len = bits_num_needed(bindex->length);
+  std::thread threads[THREAD_NUM];
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(combine_fv_worker, bindex, result, &plan.fvs, plan.invert, bitmap_len, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+}
+
+void refine_plan(BITS *result, const RangeScanPlan &plan, const ScanContext *ctx) {
+  if (plan.segs.empty()) return;
+  std::thread threads[THREAD_NUM];
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(refine_segments_worker, result, &plan.segs, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+}
+
+/*
+  Zone-map pruning: a zone whose [min, max] misses every range is all 0s, one
+  lying inside a single range all 1s. Only the remaining (mixed) zones are
+  combined from the filter vectors and refined, positions in decided zones
+  are dropped before their atomic flip.
+*/
+enum ZONE_CLASS {
+  ZONE_NONE = 0,  // No row selected
+  ZONE_ALL,       // Every row selected
+  ZONE_MIXED,     // Needs the filter vectors and refine
+};
+
+int classify_zones(BinDex *bindex, const RangeSet &ranges, std::vector<char> &cls) {
+  // Return the number of mixed zones
+  int zone_num = ROUNDUP_DIVIDE(bindex->length, ZONE_ROWS);
+  cls.resize(zone_num);
+  int mixed = 0;
+  for (int z = 0; z < zone_num; z++) {
+    const Zone &zone = bindex->zones[z];
+    size_t r = 0;
+    while (r < ranges.size() && ranges[r].second <= zone.min) r++;  // First range ending above min
+    if (r == ranges.size() || ranges[r].first > zone.max) {
+      cls[z] = ZONE_NONE;
+    } else if (ranges[r].first <= zone.min && zone.max < ranges[r].second) {
+      cls[z] = ZONE_ALL;
+    } else {
+      cls[z] = ZONE_MIXED;
+      mixed++;
+    }
+  }
+  return mixed;
+}
+
+void combine_zones_worker(BinDex *bindex, BITS *result, const RangeScanPlan *plan, const std::vector<char> *cls,
+                          int bitmap_len, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  bool stream = plan->fvs.size() == 1 && bitmap_kernels.stream(bitmap_len * sizeof(BITS));
+  for (size_t z = t_id; z < cls->size(); z += ctx->thread_num) {
+    int cur = z * ZONE_WORDS;
+    int end = std::min(cur + ZONE_WORDS, bitmap_len);
+    if ((*cls)[z] == ZONE_MIXED) {
+      combine_fv_words(bindex, result, &plan->fvs, plan->invert, cur, end, stream, ctx, t_id);
+    } else {
+      memset(result + cur, (*cls)[z] == ZONE_ALL ? 0xFF : 0, (end - cur) * sizeof(BITS));
+    }
+  }
+}
+
+void refine_zones_worker(BITS *result, const std::vector<PosSegment> *segs, const std::vector<char> *cls,
+                         const ScanContext *ctx, int t_id) {
+  // refine_segments_worker(..) skipping the positions of decided zones
+  pin_worker(ctx, t_id);
+  for (size_t i = t_id; i < segs->size(); i += ctx->thread_num) {
+    const PosSegment &seg = (*segs)[i];
+    if (seg.blk->runs) {
+      // Clip the runs to mixed zones
+      int from = seg.pos - seg.blk->pos;
+      for_each_run(seg.blk, from, from + seg.n, [result, cls](POSTYPE start, POSTYPE n) {
+        POSTYPE end = start + n;
+        while (start < end) {
+          POSTYPE zone_end = std::min(end, (start / ZONE_ROWS + 1) * ZONE_ROWS);
+          if ((*cls)[start / ZONE_ROWS] == ZONE_MIXED) refine_rows(result, start, zone_end - start);
+          start = zone_end;
+        }
+      });
+      continue;
+    }
+    for (int j = 0; j < seg.n; j++) {
+      POSTYPE pos = seg.pos[j];
+      if ((*cls)[pos / ZONE_ROWS] != ZONE_MIXED) continue;
+      __atomic_fetch_xor(&result[pos >> BITSSHIFT], 1U << (BITSWIDTH - 1 - pos % BITSWIDTH), __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void bindex_scan_ranges(BinDex *bindex, BITS *result, const RangeSet &ranges, const ScanContext *ctx = &default_ctx) {
+  std::vector<char> cls;
+  int mixed = classify_zones(bindex, ranges, cls);
+  RangeScanPlan plan;
+  if (mixed) plan_range_scan(bindex, ranges, plan);
+  if (mixed == (int)cls.size()) {
+    // Zone maps decide nothing
+    combine_plan_fvs(bindex, result, plan, ctx);
+    refine_plan(result, plan, ctx);
+    return;
+  }
+  for (size_t i = 0; i < plan.fvs.size(); i++) __sync_fetch_and_add(&bindex->fvHits[plan.fvs[i]], 1);
+  int bitmap_len = bits_num_needed(bindex->length);
+  std::thread threads[THREAD_NUM];
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(combine_zones_worker, bindex, result, &plan, &cls, bitmap_len, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+  if (plan.segs.empty()) return;
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(refine_zones_worker, result, &plan.segs, &cls, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+}
+
+void raw_scan_ranges(BITS *bitmap, POSTYPE n, const RangeSet &ranges, CODE *raw_data) {
+  for (POSTYPE i = 0; i < n; i++) {
+    if (range_contains(ranges, raw_data[i])) refine(bitmap, i);
+  }
+}
+
+/*
+  Approximate and progressive answers. The filter vectors alone are only
+  wrong at the positions the refine step would flip, and those are known
+  from area_counts and block lengths before touching any bitmap: the
+  unrefined result is returned right away with that many rows in doubt, and
+  the progressive mode flips them afterwards for the exact result.
+*/
+enum APPROX_MODE {
+  APPROX_OFF = 0,
+  APPROX_ONLY,         // Unrefined bitmaps and counts with error bounds
+  APPROX_PROGRESSIVE,  // Unrefined first, then refined in place
+};
+
+typedef struct {
+  POSTYPE count;  // Rows set in the unrefined bitmap
+  POSTYPE error;  // Rows the unrefined bitmap gets wrong, the exact count is within count +- error
+} ApproxResult;
+
+POSTYPE fv_rows(BinDex *bindex, int k) {
+  // Rows set in filter vector k (values below the start of area k + 1)
+  int first = k + 1;
+  while (first > 0 && area_start_value(bindex->areas[first - 1]) == area_start_value(bindex->areas[k + 1])) first--;
+  return first ? bindex->area_counts[first - 1] : 0;
+}
+
+ApproxResult plan_approx_result(BinDex *bindex, const RangeScanPlan &plan) {
+  // The filter vectors are nested prefixes, their XOR alternates sizes
+  ApproxResult res = {0, 0};
+  for (size_t i = 0; i < plan.fvs.size(); i++) {
+    POSTYPE rows = fv_rows(bindex, plan.fvs[i]);
+    res.count = (plan.fvs.size() - i) % 2 ? res.count + rows : res.count - rows;
+  }
+  if (plan.invert) res.count = bindex->length - res.count;
+  for (size_t i = 0; i < plan.segs.size(); i++) res.error += plan.segs[i].n;
+  return res;
+}
+
+ApproxResult bindex_count_approx(BinDex *bindex, const RangeSet &ranges) {
+  RangeScanPlan plan;
+  plan_range_scan(bindex, ranges, plan);
+  return plan_approx_result(bindex, plan);
+}
+
+ApproxResult bindex_scan_approx(BinDex *bindex, BITS *result, const RangeSet &ranges, RangeScanPlan *plan,
+                                const ScanContext *ctx = &default_ctx) {
+  // Leaves the positions to refine in 'plan', refine_plan(..) makes the result exact
+  plan_range_scan(bindex, ranges, *plan);
+  combine_plan_fvs(bindex, result, *plan, ctx);
+  return plan_approx_result(bindex, *plan);
+}
+
+APPROX_MODE parse_approx_mode(const char *s) {
+  if (!strcmp(s, "approx")) return APPROX_ONLY;
+  if (!strcmp(s, "progressive")) return APPROX_PROGRESSIVE;
+  assert(!strcmp(s, "off"));
+  return APPROX_OFF;
+}
+
+/*
+  LIMIT / OFFSET. Over a finished result bitmap, a rank/select index finds the
+  first row of a page without scanning from the start. Without one, the
+  predicates are evaluated tile by tile in row order and evaluation stops once
+  offset + k rows qualified: a tile is its filter vector words plus the
+  refine positions that fall into it, bucketed by tile for the tiles ahead
+  only, so positions past the stopping point are never collected.
+*/
+#define LIMIT_TILE_WORDS 2048  // 64K rows
+
+int bitmap_page(const BitmapRankIndex &index, POSTYPE n, POSTYPE offset, int k, POSTYPE *rows) {
+  // Rows offset .. offset + k - 1 of the set bits among the first n rows
+  if (offset >= (POSTYPE)index.count()) return 0;
+  int found = 0;
+  POSTYPE row = index.select(offset);
+  int w = row >> BITSSHIFT;
+  BITS bits = index.bitmap[w] & (~0U >> (row % BITSWIDTH));
+  while (found < k) {
+    while (!bits) {
+      if (++w >= index.words) return found;
+      bits = index.bitmap[w];
+    }
+    int b = __builtin_clz(bits);
+    if (w * BITSWIDTH + b >= n) break;  // bits past the last row
+    rows[found++] = w * BITSWIDTH + b;
+    bits &= ~(0x80000000U >> b);
+  }
+  return found;
+}
+
+void bucket_limit_tiles(const RangeScanPlan &plan, int lo, int hi, std::vector<POSTYPE> &begin,
+                        std::vector<POSTYPE> &tile_pos) {
+  // CSR of the refine positions that fall into tiles [lo, hi), begin[t - lo]
+  // is the first one of tile t
+  begin.assign(hi - lo + 1, 0);
+  for (size_t s = 0; s < plan.segs.size(); s++) {
+    for (int j = 0; j < plan.segs[s].n; j++) {
+      int t = (plan.segs[s].pos[j] >> BITSSHIFT) / LIMIT_TILE_WORDS;
+      if (t >= lo && t < hi) begin[t - lo + 1]++;
+    }
+  }
+  for (int t = 0; t < hi - lo; t++) begin[t + 1] += begin[t];
+  std::vector<POSTYPE> fill(begin.begin(), begin.end() - 1);
+  tile_pos.resize(begin[hi - lo]);
+  for (size_t s = 0; s < plan.segs.size(); s++) {
+    for (int j = 0; j < plan.segs[s].n; j++) {
+      POSTYPE pos = plan.segs[s].pos[j];
+      int t = (pos >> BITSSHIFT) / LIMIT_TILE_WORDS;
+      if (t >= lo && t < hi) tile_pos[fill[t - lo]++] = pos;
+    }
+  }
+}
+
+int bindex_limit_scan(BinDex **bindexs, const RangeSet *ranges, int column_num, POSTYPE offset, int k,
+                      POSTYPE *rows, int *tiles_done = NULL) {
+  // Rows offset .. offset + k - 1 (in row order) of the AND of ranges[c] on
+  // column c, returns how many exist
+  POSTYPE n = bindexs[0]->length;
+  int bitmap_len = bits_num_needed(n);
+  int tile_num = ROUNDUP_DIVIDE(bitmap_len, LIMIT_TILE_WORDS);
+  std::vector<RangeScanPlan> plans(column_num);
+  std::vector<std::vector<POSTYPE> > tile_begin(column_num), tile_pos(column_num);
+  double sel = 1;
+  for (int c = 0; c < column_num; c++) {
+    assert(bindexs[c]->length == n);
+    plan_range_scan(bindexs[c], ranges[c], plans[c]);
+    sel *= n ? (double)bindex_count_ranges(bindexs[c], ranges[c]) / n : 0;
+  }
+  if (sel == 0) {
+    // Some column has no qualifying row
+    if (tiles_done) *tiles_done = 0;
+    return 0;
+  }
+  // Refine positions are bucketed only up to a horizon of tiles, first where
+  // twice the needed rows are expected (columns taken as independent), then
+  // doubled while rows are still missing
+  double expected_tiles = 2.0 * ((double)offset + k) / std::max(sel * LIMIT_TILE_WORDS * BITSWIDTH, 1e-9);
+  int horizon = (int)std::max(1.0, std::min((double)tile_num, ceil(expected_tiles)));
+  int tile_lo = 0, tile_hi = 0;  // Bucketed tiles
+
+  std::vector<BITS> tile(LIMIT_TILE_WORDS), acc(LIMIT_TILE_WORDS);
+  POSTYPE skip = offset;
+  int found = 0, t = 0;
+  for (; t < tile_num && found < k; t++) {
+    if (t == tile_hi) {
+      tile_lo = tile_hi;
+      tile_hi = std::min(tile_num, tile_lo ? 2 * tile_lo : horizon);
+      for (int c = 0; c < column_num; c++) bucket_limit_tiles(plans[c], tile_lo, tile_hi, tile_begin[c], tile_pos[c]);
+    }
+    int w0 = t * LIMIT_TILE_WORDS, nw = std::min(LIMIT_TILE_WORDS, bitmap_len - w0);
+    for (int c = 0; c < column_num; c++) {
+      const RangeScanPlan &plan = plans[c];
+      BITS *out = c ? tile.data() : acc.data();
+      if (plan.fvs.empty()) {
+        memset(out, plan.invert ? 0xFF : 0, nw * sizeof(BITS));
+      } else if (plan.invert) {
+        bitmap_kernels.not_(out, bindexs[c]->filterVectors[plan.fvs[0]] + w0, NULL, nw, false);
+      } else {
+        bitmap_kernels.copy(out, bindexs[c]->filterVectors[plan.fvs[0]] + w0, NULL, nw, false);
+      }
+      for (size_t i = 1; i < plan.fvs.size(); i++) {
+        bitmap_kernels.xor_(out, out, bindexs[c]->filterVectors[plan.fvs[i]] + w0, nw, false);
+      }
+      for (POSTYPE i = tile_begin[c][t - tile_lo]; i < tile_begin[c][t - tile_lo + 1]; i++) {
+        POSTYPE pos = tile_pos[c][i];
+        out[(pos >> BITSSHIFT) - w0] ^= 1U << (BITSWIDTH - 1 - pos % BITSWIDTH);
+      }
+      if (c) {
+        for (int i = 0; i < nw; i++) acc[i] &= tile[i];
+      }
+    }
+    if (t == tile_num - 1 && n % BITSWIDTH) acc[nw - 1] &= ~0U << (BITSWIDTH - n % BITSWIDTH);
+    for (int i = 0; i < nw && found < k; i++) {
+      BITS bits = acc[i];
+      POSTYPE count = __builtin_popcount(bits);
+      if (skip >= count) {
+        skip -= count;
+        continue;
+      }
+      while (bits && found < k) {
+        int b = __builtin_clz(bits);
+        bits &= ~(0x80000000U >> b);
+        if (skip) {
+          skip--;
+          continue;
+        }
+        rows[found++] = (w0 + i) * BITSWIDTH + b;
+      }
+    }
+  }
+  if (tiles_done) *tiles_done = t;
+  return found;
+}
+
+/*
+  Selectivity-ordered conjunctions. Columns are evaluated from the one with
+  the fewest qualifying rows (index-only counts) on, the first one in full.
+  A coarse segment mask then marks the segments of the result that still
+  have rows, and later columns copy filter vectors, refine and AND only
+  inside live segments, so once the result is empty the rest is skipped.
+  Refine positions are bucketed by segment, so a segment is finished by one
+  worker without atomics.
+*/
+#define CONJ_SEGMENT_WORDS 256  // 8K rows
+
+void conj_mask_worker(BITS *result, std::vector<char> *mask, int bitmap_len, const ScanContext *ctx, int t_id) {
+  pin_worker(ctx, t_id);
+  for (size_t seg = t_id; seg < mask->size(); seg += ctx->thread_num) {
+    int w0 = seg * CONJ_SEGMENT_WORDS, end = std::min(w0 + CONJ_SEGMENT_WORDS, bitmap_len);
+    BITS any = 0;
+    for (int w = w0; w < end; w++) any |= result[w];
+    (*mask)[seg] = any != 0;
+  }
+}
+
+void conj_segment_worker(BinDex *bindex, BITS *result, const RangeScanPlan *plan, const std::vector<int> *live,
+                         const std::vector<POSTYPE> *seg_begin, const std::vector<POSTYPE> *seg_pos,
+                         std::vector<char> *mask, int bitmap_len, const ScanContext *ctx, int t_id) {
+  // For each live segment of this worker: the column's words from its filter
+  // vectors and refine positions, ANDed into the result. Segments that end
+  // up all zero die.
+  pin_worker(ctx, t_id);
+  BITS tile[CONJ_SEGMENT_WORDS];
+  for (size_t i = t_id; i < live->size(); i += ctx->thread_num) {
+    int seg = (*live)[i];
+    int w0 = seg * CONJ_SEGMENT_WORDS, nw = std::min(CONJ_SEGMENT_WORDS, bitmap_len - w0);
+    if (plan->fvs.empty()) {
+      memset(tile, plan->invert ? 0xFF : 0, nw * sizeof(BITS));
+    } else if (plan->invert) {
+      bitmap_kernels.not_(tile, local_fv(bindex, plan->fvs[0], ctx, t_id) + w0, NULL, nw, false);
+    } else {
+      bitmap_kernels.copy(tile, local_fv(bindex, plan->fvs[0], ctx, t_id) + w0, NULL, nw, false);
+    }
+    for (size_t k = 1; k < plan->fvs.size(); k++) {
+      bitmap_kernels.xor_(tile, tile, local_fv(bindex, plan->fvs[k], ctx, t_id) + w0, nw, false);
+    }
+    for (POSTYPE j = (*seg_begin)[seg]; j < (*seg_begin)[seg + 1]; j++) {
+      POSTYPE pos = (*seg_pos)[j];
+      tile[(pos >> BITSSHIFT) - w0] ^= 1U << (BITSWIDTH - 1 - pos % BITSWIDTH);
+    }
+    BITS any = 0;
+    for (int w = 0; w < nw; w++) any |= (result[w0 + w] &= tile[w]);
+    (*mask)[seg] = any != 0;
+  }
+}
+
+void bindex_scan_conjunction(BinDex **bindexs, const RangeSet *ranges, int column_num, BITS *result,
+                             const ScanContext *ctx = &default_ctx) {
+  // AND of ranges[c] on column c. Snapshots may differ in length, only the
+  // rows all of them have count.
+  POSTYPE n = bindexs[0]->length;
+  for (int c = 1; c < column_num; c++) n = std::min(n, bindexs[c]->length);
+  int bitmap_len = bits_num_needed(n);
+  int segment_num = ROUNDUP_DIVIDE(bitmap_len, CONJ_SEGMENT_WORDS);
+  int order[MAX_BINDEX_NUM];
+  POSTYPE counts[MAX_BINDEX_NUM];
+  for (int c = 0; c < column_num; c++) {
+    order[c] = c;
+    counts[c] = bindex_count_ranges(bindexs[c], ranges[c]);
+  }
+  std::stable_sort(order, order + column_num, [&counts](int a, int b) { return counts[a] < counts[b]; });
+
+  bindex_scan_ranges(bindexs[order[0]], result, ranges[order[0]], ctx);
+  std::vector<char> mask(segment_num);
+  std::thread threads[THREAD_NUM];
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(conj_mask_worker, result, &mask, bitmap_len, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+  std::vector<int> live;
+  for (int seg = 0; seg < segment_num; seg++) {
+    if (mask[seg]) live.push_back(seg);
+  }
+  printf("[CONJ] c%d: %d rows (%d/%d segments live)", order[0], counts[order[0]], (int)live.size(), segment_num);
+
+  std::vector<POSTYPE> seg_begin(segment_num + 1), seg_pos;
+  int step = 1;
+  for (; step < column_num && !live.empty(); step++) {
+    int c = order[step];
+    RangeScanPlan plan;
+    plan_range_scan(bindexs[c], ranges[c], plan);
+    for (size_t i = 0; i < plan.fvs.size(); i++) __sync_fetch_and_add(&bindexs[c]->fvHits[plan.fvs[i]], 1);
+    // Refine positions bucketed by segment, those in dead segments are dropped
+    std::fill(seg_begin.begin(), seg_begin.end(), 0);
+    for (size_t i = 0; i < plan.segs.size(); i++) {
+      for (int j = 0; j < plan.segs[i].n; j++) {
+        POSTYPE pos = plan.segs[i].pos[j];
+        int seg = (pos >> BITSSHIFT) / CONJ_SEGMENT_WORDS;
+        if (pos < n && mask[seg]) seg_begin[seg + 1]++;
+      }
+    }
+    for (int seg = 0; seg < segment_num; seg++) seg_begin[seg + 1] += seg_begin[seg];
+    seg_pos.resize(seg_begin[segment_num]);
+    std::vector<POSTYPE> fill(seg_begin.begin(), seg_begin.end() - 1);
+    for (size_t i = 0; i < plan.segs.size(); i++) {
+      for (int j = 0; j < plan.segs[i].n; j++) {
+        POSTYPE pos = plan.segs[i].pos[j];
+        int seg = (pos >> BITSSHIFT) / CONJ_SEGMENT_WORDS;
+        if (pos < n && mask[seg]) seg_pos[fill[seg]++] = pos;
+      }
+    }
+
+    for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+      threads[t_id] = std::thread(conj_segment_worker, bindexs[c], result, &plan, &live, &seg_begin, &seg_pos, &mask,
+                                  bitmap_len, ctx, t_id);
+    }
+    for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+    // Segments that died are all zero in the result already
+    size_t alive = 0;
+    for (size_t i = 0; i < live.size(); i++) {
+      if (mask[live[i]]) live[alive++] = live[i];
+    }
+    live.resize(alive);
+    printf(", c%d: %d (%d/%d segments live)", c, counts[c], (int)alive, segment_num);
+  }
+  if (step < column_num) printf(", %d columns skipped", column_num - step);
+  printf("\n");
+}
+
+void raw_scan(BinDex *bindex, BITS *bitmap, CODE target1, CODE target2, OPERATOR OP, CODE *raw_data, BITS* compare_bitmap = NULL)
+{
+  for(int i = 0; i < bindex->length; i++) {
+    bool hit = false;
+    switch (OP)
+    {
+    case LT:
+      if (raw_data[i] < target1) hit = true;
+      break;
+    case LE:
+      if (raw_data[i] <= target1) hit = true;
+      break;
+    case GT:
+      if (raw_data[i] > target1) hit = true;
+      break;
+    case GE:
+      if (raw_data[i] >= target1) hit = true;
+      break;
+    case EQ:
+      if (raw_data[i] == target1) hit = true;
+      break;
+    case BT:
+      if (raw_data[i] > target1 && raw_data[i] < target2) hit = true;
+      break;
+    default:
+      break;
+    }
+    if (hit) {
+      // bitmap[i >> BITSSHIFT] |= (1U << (BITSWIDTH - 1 - i % BITSWIDTH));
+      if (compare_bitmap != NULL) {
+        int compare_bit = (compare_bitmap[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH)));
+        if(compare_bitmap == 0) {
+          printf("[ERROR] check error in raw_data[%d]=", i);
+          printf(" %u\n", raw_data[i]);
+          break;
+        }
+      } else {
+        refine(bitmap, i);
+      }
+    }
+  }
+}
+
+void raw_scan_entry(std::vector<CODE>* target_l, std::vector<CODE>* target_r, std::string search_cmd, BinDex* bindex, BITS* bitmap, BITS* mergeBitmap, CODE* raw_data, const RangeSet* ranges = NULL) {
+  CODE target1, target2;
+
+  if (search_cmd == "expr") {
+    // Its one dummy target matches no operator below, still merged at the end
+    raw_scan_ranges(bitmap, bindex->length, *ranges, raw_data);
+  }
+
+  for (int pi = 0; pi < target_l->size(); pi++) {
+    target1 = (*target_l)[pi];
     if (target_r->size() != 0) {
       assert(search_cmd == "bt");
       target2 = (*target_r)[pi];
     }
-    if (search_cmd == "bt" && target1 > target2) {
-      std::swap(target1, target2);
+    if (search_cmd == "bt" && target1 > target2) {
+      std::swap(target1, target2);
+    }
+
+    if (search_cmd == "lt") {
+      raw_scan(bindex, bitmap, target1, 0, LT, raw_data);
+    } else if (search_cmd == "le") {
+      raw_scan(bindex, bitmap, target1, 0, LE, raw_data);
+    } else if (search_cmd == "gt") {
+      raw_scan(bindex, bitmap, target1, 0, GT, raw_data);
+    } else if (search_cmd == "ge") {
+      raw_scan(bindex, bitmap, target1, 0, GE, raw_data);
+    } else if (search_cmd == "eq") {
+      raw_scan(bindex, bitmap, target1, 0, EQ, raw_data);
+    } else if (search_cmd == "bt") {
+      raw_scan(bindex, bitmap, target1, target2, BT, raw_data);
+    }
+  }
+
+  /* for (int bindex_id = 1; bindex_id < bindex_num; bindex_id++) {
+    for (int m = 0; m < bitmap_len; m++) {
+      bitmap[0][m] = bitmap[0][m] & bitmap[m];
+    }
+  } */
+
+  // CPU merge
+  // int stride = 156250;
+  // if (N / stride / CODEWIDTH > THREAD_NUM) {
+  //   stride = N / THREAD_NUM / CODEWIDTH;
+  //   printf("No enough threads, set stride to %d\n", stride);
+  // }
+  
+  int max_idx = (N + CODEWIDTH - 1) / CODEWIDTH;
+  int stride = (max_idx + THREAD_NUM - 1) / THREAD_NUM;
+
+  if (mergeBitmap != bitmap) {
+    std::thread threads[THREAD_NUM];
+    int start_idx = 0;
+    int end_idx = 0;
+    size_t t_id = 0;
+    while (end_idx < max_idx && t_id < THREAD_NUM) {
+      end_idx = start_idx + stride;
+      if (end_idx > max_idx) {
+        end_idx = max_idx;
+      }
+      // printf("start idx: %d end idx: %d\n",start_idx, end_idx);
+      // refine_result_bitmap(mergeBitmap, bitmap, start_idx, end_idx, t_id);
+      threads[t_id] = std::thread(refine_result_bitmap, mergeBitmap, bitmap, start_idx, end_idx, &default_ctx, t_id);
+      start_idx += stride;
+      t_id += 1;
+    }
+    for (int i = 0; i < THREAD_NUM; i++)
+      threads[i].join();
+  }
+}
+
+void compare_bitmap(BITS *bitmap_a, BITS *bitmap_b, int len, CODE **raw_data, int bindex_num)
+{
+  int total_hit = 0;
+  int true_hit = 0;
+  for (int i = 0; i < len; i++) {
+    int data_a = (bitmap_a[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH)));
+    int data_b = (bitmap_b[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH)));
+    if (data_a) {
+      total_hit += 1;
+      if (data_b) true_hit += 1;
+    }
+    if (data_a != data_b) {
+      printf("[ERROR] check error in raw_data[%d]=", i);
+      for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) printf(" %u", raw_data[bindex_id][i]);
+      printf("\n");
+      printf("the correct is %#x, but we have %#x\n", data_a, data_b);
+      break;
+    }
+  }
+  printf("[CHECK]hit %d/%d\n", true_hit, total_hit);
+}
+
+void start_timer(struct timeval* t) {
+    gettimeofday(t, NULL);
+}
+
+void stop_timer(struct timeval* t, double* elapsed_time) {
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    *elapsed_time += (end.tv_sec - t->tv_sec) * 1000.0 + (end.tv_usec - t->tv_usec) / 1000.0;
+}
+
+void append_worker(VersionedBinDex **vbindexs, CODE **raw_datas, int bindex_num, POSTYPE start, POSTYPE end) {
+  // Append rows [start, end) of every column in batches, readers keep scanning
+  // pinned snapshots meanwhile
+  POSTYPE batch = std::max((end - start) / 16, 1);
+  for (POSTYPE cur = start; cur < end; cur += batch) {
+    POSTYPE n = std::min(batch, end - cur);
+    for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+      append_to_bindex_snapshot(vbindexs[bindex_id], raw_datas[bindex_id] + cur, n, raw_datas[bindex_id]);
+    }
+  }
+  printf("[SNAPSHOT] appended %d rows in %f ms\n", end - start, append_timer.time[1]);
+}
+
+void run_scan_cmd(BinDex *bindex, BITS *result, const string &search_cmd, CODE target1, CODE target2,
+                  const ScanContext *ctx) {
+  if (search_cmd == "lt") {
+    bindex_scan_lt(bindex, result, target1, ctx);
+  } else if (search_cmd == "le") {
+    bindex_scan_le(bindex, result, target1, ctx);
+  } else if (search_cmd == "gt") {
+    bindex_scan_gt(bindex, result, target1, ctx);
+  } else if (search_cmd == "ge") {
+    bindex_scan_ge(bindex, result, target1, ctx);
+  } else if (search_cmd == "eq") {
+    bindex_scan_eq(bindex, result, target1, ctx);
+  } else if (search_cmd == "bt") {
+    if (target1 > target2) std::swap(target1, target2);
+    bindex_scan_bt(bindex, result, target1, target2, ctx);
+  }
+}
+
+/*
+  Shared scans: a batch of lt/le/gt/ge predicates on one column. Borders are
+  sorted and located in one merge walk over areas and blocks, every filter
+  vector is read once per tile for all queries starting from it, and queries
+  refining the same area share one pass over its positions.
+*/
+#define BATCH_TILE_WORDS 4096  // 16 KB of every filter vector, read once, stays in L1 for all its queries
+
+typedef struct {
+  CODE border;       // Result is lt(border), or its complement
+  bool above_max;    // le/gt the largest code, lt(border + 1) is all rows
+  bool invert;
+  BITS *result;
+  int fv;            // Filter vector the result starts from, -1: no rows, K - 1: all rows
+  bool prefix;       // Refine [start of the area run, rank of border) instead of [rank, end of area)
+  POSTYPE lo, hi;    // Global ranks of the positions to refine
+} BatchQuery;
+
+bool batch_query_to_lt(const string &search_cmd, CODE target, BatchQuery *query) {
+  // lt/le/gt/ge as (complement of) one lt border, false for anything else
+  query->above_max = false;
+  if (search_cmd == "lt" || search_cmd == "ge") {
+    query->border = target;
+    query->invert = search_cmd == "ge";
+    return true;
+  }
+  if (search_cmd == "le" || search_cmd == "gt") {
+    query->above_max = target == (CODE)~(CODE)0;
+    query->border = query->above_max ? target : target + 1;
+    query->invert = search_cmd == "gt";
+    return true;
+  }
+  return false;
+}
+
+void add_rank_segments(BinDex *bindex, POSTYPE lo, POSTYPE hi, std::vector<PosSegment> &segs) {
+  // Positions of the global ranks [lo, hi)
+  int a = std::upper_bound(bindex->area_counts, bindex->area_counts + K, lo) - bindex->area_counts;
+  for (; a < K && lo < hi; a++) {
+    POSTYPE begin = bindex->area_counts[a] - bindex->areas[a]->length;
+    POSTYPE end = std::min(hi, bindex->area_counts[a]);
+    add_area_segments(bindex->areas[a], lo - begin, end - begin, segs);
+    lo = end;
+  }
+}
+
+void batch_fv_worker(BinDex *bindex, std::vector<BatchQuery> *queries, int bitmap_len, bool stream,
+                     const ScanContext *ctx, int t_id) {
+  // Queries are sorted by filter vector, so each tile of a vector is loaded
+  // from memory once and copied from cache into the results of all its queries
+  int jobs = ((bitmap_len / SIMD_JOB_UNIT - 1) / ctx->thread_num + 1) * SIMD_JOB_UNIT;
+  pin_worker(ctx, t_id);
+  int begin = t_id * jobs;
+  int end = std::min((t_id + 1) * jobs, bitmap_len);
+  for (int cur = begin; cur < end; cur += BATCH_TILE_WORDS) {
+    int n = std::min(BATCH_TILE_WORDS, end - cur);
+    for (size_t q = 0; q < queries->size(); q++) {
+      BatchQuery &query = (*queries)[q];
+      if (query.fv < 0 || query.fv >= K - 1) {
+        memset(query.result + cur, (query.fv < 0) != query.invert ? 0 : 0xFF, n * sizeof(BITS));
+      } else if (query.invert) {
+        bitmap_kernels.not_(query.result + cur, local_fv(bindex, query.fv, ctx, t_id) + cur, NULL, n, stream);
+      } else {
+        bitmap_kernels.copy(query.result + cur, local_fv(bindex, query.fv, ctx, t_id) + cur, NULL, n, stream);
+      }
+    }
+  }
+}
+
+void batch_refine_worker(BinDex *bindex, std::vector<BatchQuery> *queries, std::vector<std::pair<int, int> > *groups,
+                         const ScanContext *ctx, int t_id) {
+  // Queries of a group refine nested rank ranges sharing one end, [lo, hi_1)
+  // .. [lo, hi_m) or [lo_1, hi) .. [lo_m, hi), so every position of the group
+  // is loaded once and flipped in all results covering it. A group belongs to
+  // one worker, no two workers write the same result.
+  pin_worker(ctx, t_id);
+  for (size_t g = t_id; g < groups->size(); g += ctx->thread_num) {
+    int first = (*groups)[g].first, last = (*groups)[g].second;
+    std::vector<POSTYPE> cuts;  // Sorted borders of the pieces
+    bool prefix = (*queries)[first].prefix;
+    for (int q = first; q < last; q++) cuts.push_back(prefix ? (*queries)[q].hi : (*queries)[q].lo);
+    cuts.insert(prefix ? cuts.begin() : cuts.end(), prefix ? (*queries)[first].lo : (*queries)[first].hi);
+    for (size_t c = 0; c + 1 < cuts.size(); c++) {
+      // Piece [cuts[c], cuts[c + 1]) belongs to queries first + c.. (prefix) or ..first + c (suffix)
+      int q_begin = prefix ? first + c : first, q_end = prefix ? last : first + c + 1;
+      std::vector<PosSegment> segs;
+      add_rank_segments(bindex, cuts[c], cuts[c + 1], segs);
+      for (size_t s = 0; s < segs.size(); s++) {
+        if (segs[s].blk->runs) {
+          // Whole words of a run at once, the results are only written here
+          int from = segs[s].pos - segs[s].blk->pos;
+          for_each_run(segs[s].blk, from, from + segs[s].n, [queries, q_begin, q_end](POSTYPE start, POSTYPE n) {
+            for_each_row_word(start, n, [queries, q_begin, q_end](int w, BITS mask) {
+              for (int q = q_begin; q < q_end; q++) (*queries)[q].result[w] ^= mask;
+            });
+          });
+          continue;
+        }
+        for (int j = 0; j < segs[s].n; j++) {
+          POSTYPE pos = segs[s].pos[j];
+          BITS mask = 1U << (BITSWIDTH - 1 - pos % BITSWIDTH);
+          for (int q = q_begin; q < q_end; q++) (*queries)[q].result[pos >> BITSSHIFT] ^= mask;
+        }
+      }
+    }
+  }
+}
+
+void bindex_scan_batch(BinDex *bindex, const std::vector<string> &search_cmds, const std::vector<CODE> &targets1,
+                       const std::vector<CODE> &targets2, BITS **results, const ScanContext *ctx = &default_ctx) {
+  // results[i] = search_cmds[i] targets1[i] (targets2[i]), predicates other
+  // than lt/le/gt/ge are scanned one by one
+  std::vector<BatchQuery> queries;
+  for (size_t i = 0; i < targets1.size(); i++) {
+    BatchQuery query;
+    if (!batch_query_to_lt(search_cmds[i], targets1[i], &query)) {
+      run_scan_cmd(bindex, results[i], search_cmds[i], targets1[i], targets2[i], ctx);
+      continue;
+    }
+    query.result = results[i];
+    queries.push_back(query);
+  }
+  if (queries.empty()) return;
+  std::sort(queries.begin(), queries.end(),
+            [](const BatchQuery &a, const BatchQuery &b) { return a.border < b.border; });
+
+  // Merge walk: area, block and rank only move forward
+  int a = 0, blk = 0;
+  POSTYPE block_rank = 0;  // Global rank of blocks[blk][0]
+  for (size_t q = 0; q < queries.size(); q++) {
+    BatchQuery &query = queries[q];
+    if (query.above_max) {
+      query.fv = K - 1;
+      query.prefix = false;
+      query.lo = query.hi = bindex->length;
+      continue;
+    }
+    POSTYPE rank = 0;
+    if (query.border > area_start_value(bindex->areas[0])) {
+      while (a + 1 < K && area_start_value(bindex->areas[a + 1]) < query.border) {
+        a++;
+        blk = 0;
+        block_rank = bindex->area_counts[a] - bindex->areas[a]->length;
+      }
+      Area *area = bindex->areas[a];
+      while (blk + 1 < area->blockNum && block_start_value(area->blocks[blk + 1]) < query.border) {
+        block_rank += area->blocks[blk++]->length;
+      }
+      rank = block_rank + on_which_pos(area->blocks[blk], query.border);
+    }
+    // Same choice as for a lone border of bindex_scan_ranges(..)
+    int first = a;
+    while (first > 0 && area_start_value(bindex->areas[first - 1]) == area_start_value(bindex->areas[a])) first--;
+    POSTYPE run_begin = first ? bindex->area_counts[first - 1] : 0;
+    if (rank - run_begin <= bindex->area_counts[a] - rank) {
+      query.fv = first - 1;
+      query.prefix = true;
+      query.lo = run_begin;
+      query.hi = rank;
+    } else {
+      query.fv = a;
+      query.prefix = false;
+      query.lo = rank;
+      query.hi = bindex->area_counts[a];
+    }
+  }
+
+  // Group by filter vector and refine side, borders stay sorted inside a group
+  std::stable_sort(queries.begin(), queries.end(), [](const BatchQuery &a, const BatchQuery &b) {
+    return a.fv < b.fv || (a.fv == b.fv && a.prefix < b.prefix);
+  });
+  std::vector<std::pair<int, int> > groups;  // [first, last) of queries refining the same area run
+  int fv_num = 0;
+  for (size_t q = 0; q < queries.size(); q++) {
+    if (q && queries[q].fv == queries[q - 1].fv && queries[q].prefix == queries[q - 1].prefix) {
+      groups.back().second++;
+      continue;
+    }
+    groups.push_back(std::make_pair((int)q, (int)q + 1));
+    if (q && queries[q].fv == queries[q - 1].fv) continue;
+    if (queries[q].fv >= 0 && queries[q].fv < K - 1) {
+      __sync_fetch_and_add(&bindex->fvHits[queries[q].fv], 1);
+      fv_num++;
     }
+  }
+  int bitmap_len = bits_num_needed(bindex->length);
+  bool stream = bitmap_kernels.stream(queries.size() * bitmap_len * sizeof(BITS));
 
-    if (search_cmd == "lt") {
-      raw_scan(bindex, bitmap, target1, 0, LT, raw_data);
-    } else if (search_cmd == "le") {
-      raw_scan(bindex, bitmap, target1, 0, LE, raw_data);
-    } else if (search_cmd == "gt") {
-      raw_scan(bindex, bitmap, target1, 0, GT, raw_data);
-    } else if (search_cmd == "ge") {
-      raw_scan(bindex, bitmap, target1, 0, GE, raw_data);
-    } else if (search_cmd == "eq") {
-      raw_scan(bindex, bitmap, target1, 0, EQ, raw_data);
-    } else if (search_cmd == "bt") {
-      raw_scan(bindex, bitmap, target1, target2, BT, raw_data);
+  std::thread threads[THREAD_NUM];
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(batch_fv_worker, bindex, &queries, bitmap_len, stream, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(batch_refine_worker, bindex, &queries, &groups, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+  printf("[BATCH] %d queries, %d filter vectors read\n", (int)queries.size(), fv_num);
+}
+
+/*
+  Planner, picks per predicate between the BinDex scan (copy filter vectors +
+  refine), a SIMD scan of the raw column and, for tiny ranges, setting the
+  qualifying positions directly
+*/
+enum SCAN_PLAN { PLAN_AUTO = -1, PLAN_BINDEX = 0, PLAN_RAW_SCAN, PLAN_DIRECT, PLAN_CONSTANT };
+
+const char *plan_name(SCAN_PLAN plan) {
+  switch (plan) {
+    case PLAN_RAW_SCAN:
+      return "raw scan";
+    case PLAN_DIRECT:
+      return "direct";
+    case PLAN_CONSTANT:
+      return "constant";
+    default:
+      return "bindex";
+  }
+}
+
+typedef struct {
+  // Single thread numbers, GB/s == bytes/ns
+  double copy_gbps;    // bitmap copy, bytes read + written
+  double scan_gbps;    // raw column bytes scanned into a bitmap
+  double memset_gbps;  // bitmap clearing
+  double refine_ns;    // one refine at a random position
+  double spawn_ms;     // launching and joining one round of scan workers
+} PlannerCalibration;
+
+PlannerCalibration planner_calib = {8.0, 4.0, 16.0, 5.0, 0.05};  // until calibrate_planner()
+
+typedef struct {
+  bool empty;            // no value can qualify
+  CODE lo, hi;           // predicate as lo <= x <= hi
+  POSTYPE count;         // exact number of qualifying rows
+  POSTYPE refine;        // estimated positions the BinDex scan refines
+  int filter_vectors;    // filter vectors the BinDex scan reads
+  double cost_ms[3];     // per SCAN_PLAN
+  SCAN_PLAN plan;
+} ScanEstimate;
+
+bool predicate_range(const string &search_cmd, CODE target1, CODE target2, CODE *lo, CODE *hi) {
+  // Closed range of a predicate, false if it is empty
+  const CODE max_code = (CODE)~(CODE)0;
+  if (search_cmd == "bt" && target1 > target2) std::swap(target1, target2);
+  *lo = 0;
+  *hi = max_code;
+  if (search_cmd == "lt") {
+    if (target1 == 0) return false;
+    *hi = target1 - 1;
+  } else if (search_cmd == "le") {
+    *hi = target1;
+  } else if (search_cmd == "gt") {
+    if (target1 == max_code) return false;
+    *lo = target1 + 1;
+  } else if (search_cmd == "ge") {
+    *lo = target1;
+  } else if (search_cmd == "eq") {
+    *lo = *hi = target1;
+  } else if (search_cmd == "bt") {
+    if (target2 - target1 < 2) return false;
+    *lo = target1 + 1;
+    *hi = target2 - 1;
+  } else {
+    assert(0);
+  }
+  return true;
+}
+
+POSTYPE boundary_refine(BinDex *bindex, POSTYPE rank, int area_idx) {
+  // Refines for a bound at 'rank': the smaller side of its area
+  POSTYPE area_begin = area_idx ? bindex->area_counts[area_idx - 1] : 0;
+  POSTYPE area_len = bindex->area_counts[area_idx] - area_begin;
+  return std::min(rank - area_begin, area_len - (rank - area_begin));
+}
+
+ScanEstimate estimate_scan(BinDex *bindex, const string &search_cmd, CODE target1, CODE target2,
+                           const ScanContext *ctx = &default_ctx) {
+  // Exact selectivity and a cost estimate of every plan, from area_counts and
+  // block boundaries only
+  ScanEstimate est;
+  est.empty = !predicate_range(search_cmd, target1, target2, &est.lo, &est.hi);
+  est.count = est.refine = 0;
+  est.filter_vectors = 0;
+  if (!est.empty) {
+    int area_idx, block_idx, pos_idx;
+    POSTYPE rank_lo = bindex_locate_lt(bindex, est.lo, &area_idx, &block_idx, &pos_idx);
+    if (est.lo > 0) {
+      est.refine += boundary_refine(bindex, rank_lo, area_idx);
+      est.filter_vectors++;
     }
+    POSTYPE rank_hi = bindex->length;
+    if (est.hi < (CODE)~(CODE)0) {
+      rank_hi = bindex_locate_lt(bindex, est.hi + 1, &area_idx, &block_idx, &pos_idx);
+      est.refine += boundary_refine(bindex, rank_hi, area_idx);
+      est.filter_vectors++;
+    }
+    est.count = rank_hi - rank_lo;
   }
 
-  /* for (int bindex_id = 1; bindex_id < bindex_num; bindex_id++) {
-    for (int m = 0; m < bitmap_len; m++) {
-      bitmap[0][m] = bitmap[0][m] & bitmap[m];
+  // Workers beyond the online cpus don't add bandwidth
+  double threads = std::max(1, std::min(ctx->thread_num, (int)std::thread::hardware_concurrency()));
+  double bitmap_bytes = bits_num_needed(bindex->length) * sizeof(BITS);
+  const PlannerCalibration &c = planner_calib;
+  // copy + refine, one round of workers each
+  est.cost_ms[PLAN_BINDEX] =
+      (bitmap_bytes * (1 + est.filter_vectors) / c.copy_gbps + est.refine * c.refine_ns) / threads / 1e6 +
+      2 * c.spawn_ms;
+  est.cost_ms[PLAN_RAW_SCAN] = sizeof(CODE) == sizeof(uint32_t)
+                                   ? (double)bindex->length * sizeof(CODE) / c.scan_gbps / threads / 1e6 + c.spawn_ms
+                                   : 1e30;  // the kernels only scan 32-bit codes
+  // parallel clear, then single thread refine
+  est.cost_ms[PLAN_DIRECT] = (bitmap_bytes / c.memset_gbps / threads + est.count * c.refine_ns) / 1e6 + c.spawn_ms;
+  est.plan = PLAN_BINDEX;
+  for (int p = PLAN_RAW_SCAN; p <= PLAN_DIRECT; p++) {
+    if (est.cost_ms[p] < est.cost_ms[est.plan]) est.plan = (SCAN_PLAN)p;
+  }
+  // Nothing or everything qualifies, the result is known without scanning
+  if (est.count == 0 || est.count == bindex->length) est.plan = PLAN_CONSTANT;
+  return est;
+}
+
+void raw_scan_worker(BITS *result, CODE *raw_data, CODE lo, CODE hi, int full_words, const ScanContext *ctx,
+                     int t_id) {
+  pin_worker(ctx, t_id);
+  int jobs = ROUNDUP_DIVIDE(full_words, ctx->thread_num);
+  int start = t_id * jobs;
+  int end = std::min(start + jobs, full_words);
+  if (start < end) bitmap_kernels.range_scan(result, (const uint32_t *)raw_data, lo, hi, start, end);
+}
+
+void raw_scan_simd(BITS *result, CODE *raw_data, POSTYPE n, CODE lo, CODE hi, const ScanContext *ctx = &default_ctx) {
+  std::thread threads[THREAD_NUM];
+  int full_words = n / BITSWIDTH;
+  for (int i = 0; i < ctx->thread_num; i++) {
+    threads[i] = std::thread(raw_scan_worker, result, raw_data, lo, hi, full_words, ctx, i);
+  }
+  for (int i = 0; i < ctx->thread_num; i++) threads[i].join();
+  if (n % BITSWIDTH) {
+    BITS bits = 0;
+    for (int j = 0; j < n % BITSWIDTH; j++) {
+      CODE v = raw_data[full_words * BITSWIDTH + j];
+      if (v >= lo && v <= hi) bits |= 1U << (BITSWIDTH - 1 - j);
     }
-  } */
+    result[full_words] = bits;
+  }
+}
 
-  // CPU merge
-  // int stride = 156250;
-  // if (N / stride / CODEWIDTH > THREAD_NUM) {
-  //   stride = N / THREAD_NUM / CODEWIDTH;
-  //   printf("No enough threads, set stride to %d\n", stride);
-  // }
-  
-  int max_idx = (N + CODEWIDTH - 1) / CODEWIDTH;
-  int stride = (max_idx + THREAD_NUM - 1) / THREAD_NUM;
+void bindex_scan_direct(BinDex *bindex, BITS *result, CODE lo, POSTYPE count, const ScanContext *ctx = &default_ctx) {
+  // Set the 'count' positions from the first value >= lo on, in value order
+  memset_mt(result, 0, bits_num_needed(bindex->length), ctx);
+  int area_idx, block_idx, pos_idx;
+  bindex_locate_lt(bindex, lo, &area_idx, &block_idx, &pos_idx);
+  while (count > 0) {
+    Area *area = bindex->areas[area_idx];
+    pos_block *pb = area->blocks[block_idx];
+    int n = std::min((POSTYPE)(pb->length - pos_idx), count);
+    refine_block(result, pb, pos_idx, pos_idx + n);
+    count -= n;
+    pos_idx = 0;
+    if (++block_idx == area->blockNum) {
+      block_idx = 0;
+      area_idx++;
+    }
+  }
+}
 
-  if (mergeBitmap != bitmap) {
+SCAN_PLAN bindex_scan_planned(BinDex *bindex, CODE *raw_data, BITS *result, const string &search_cmd, CODE target1,
+                              CODE target2, SCAN_PLAN force = PLAN_AUTO, const ScanContext *ctx = &default_ctx) {
+  ScanEstimate est = estimate_scan(bindex, search_cmd, target1, target2, ctx);
+  SCAN_PLAN plan = force == PLAN_AUTO || est.plan == PLAN_CONSTANT ? est.plan : force;
+  if (plan == PLAN_RAW_SCAN && sizeof(CODE) != sizeof(uint32_t)) plan = PLAN_BINDEX;
+  printf("[PLAN] %s (selectivity %.6f, est. bindex %.3f ms, raw scan %.3f ms, direct %.3f ms)\n", plan_name(plan),
+         (double)est.count / bindex->length, est.cost_ms[PLAN_BINDEX], est.cost_ms[PLAN_RAW_SCAN],
+         est.cost_ms[PLAN_DIRECT]);
+  if (plan == PLAN_CONSTANT) {
+    memset_mt(result, est.count ? 0xFF : 0, bits_num_needed(bindex->length), ctx);
+  } else if (plan == PLAN_RAW_SCAN) {
+    raw_scan_simd(result, raw_data, bindex->length, est.lo, est.hi, ctx);
+  } else if (plan == PLAN_DIRECT) {
+    bindex_scan_direct(bindex, result, est.lo, est.count, ctx);
+  } else {
+    run_scan_cmd(bindex, result, search_cmd, target1, target2, ctx);
+  }
+  return plan;
+}
+
+double now_ms() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+
+void calibrate_planner() {
+  // Measure the single thread rates the cost model uses, on buffers of up to
+  // 2^24 rows so startup stays short; best of 3 runs each
+  int rows = std::min(N, 1 << 24) / BITSWIDTH * BITSWIDTH;
+  int words = rows / BITSWIDTH;
+  BITS *src = alloc_bitmap(words);
+  BITS *dst = alloc_bitmap(words);
+  uint32_t *vals = (uint32_t *)malloc(rows * sizeof(uint32_t));
+  POSTYPE *pos = (POSTYPE *)malloc(rows / 8 * sizeof(POSTYPE));
+  std::mt19937 mt(42);
+  for (int i = 0; i < rows; i++) vals[i] = mt();
+  for (int i = 0; i < rows / 8; i++) pos[i] = mt() % rows;
+  memset(src, 0x5A, words * sizeof(BITS));
+  memset(dst, 0, words * sizeof(BITS));
+
+  double best[5] = {1e30, 1e30, 1e30, 1e30, 1e30};
+  for (int run = 0; run < 3; run++) {
     std::thread threads[THREAD_NUM];
-    int start_idx = 0;
-    int end_idx = 0;
-    size_t t_id = 0;
-    while (end_idx < max_idx && t_id < THREAD_NUM) {
-      end_idx = start_idx + stride;
-      if (end_idx > max_idx) {
-        end_idx = max_idx;
+    double t_spawn = now_ms();
+    for (int i = 0; i < default_ctx.thread_num; i++) threads[i] = std::thread(pin_worker, &default_ctx, i);
+    for (int i = 0; i < default_ctx.thread_num; i++) threads[i].join();
+    best[4] = std::min(best[4], now_ms() - t_spawn);
+
+    double t0 = now_ms();
+    bitmap_kernels.copy(dst, src, NULL, words, bitmap_kernels.stream(words * sizeof(BITS)));
+    double t1 = now_ms();
+    bitmap_kernels.range_scan(dst, vals, 1U << 30, 3U << 30, 0, words);
+    double t2 = now_ms();
+    memset(dst, 0, words * sizeof(BITS));
+    double t3 = now_ms();
+    refine_positions(dst, pos, rows / 8);
+    double t4 = now_ms();
+    best[0] = std::min(best[0], t1 - t0);
+    best[1] = std::min(best[1], t2 - t1);
+    best[2] = std::min(best[2], t3 - t2);
+    best[3] = std::min(best[3], t4 - t3);
+  }
+  for (int i = 0; i < 4; i++) best[i] = std::max(best[i], 1e-3);
+  double bitmap_bytes = (double)words * sizeof(BITS);
+  planner_calib.copy_gbps = 2 * bitmap_bytes / (best[0] * 1e6);
+  planner_calib.scan_gbps = (double)rows * sizeof(uint32_t) / (best[1] * 1e6);
+  planner_calib.memset_gbps = bitmap_bytes / (best[2] * 1e6);
+  planner_calib.refine_ns = best[3] * 1e6 / (rows / 8);
+  planner_calib.spawn_ms = best[4];
+  printf("[CALIBRATE] copy %.2f GB/s, raw scan %.2f GB/s, memset %.2f GB/s, refine %.2f ns/pos, workers %.3f ms\n",
+         planner_calib.copy_gbps, planner_calib.scan_gbps, planner_calib.memset_gbps, planner_calib.refine_ns,
+         planner_calib.spawn_ms);
+  free_bitmap(src);
+  free_bitmap(dst);
+  free(vals);
+  free(pos);
+}
+
+/*
+  Semantic result cache: predicates are cached as value ranges [lo, hi). A
+  range near a cached one (nested, shifted or equal) is answered from the
+  cached bitmap by flipping the positions of the values between the old and
+  the new borders, if those are fewer than a fresh scan would refine
+*/
+ResultCache result_cache;
+
+POSTYPE rank_of(BinDex *bindex, uint64_t v) {
+  return v >= CODE_SPACE ? bindex->length : bindex_rank_lt(bindex, (CODE)v);
+}
+
+void cached_scan(int column, BinDex *bindex, BITS *result, const string &search_cmd, CODE target1, CODE target2,
+                 const ScanContext *ctx = &default_ctx) {
+  ScanEstimate est = estimate_scan(bindex, search_cmd, target1, target2, ctx);
+  if (!result_cache.budget || est.empty) {
+    run_scan_cmd(bindex, result, search_cmd, target1, target2, ctx);
+    return;
+  }
+  uint64_t lo = est.lo, hi = (uint64_t)est.hi + 1;
+  POSTYPE rank_lo = rank_of(bindex, lo), rank_hi = rank_of(bindex, hi);
+  int bitmap_len = bits_num_needed(bindex->length);
+  auto delta = [&](uint64_t old_lo, uint64_t old_hi) -> double {
+    // Positions between the old and new borders, -1 if scanning is cheaper
+    POSTYPE d_lo = rank_of(bindex, old_lo) - rank_lo, d_hi = rank_of(bindex, old_hi) - rank_hi;
+    POSTYPE d = std::abs(d_lo) + std::abs(d_hi);
+    return d <= est.refine ? d : -1;
+  };
+
+  uint64_t old_lo, old_hi;
+  if (!result_cache.lookup(column, bindex, bindex->length, delta, result, bitmap_len, &old_lo, &old_hi)) {
+    run_scan_cmd(bindex, result, search_cmd, target1, target2, ctx);
+    result_cache.insert(column, bindex, bindex->length, lo, hi, result, bitmap_len);
+    return;
+  }
+  POSTYPE old_rank_lo = rank_of(bindex, old_lo), old_rank_hi = rank_of(bindex, old_hi);
+  if (old_rank_lo == rank_lo && old_rank_hi == rank_hi) return;
+
+  // lt(hi) ^ lt(lo) from lt(old_hi) ^ lt(old_lo), the two rank ranges may
+  // overlap and cancel, hence the XOR refine
+  std::vector<PosSegment> segs;
+  add_rank_segments(bindex, std::min(rank_lo, old_rank_lo), std::max(rank_lo, old_rank_lo), segs);
+  add_rank_segments(bindex, std::min(rank_hi, old_rank_hi), std::max(rank_hi, old_rank_hi), segs);
+  std::thread threads[THREAD_NUM];
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) {
+    threads[t_id] = std::thread(refine_segments_worker, result, &segs, ctx, t_id);
+  }
+  for (int t_id = 0; t_id < ctx->thread_num; t_id++) threads[t_id].join();
+  // Sliding ranges keep moving, the next one is likely closer to this one
+  result_cache.insert(column, bindex, bindex->length, lo, hi, result, bitmap_len);
+}
+
+uint64_t bitmap_digest(const BITS *bitmap, POSTYPE n) {
+  // FNV-1a over the words of the first n rows, bits past row n are ignored
+  int len = bits_num_needed(n);
+  uint64_t h = 14695981039346656037ULL;
+  for (int i = 0; i < len; i++) {
+    BITS w = bitmap[i];
+    if (i == len - 1 && n % BITSWIDTH) w &= ~0U << (BITSWIDTH - n % BITSWIDTH);
+    h = (h ^ w) * 1099511628211ULL;
+  }
+  return h;
+}
+
+void concurrent_client(BinDex **bindexs, int bindex_num, vector<string> *queries, std::atomic<int> *next_query,
+                       QueryScheduler *scheduler, double *latency_sum, std::vector<std::vector<uint64_t> > *digests) {
+  BITS *bitmap = alloc_bitmap(ROUNDUP(bits_num_needed(N), SIMD_JOB_UNIT));
+  ScanContext ctx;
+  int qi;
+  while ((qi = next_query->fetch_add(1)) < (int)queries->size()) {
+    std::vector<std::string> cmds = stringSplit((*queries)[qi], ' ');
+    std::vector<CODE> target_l = get_target_numbers(cmds[1]);
+    std::vector<CODE> target_r;
+    if (cmds.size() > 2) target_r = get_target_numbers(cmds[2]);
+    BinDex *bindex = bindexs[qi % bindex_num];
+
+    struct timeval t;
+    start_timer(&t);
+    scheduler->acquire(&ctx);
+    for (size_t pi = 0; pi < target_l.size(); pi++) {
+      cached_scan(qi % bindex_num, bindex, bitmap, cmds[0], target_l[pi], target_r.size() ? target_r[pi] : 0, &ctx);
+      // Checked against a raw scan once all clients are done
+      (*digests)[qi].push_back(bitmap_digest(bitmap, bindex->length));
+    }
+    scheduler->release(&ctx);
+    stop_timer(&t, latency_sum);
+  }
+  free_bitmap(bitmap);
+}
+
+void exp_concurrent(BinDex **bindexs, CODE **initial_data, int bindex_num, int client_num) {
+  // Every line of the scan file is an independent query on column
+  // (line % bindex_num), issued by client_num client threads sharing the
+  // BinDex and the cores
+  vector<string> queries;
+  ifstream fin(scan_file);
+  string input;
+  while (getline(fin, input)) {
+    if (input == "exit") break;
+    if (stringSplit(input, ' ').size() > 1) queries.push_back(input);
+  }
+  printf("[CONCURRENT] %d queries, %d clients\n", (int)queries.size(), client_num);
+
+  QueryScheduler scheduler(default_ctx.cores, default_ctx.thread_num);
+  std::atomic<int> next_query(0);
+  std::vector<double> latency_sum(client_num, 0.0);
+  std::vector<std::vector<uint64_t> > digests(queries.size());
+  std::vector<std::thread> clients;
+  struct timeval t;
+  double elapsed = 0.0;
+  start_timer(&t);
+  for (int c = 0; c < client_num; c++) {
+    clients.push_back(std::thread(concurrent_client, bindexs, bindex_num, &queries, &next_query, &scheduler,
+                                  &latency_sum[c], &digests));
+  }
+  for (int c = 0; c < client_num; c++) {
+    clients[c].join();
+  }
+  stop_timer(&t, &elapsed);
+
+  double latency = 0.0;
+  for (int c = 0; c < client_num; c++) latency += latency_sum[c];
+  printf("[CONCURRENT] total time: %f ms\n", elapsed);
+  printf("[CONCURRENT] throughput: %f queries/s\n", queries.size() / (elapsed / 1000.0));
+  printf("[CONCURRENT] average latency: %f ms\n", latency / std::max((int)queries.size(), 1));
+  if (result_cache.budget) result_cache.report();
+
+  BITS *check = alloc_bitmap(ROUNDUP(bits_num_needed(N), SIMD_JOB_UNIT));
+  int predicate_num = 0, wrong = 0;
+  for (size_t qi = 0; qi < queries.size(); qi++) {
+    std::vector<std::string> cmds = stringSplit(queries[qi], ' ');
+    std::vector<CODE> target_l = get_target_numbers(cmds[1]);
+    std::vector<CODE> target_r;
+    if (cmds.size() > 2) target_r = get_target_numbers(cmds[2]);
+    BinDex *bindex = bindexs[qi % bindex_num];
+    for (size_t pi = 0; pi < target_l.size(); pi++) {
+      RangeSet ranges = comparison_range(cmds[0], target_l[pi], target_r.size() ? target_r[pi] : 0);
+      memset(check, 0, bits_num_needed(bindex->length) * sizeof(BITS));
+      raw_scan_ranges(check, bindex->length, ranges, initial_data[qi % bindex_num]);
+      if (bitmap_digest(check, bindex->length) != digests[qi][pi]) {
+        printf("[ERROR] concurrent query %d: %s\n", (int)qi, queries[qi].c_str());
+        wrong++;
       }
-      // printf("start idx: %d end idx: %d\n",start_idx, end_idx);
-      // refine_result_bitmap(mergeBitmap, bitmap, start_idx, end_idx, t_id);
-      threads[t_id] = std::thread(refine_result_bitmap, mergeBitmap, bitmap, start_idx, end_idx, t_id);
-      start_idx += stride;
-      t_id += 1;
+      predicate_num++;
     }
-    for (int i = 0; i < THREAD_NUM; i++)
-      threads[i].join();
   }
+  free_bitmap(check);
+  printf("[CHECK] concurrent: %d/%d predicates correct\n", predicate_num - wrong, predicate_num);
 }
 
-void compare_bitmap(BITS *bitmap_a, BITS *bitmap_b, int len, CODE **raw_data, int bindex_num)
-{
-  int total_hit = 0;
-  int true_hit = 0;
-  for (int i = 0; i < len; i++) {
-    int data_a = (bitmap_a[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH)));
-    int data_b = (bitmap_b[i >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - i % BITSWIDTH)));
-    if (data_a) {
-      total_hit += 1;
-      if (data_b) true_hit += 1;
+void exp_batch(BinDex **bindexs, CODE **initial_data, int bindex_num, int batch_size) {
+  // Every line of the scan file is an independent query on column
+  // (line % bindex_num) as in exp_concurrent(..). The queries of a column run
+  // in batches of batch_size shared scans, then one by one for comparison.
+  std::vector<string> search_cmds[MAX_BINDEX_NUM];
+  std::vector<CODE> targets1[MAX_BINDEX_NUM], targets2[MAX_BINDEX_NUM];
+  ifstream fin(scan_file);
+  string input;
+  int line = 0;
+  while (getline(fin, input)) {
+    if (input == "exit") break;
+    std::vector<std::string> cmds = stringSplit(input, ' ');
+    if (cmds.size() < 2) continue;
+    int bindex_id = line++ % bindex_num;
+    std::vector<CODE> target_l = get_target_numbers(cmds[1]);
+    std::vector<CODE> target_r;
+    if (cmds.size() > 2) target_r = get_target_numbers(cmds[2]);
+    for (size_t pi = 0; pi < target_l.size(); pi++) {
+      search_cmds[bindex_id].push_back(cmds[0]);
+      targets1[bindex_id].push_back(target_l[pi]);
+      targets2[bindex_id].push_back(target_r.size() ? target_r[pi] : 0);
     }
-    if (data_a != data_b) {
-      printf("[ERROR] check error in raw_data[%d]=", i);
-      printf(" %u / %u / %u \n", raw_data[0][i], raw_data[1][i], raw_data[2][i]);
-      printf("the correct is %#x, but we have %#x\n", data_a, data_b);
-      break;
+  }
+
+  int bitmap_len = bits_num_needed(N);
+  std::vector<BITS *> results(batch_size);
+  for (int i = 0; i < batch_size; i++) results[i] = alloc_bitmap(ROUNDUP(bitmap_len, SIMD_JOB_UNIT));
+  BITS *single = alloc_bitmap(ROUNDUP(bitmap_len, SIMD_JOB_UNIT));
+  BITS *check = alloc_bitmap(ROUNDUP(bitmap_len, SIMD_JOB_UNIT));
+  double batched = 0.0, sequential = 0.0;
+  int query_num = 0, wrong = 0;
+  for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+    for (size_t start = 0; start < targets1[bindex_id].size(); start += batch_size) {
+      size_t end = std::min(start + batch_size, targets1[bindex_id].size());
+      std::vector<string> cmds(search_cmds[bindex_id].begin() + start, search_cmds[bindex_id].begin() + end);
+      std::vector<CODE> t1(targets1[bindex_id].begin() + start, targets1[bindex_id].begin() + end);
+      std::vector<CODE> t2(targets2[bindex_id].begin() + start, targets2[bindex_id].begin() + end);
+      struct timeval t;
+      start_timer(&t);
+      bindex_scan_batch(bindexs[bindex_id], cmds, t1, t2, results.data());
+      stop_timer(&t, &batched);
+
+      for (size_t i = 0; i < cmds.size(); i++) {
+        start_timer(&t);
+        run_scan_cmd(bindexs[bindex_id], single, cmds[i], t1[i], t2[i], &default_ctx);
+        stop_timer(&t, &sequential);
+
+        memset(check, 0, bitmap_len * sizeof(BITS));
+        raw_scan_ranges(check, N, comparison_range(cmds[i], t1[i], t2[i]), initial_data[bindex_id]);
+        for (POSTYPE row = 0; row < N; row++) {
+          BITS mask = 1U << (BITSWIDTH - 1 - row % BITSWIDTH);
+          if ((results[i][row >> BITSSHIFT] & mask) != (check[row >> BITSSHIFT] & mask)) {
+            printf("[ERROR] batch query %s %u: row %d\n", cmds[i].c_str(), t1[i], row);
+            wrong++;
+            break;
+          }
+        }
+      }
+      query_num += cmds.size();
     }
   }
-  printf("[CHECK]hit %d/%d\n", true_hit, total_hit);
+  printf("[BATCH] %d queries, batch size %d\n", query_num, batch_size);
+  printf("[BATCH] batched: %f ms, %f ms/query\n", batched, batched / std::max(query_num, 1));
+  printf("[BATCH] sequential: %f ms, %f ms/query\n", sequential, sequential / std::max(query_num, 1));
+  printf("[CHECK]batch %d/%d\n", query_num - wrong, query_num);
+
+  for (int i = 0; i < batch_size; i++) free_bitmap(results[i]);
+  free_bitmap(single);
+  free_bitmap(check);
 }
 
-void start_timer(struct timeval* t) {
-    gettimeofday(t, NULL);
+BITMAP_ISA parse_bitmap_isa(const char *s) {
+  if (!strcmp(s, "auto")) return ISA_AUTO;
+  if (!strcmp(s, "scalar")) return ISA_SCALAR;
+  if (!strcmp(s, "avx2")) return ISA_AVX2;
+  if (!strcmp(s, "avx512")) return ISA_AVX512;
+  printf("Error: unknown isa %s\n", s);
+  exit(-1);
 }
 
-void stop_timer(struct timeval* t, double* elapsed_time) {
-    struct timeval end;
-    gettimeofday(&end, NULL);
-    *elapsed_time += (end.tv_sec - t->tv_sec) * 1000.0 + (end.tv_usec - t->tv_usec) / 1000.0;
+PAGE_POLICY parse_page_policy(const char *s) {
+  if (!strcmp(s, "normal")) return PAGE_NORMAL;
+  if (!strcmp(s, "thp")) return PAGE_THP;
+  if (!strcmp(s, "2m")) return PAGE_HUGE_2M;
+  if (!strcmp(s, "1g")) return PAGE_HUGE_1G;
+  printf("Error: unknown page policy %s\n", s);
+  exit(-1);
+}
+
+void report_page_sizes(BinDex *bindex, BITS *bitmap) {
+  // Page sizes actually achieved, hugetlb requests may have fallen back
+  printf("[PAGES] requested: %s\n", page_policy_name(page_policy));
+  PageAllocator::report("filter vectors", bindex->filterVectors[0]);
+  PageAllocator::report("result bitmap", bitmap);
+  PageAllocator::report("position blocks", bindex->areas[0]->blocks[0]->pos);
+}
+
+MEM_POLICY parse_mem_policy(const char *s, int *node) {
+  // local | interleave | bind:<node>
+  if (!strcmp(s, "local")) return MEM_LOCAL;
+  if (!strcmp(s, "interleave")) return MEM_INTERLEAVE;
+  if (!strncmp(s, "bind:", 5)) {
+    *node = atoi(s + 5);
+    assert(*node >= 0 && *node < topology.node_num);
+    return MEM_BIND;
+  }
+  printf("Error: unknown memory policy %s\n", s);
+  exit(-1);
+}
+
+AFFINITY_POLICY parse_affinity_policy(const char *s) {
+  if (!strcmp(s, "legacy")) return AFFINITY_LEGACY;
+  if (!strcmp(s, "compact")) return AFFINITY_COMPACT;
+  if (!strcmp(s, "spread")) return AFFINITY_SPREAD;
+  if (!strcmp(s, "none")) return AFFINITY_NONE;
+  printf("Error: unknown affinity policy %s\n", s);
+  exit(-1);
 }
 
 void exp_opt(int argc, char *argv[]) {
@@ -1999,19 +4721,66 @@ void exp_opt(int argc, char *argv[]) {
   int insert_num = 0;
   int bindex_num = 1;
   bool USEKEYBOARDINPUT = false;
+  int client_num = 0;
+  int batch_size = 0;
+  AFFINITY_POLICY affinity_policy = AFFINITY_LEGACY;
+  int replicate_num = 0;
 
   // get command line options
   bool STRICT_SELECTIVITY = false;
   bool TEST_INSERTING = false;
-  while ((opt = getopt(argc, argv, "khsil:r:o:f:n:p:b:")) != -1) {
+  bool COUNT_ONLY = false;
+  bool USE_PLANNER = false;
+  bool ORDERED_EVAL = false;
+  bool ZONE_SCAN = false;
+  bool KD_REFINE = false;
+  bool ZORDER_SCAN = false;
+  SCAN_PLAN plan_force = PLAN_AUTO;
+  APPROX_MODE approx_mode = APPROX_OFF;
+  std::vector<AggSpec> agg_specs;
+  std::vector<OrderSpec> order_specs;
+  POSTYPE limit_offset = 0;
+  int limit_k = 0;
+  std::vector<int> project_cols;
+  bool materialize = false;
+  std::vector<int> cluster_cols;
+  std::vector<int> grid_cols;
+  std::vector<double> quantiles;
+  int histogram_buckets = 0;
+  int value_num = 0;
+  while ((opt = getopt(argc, argv, "khsiSZKzCl:r:o:f:n:p:b:c:B:Q:a:m:M:R:H:x:g:e:P:A:O:q:y:L:j:W:G:")) != -1) {
     switch (opt) {
       case 'h':
         printf(
             "Usage: %s \n"
             "[-l <left target list>] [-r <right target list>]"
             "[-s use stric selectivity]"
-            "[-i test inserting]"
+            "[-i test inserting, with -n <rows appended while scanning>]"
+            "[-C index-only counts instead of bitmaps]"
+            "[-S evaluate columns most selective first, skipping emptied segments]"
+            "[-Z scan comparisons through the zone maps]"
+            "[-K answer box predicates on the first three columns with a k-d tree]"
+            "[-z answer box predicates on the first four columns along the z-order curve]"
+            "[-g <aggregates: count,sum:<col>,min:<col>,max:<col>,avg:<col>,sumprod:<col>*<col>>]"
+            "[-e <value-only columns loaded after the indexed ones>]"
+            "[-P <plan per predicate: auto|bindex|raw|direct>]"
+            "[-A <unrefined answers with error bounds: approx|progressive>]"
             "[-p <scan-file>]"
+            "[-c <concurrent clients>]"
+            "[-B <shared-scan batch size>]"
+            "[-Q <result cache size in MB>]"
+            "[-O <order by: <col>:asc|desc:<k>>]"
+            "[-q <quantiles, e.g. 0.5,0.99>][-y <histogram buckets>]"
+            "[-L <limit page: <offset>:<k>>]"
+            "[-j <materialize row ids and project columns, e.g. 0,1 or - for row ids only>]"
+            "[-W <cluster the rows by columns before building, e.g. 0 or 0,1 for z-order>]"
+            "[-G <2-D grid sieve over two indexed columns, e.g. 0,1>]"
+            "[-a <affinity: legacy|compact|spread|none>]"
+            "[-m <filter vector placement: local|interleave|bind:<node>>]"
+            "[-M <result bitmap placement: local|interleave|bind:<node>>]"
+            "[-R <replicate the n hottest filter vectors per node>]"
+            "[-H <page size: normal|thp|2m|1g>]"
+            "[-x <bitmap kernels: auto|scalar|avx2|avx512>]"
             "[-f <input-file>] [-o <operator>] \n",
             argv[0]);
         exit(0);
@@ -2041,12 +4810,106 @@ void exp_opt(int argc, char *argv[]) {
       case 's':
         STRICT_SELECTIVITY = true;
         break;
+      case 'C':
+        COUNT_ONLY = true;
+        break;
+      case 'S':
+        ORDERED_EVAL = true;
+        break;
+      case 'Z':
+        ZONE_SCAN = true;
+        break;
+      case 'K':
+        KD_REFINE = true;
+        break;
+      case 'z':
+        ZORDER_SCAN = true;
+        break;
+      case 'g':
+        agg_specs = parse_agg_specs(optarg);
+        break;
+      case 'e':
+        value_num = atoi(optarg);
+        break;
+      case 'P':
+        USE_PLANNER = true;
+        if (!strcmp(optarg, "bindex")) plan_force = PLAN_BINDEX;
+        else if (!strcmp(optarg, "raw")) plan_force = PLAN_RAW_SCAN;
+        else if (!strcmp(optarg, "direct")) plan_force = PLAN_DIRECT;
+        else assert(!strcmp(optarg, "auto"));
+        break;
+      case 'A':
+        approx_mode = parse_approx_mode(optarg);
+        break;
       case 'i':
         TEST_INSERTING = true;
         break;
       case 'k':
         USEKEYBOARDINPUT = true;
         break;
+      case 'c':
+        client_num = atoi(optarg);
+        break;
+      case 'B':
+        batch_size = atoi(optarg);
+        break;
+      case 'q': {
+        std::vector<std::string> items = stringSplit(optarg, ',');
+        for (size_t i = 0; i < items.size(); i++) quantiles.push_back(atof(items[i].c_str()));
+        break;
+      }
+      case 'L':
+        limit_offset = atoi(optarg);
+        assert(strchr(optarg, ':'));
+        limit_k = atoi(strchr(optarg, ':') + 1);
+        break;
+      case 'j': {
+        materialize = true;
+        std::vector<std::string> items = stringSplit(optarg, ',');
+        for (size_t i = 0; i < items.size(); i++) {
+          if (items[i] != "-") project_cols.push_back(atoi(items[i].c_str()));
+        }
+        break;
+      }
+      case 'y':
+        histogram_buckets = atoi(optarg);
+        break;
+      case 'G':
+        grid_cols.clear();
+        for (std::string item : stringSplit(optarg, ',')) grid_cols.push_back(atoi(item.c_str()));
+        break;
+      case 'W': {
+        std::vector<std::string> items = stringSplit(optarg, ',');
+        for (size_t i = 0; i < items.size(); i++) cluster_cols.push_back(atoi(items[i].c_str()));
+        break;
+      }
+      case 'O':
+        order_specs.push_back(parse_order_spec(optarg));
+        break;
+      case 'Q':
+        result_cache.budget = (size_t)(atof(optarg) * 1048576);
+        break;
+      case 'a':
+        affinity_policy = parse_affinity_policy(optarg);
+        break;
+      case 'm':
+        fv_mem_policy = parse_mem_policy(optarg, &fv_mem_node);
+        break;
+      case 'M':
+        bitmap_mem_policy = parse_mem_policy(optarg, &bitmap_mem_node);
+        break;
+      case 'R':
+        replicate_num = atoi(optarg);
+        break;
+      case 'H':
+        page_policy = parse_page_policy(optarg);
+        break;
+      case 'x':
+        if (!bitmap_kernels.select(parse_bitmap_isa(optarg))) {
+          printf("Error: cpu doesn't support %s\n", optarg);
+          exit(-1);
+        }
+        break;
       default:
         printf("Error: unknown option %c\n", (char)opt);
         exit(-1);
@@ -2055,13 +4918,41 @@ void exp_opt(int argc, char *argv[]) {
   assert(target_numbers_r.size() == 0 || target_numbers_l.size() == target_numbers_r.size());
   assert(blockNumMax);
   assert(bindex_num >= 1);
+  // Row lists and aggregates of approximate bitmaps can't be checked
+  assert(approx_mode != APPROX_ONLY || (!limit_k && order_specs.empty() && agg_specs.empty() && !materialize));
+
+  topology.show();
+  printf("[KERNELS] %s, non-temporal stores for outputs >= %zu bytes\n", bitmap_kernels.name(),
+         bitmap_kernels.stream_min_bytes);
+  block_pool.set_policy(&page_allocator, page_policy);
+  default_ctx.thread_num = topology.affinity_cores(affinity_policy, default_ctx.cores, THREAD_NUM);
+  assert(default_ctx.thread_num >= 1);
 
   // initial data
   CODE *initial_data[MAX_BINDEX_NUM];
 
 
+  // Indexed columns first, then the value-only columns used by aggregates
+  int column_num = bindex_num + value_num;
+  assert(column_num <= MAX_BINDEX_NUM);
+  for (size_t i = 0; i < order_specs.size(); i++) {
+    assert(order_specs[i].col < bindex_num);  // needs the position blocks of an indexed column
+  }
+  for (size_t i = 0; i < agg_specs.size(); i++) {
+    assert(agg_specs[i].col < column_num && agg_specs[i].col2 < column_num);
+  }
+  for (size_t i = 0; i < project_cols.size(); i++) assert(project_cols[i] < column_num);
+  assert(cluster_cols.size() <= MAX_CLUSTER_COLUMNS);
+  if (grid_cols.size()) {
+    // Built once over the initial rows, appends are not tracked
+    assert(grid_cols.size() == 2 && grid_cols[0] != grid_cols[1] && !TEST_INSERTING);
+    assert(grid_cols[0] < bindex_num && grid_cols[1] < bindex_num);
+  }
+  assert(!KD_REFINE || (!TEST_INSERTING && !grid_cols.size()));
+  assert(!ZORDER_SCAN || (!TEST_INSERTING && !grid_cols.size() && !KD_REFINE));
+  for (size_t i = 0; i < cluster_cols.size(); i++) assert(cluster_cols[i] < column_num);
   if (!strlen(DATA_PATH)) {
-    for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++)
+    for (int bindex_id = 0; bindex_id < column_num; bindex_id++)
     {
       initial_data[bindex_id] = (CODE *)malloc(N * sizeof(CODE));
       CODE *data = initial_data[bindex_id];
@@ -2085,7 +4976,7 @@ void exp_opt(int argc, char *argv[]) {
     }
     printf("initing data from %s\n", DATA_PATH);
 
-    for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+    for (int bindex_id = 0; bindex_id < column_num; bindex_id++) {
       initial_data[bindex_id] = (CODE*)malloc(N * sizeof(CODE));
       CODE* data = initial_data[bindex_id];
       // 8/16/32 only
@@ -2132,16 +5023,86 @@ void exp_opt(int argc, char *argv[]) {
   }
   
   BinDex *bindexs[MAX_BINDEX_NUM];
+  VersionedBinDex *vbindexs[MAX_BINDEX_NUM];
+  int snapshot_slots[MAX_BINDEX_NUM];
+  // With -i the last insert_num rows are appended while the queries run
+  POSTYPE build_n = TEST_INSERTING ? N - insert_num : N;
+  assert(build_n > 0 && build_n <= N);
+
+  // Original row id of every row after clustering (rows appended by -i stay
+  // in arrival order), empty without -W
+  std::vector<uint32_t> row_ids;
+  if (cluster_cols.size()) {
+    const CODE *keys[MAX_CLUSTER_COLUMNS];
+    for (size_t i = 0; i < cluster_cols.size(); i++) keys[i] = initial_data[cluster_cols[i]];
+    PRINT_EXCECUTION_TIME("cluster", row_ids = cluster_order(keys, cluster_cols.size(), build_n));
+    CODE *tmp = (CODE *)malloc(build_n * sizeof(CODE));
+    PRINT_EXCECUTION_TIME("reorder", for (int i = 0; i < column_num; i++) permute_column(initial_data[i], row_ids, tmp));
+    free(tmp);
+    for (POSTYPE i = build_n; i < N; i++) row_ids.push_back(i);
+    printf("[REORDER] rows clustered by %s of column", cluster_cols.size() > 1 ? "the z-order" : "the value");
+    for (size_t i = 0; i < cluster_cols.size(); i++) printf("%s %d", i ? "," : "", cluster_cols[i]);
+    printf("\n");
+  }
   for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
     // Build the bindex structure
     printf("Build the bindex structure %d...\n", bindex_id);
     CODE *data = initial_data[bindex_id];
-    bindexs[bindex_id] = (BinDex *)malloc(sizeof(BinDex));
     if (DEBUG_TIME_COUNT) timer.commonGetStartTime(0);
-    PRINT_EXCECUTION_TIME("BinDex building", init_bindex(bindexs[bindex_id], data, N));
+    if (TEST_INSERTING) {
+      vbindexs[bindex_id] = new VersionedBinDex;
+      PRINT_EXCECUTION_TIME("BinDex building", init_versioned_bindex(vbindexs[bindex_id], data, build_n));
+    } else {
+      bindexs[bindex_id] = (BinDex *)malloc(sizeof(BinDex));
+      PRINT_EXCECUTION_TIME("BinDex building", init_bindex(bindexs[bindex_id], data, N));
+    }
+    report_runs(TEST_INSERTING ? vbindexs[bindex_id]->current.load() : bindexs[bindex_id], bindex_id);
     if (DEBUG_TIME_COUNT) timer.commonGetEndTime(0);
     printf("\n");
   }
+  GridSieve *grid = NULL;
+  if (grid_cols.size()) {
+    PRINT_EXCECUTION_TIME("grid building",
+                          grid = new GridSieve(initial_data[grid_cols[0]], initial_data[grid_cols[1]], N));
+    printf("[GRID] columns %d,%d: %dx%d cells, %.2f MB\n", grid_cols[0], grid_cols[1], GRID_CELLS, GRID_CELLS,
+           grid->bytes() / 1048576.0);
+  }
+  KdRefine *kd = NULL;
+  int kd_dims = std::min(bindex_num, KD_MAX_DIMS);
+  if (KD_REFINE) {
+    PRINT_EXCECUTION_TIME("k-d tree building", kd = new KdRefine(initial_data, kd_dims, N));
+    printf("[KD] columns 0..%d: %.2f MB\n", kd_dims - 1, kd->bytes() / 1048576.0);
+  }
+  ZOrderIndex *zorder = NULL;
+  int zorder_dims = std::min(bindex_num, ZORDER_MAX_DIMS);
+  if (ZORDER_SCAN) {
+    PRINT_EXCECUTION_TIME("z-order building", zorder = new ZOrderIndex(initial_data, zorder_dims, N));
+    printf("[ZORDER] columns 0..%d: %.2f MB\n", zorder_dims - 1, zorder->bytes() / 1048576.0);
+  }
+
+  if (quantiles.size() || histogram_buckets > 0) {
+    for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+      BinDex *bindex = TEST_INSERTING ? vbindexs[bindex_id]->current.load() : bindexs[bindex_id];
+      report_rank_statistics(bindex, bindex_id, quantiles, histogram_buckets, initial_data[bindex_id]);
+    }
+  }
+
+  std::thread appender;
+  if (TEST_INSERTING) {
+    appender = std::thread(append_worker, vbindexs, initial_data, bindex_num, build_n, (POSTYPE)N);
+  }
+
+  if (client_num > 0) {
+    assert(!TEST_INSERTING);
+    exp_concurrent(bindexs, initial_data, bindex_num, client_num);
+    return;
+  }
+
+  if (batch_size > 0) {
+    assert(!TEST_INSERTING);
+    exp_batch(bindexs, initial_data, bindex_num, batch_size);
+    return;
+  }
 
   // BinDex Scan
   printf("BinDex scan...\n");
@@ -2150,10 +5111,19 @@ void exp_opt(int argc, char *argv[]) {
   BITS *bitmap[MAX_BINDEX_NUM];
   int bitmap_len;
   for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
-    bitmap_len = bits_num_needed(bindexs[bindex_id]->length);
-    bitmap[bindex_id] = (BITS *)aligned_alloc(SIMD_ALIGEN, bitmap_len * sizeof(BITS));
+    bitmap_len = bits_num_needed(N);
+    bitmap[bindex_id] = alloc_bitmap(bitmap_len);
     memset_mt(bitmap[bindex_id], 0xFF, bitmap_len);
   }
+  if (USE_PLANNER && plan_force == PLAN_AUTO) calibrate_planner();
+  if (TEST_INSERTING) {
+    // The appender may retire the current snapshot meanwhile
+    int slot;
+    report_page_sizes(bindex_pin(vbindexs[0], &slot), bitmap[0]);
+    bindex_unpin(vbindexs[0], slot);
+  } else {
+    report_page_sizes(bindexs[0], bitmap[0]);
+  }
 
   ifstream fin;
   fin.open(scan_file);
@@ -2166,6 +5136,7 @@ void exp_opt(int argc, char *argv[]) {
     std::vector<CODE> target_l[MAX_BINDEX_NUM];
     std::vector<CODE> target_r[MAX_BINDEX_NUM]; 
     string search_cmd[MAX_BINDEX_NUM];
+    RangeSet ranges[MAX_BINDEX_NUM];  // Predicate trees, search_cmd "expr"
 
     for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
       cout << "input [operator] [target_l] [target_r] (" << bindex_id + 1 << "/" << bindex_num << ")" << endl;
@@ -2179,6 +5150,13 @@ void exp_opt(int argc, char *argv[]) {
       cout << input << endl;
       std::vector<std::string> cmds = stringSplit(input, ' ');
       if (cmds[0] == "exit") exit(0);
+      if (is_predicate_tree(cmds)) {
+        // e.g. "lt 10 or not bt 20 30", evaluated once as a whole
+        search_cmd[bindex_id] = "expr";
+        ranges[bindex_id] = PredicateParser(cmds).parse();
+        target_l[bindex_id].push_back(0);
+        continue;
+      }
       search_cmd[bindex_id] = cmds[0];
       if (cmds.size() > 1) {
         target_l[bindex_id] = get_target_numbers(cmds[1]);
@@ -2187,8 +5165,121 @@ void exp_opt(int argc, char *argv[]) {
         target_r[bindex_id] = get_target_numbers(cmds[2]);
       }
     }
-    timer.commonGetStartTime(11);
+    // Scan consistent snapshots while the appender keeps going
+    POSTYPE visible_len = N;
+    if (TEST_INSERTING) {
+      for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+        bindexs[bindex_id] = bindex_pin(vbindexs[bindex_id], &snapshot_slots[bindex_id]);
+        visible_len = std::min(visible_len, bindexs[bindex_id]->length);
+      }
+      printf("[SNAPSHOT] visible rows: %d\n", visible_len);
+    }
+
+    if (COUNT_ONLY) {
+      // Index-only COUNT(*) per column, no bitmaps involved
+      for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+        for (int pi = 0; pi < target_l[bindex_id].size(); pi++) {
+          target1 = target_l[bindex_id][pi];
+          target2 = target_r[bindex_id].size() ? target_r[bindex_id][pi] : 0;
+          if (search_cmd[bindex_id] == "bt" && target1 > target2) {
+            std::swap(target1, target2);
+          }
+          POSTYPE count, truth;
+          if (approx_mode != APPROX_OFF) {
+            RangeSet column_range = search_cmd[bindex_id] == "expr"
+                                        ? ranges[bindex_id]
+                                        : comparison_range(search_cmd[bindex_id], target1, target2);
+            ApproxResult approx;
+            PRINT_EXCECUTION_TIME("approx count", approx = bindex_count_approx(bindexs[bindex_id], column_range));
+            truth = raw_count_ranges(initial_data[bindex_id], bindexs[bindex_id]->length, column_range);
+            printf("[APPROX] column %d: %d +- %d\n", bindex_id, approx.count, approx.error);
+            printf("[CHECK]approx count %d in [%d, %d]\n", truth, approx.count - approx.error,
+                   approx.count + approx.error);
+            assert(truth >= approx.count - approx.error && truth <= approx.count + approx.error);
+            if (approx_mode == APPROX_ONLY) continue;
+          }
+          if (search_cmd[bindex_id] == "expr") {
+            PRINT_EXCECUTION_TIME("count", count = bindex_count_ranges(bindexs[bindex_id], ranges[bindex_id]));
+            truth = raw_count_ranges(initial_data[bindex_id], bindexs[bindex_id]->length, ranges[bindex_id]);
+          } else {
+            PRINT_EXCECUTION_TIME("count", count = bindex_count(bindexs[bindex_id], search_cmd[bindex_id], target1, target2));
+            truth = raw_count(initial_data[bindex_id], bindexs[bindex_id]->length, search_cmd[bindex_id], target1, target2);
+          }
+          printf("[COUNT] column %d: %d\n", bindex_id, count);
+          printf("[CHECK]count %d/%d\n", count, truth);
+          assert(count == truth);
+        }
+        if (TEST_INSERTING) bindex_unpin(vbindexs[bindex_id], snapshot_slots[bindex_id]);
+      }
+      printf("\n");
+      continue;
+    }
+
+    POSTYPE approx_error = 0;  // Rows wrong in the merged approximate bitmap at most
+    // Value ranges of the last predicate of every column
+    RangeSet column_ranges[MAX_BINDEX_NUM];
     for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+      column_ranges[bindex_id] = search_cmd[bindex_id] == "expr"
+                                     ? ranges[bindex_id]
+                                     : comparison_range(search_cmd[bindex_id], target_l[bindex_id].back(),
+                                                        target_r[bindex_id].size() ? target_r[bindex_id].back() : 0);
+    }
+    bool ordered = ORDERED_EVAL && bindex_num > 1 && approx_mode == APPROX_OFF;
+    // Box predicates on the grid pair, the k-d tree or the z-order columns are
+    // answered together into the bitmap of the first of them, the others sit
+    // out the merge
+    std::vector<int> box_cols;
+    if (grid) box_cols = grid_cols;
+    for (int d = 0; kd && d < kd_dims; d++) box_cols.push_back(d);
+    for (int d = 0; zorder && d < zorder_dims; d++) box_cols.push_back(d);
+    for (size_t i = 0; i < box_cols.size(); i++) {
+      if (ordered || approx_mode != APPROX_OFF || column_ranges[box_cols[i]].size() != 1) box_cols.clear();
+    }
+    bool use_grid = grid && box_cols.size();
+    bool use_kd = kd && box_cols.size();
+    bool use_zorder = zorder && box_cols.size();
+    timer.commonGetStartTime(11);
+    if (ordered) {
+      PRINT_EXCECUTION_TIME("ordered", bindex_scan_conjunction(bindexs, column_ranges, bindex_num, bitmap[0]));
+    }
+    if (use_grid) {
+      uint64_t lo[2], hi[2];
+      for (int axis = 0; axis < 2; axis++) {
+        lo[axis] = column_ranges[grid_cols[axis]][0].first;
+        hi[axis] = column_ranges[grid_cols[axis]][0].second;
+      }
+      GridScanStats stats;
+      PRINT_EXCECUTION_TIME("grid", stats = grid->scan(bitmap[grid_cols[0]], lo, hi));
+      printf("[GRID] %d cells filled, %d cells checked (%ld rows)\n", stats.filled_cells, stats.checked_cells,
+             stats.checked_rows);
+    }
+    if (use_kd) {
+      // Same open bounds as the RT refine
+      double predicate[2 * KD_MAX_DIMS];
+      for (int d = 0; d < kd_dims; d++) {
+        predicate[2 * d] = column_ranges[d][0].first - 1.0;
+        predicate[2 * d + 1] = column_ranges[d][0].second;
+      }
+      KdScanStats stats;
+      memset_mt(bitmap[0], 0, bits_num_needed(N));
+      PRINT_EXCECUTION_TIME("k-d refine", stats = kd->refine(bitmap[0], predicate, false, bitmap_kernels.box_test));
+      printf("[KD] %d nodes visited, %d filled, %d leaves tested (%ld rows)\n", stats.visited_nodes,
+             stats.filled_nodes, stats.tested_leaves, stats.tested_rows);
+    }
+    if (use_zorder) {
+      uint64_t lo[ZORDER_MAX_DIMS], hi[ZORDER_MAX_DIMS];
+      for (int d = 0; d < zorder_dims; d++) {
+        lo[d] = column_ranges[d][0].first;
+        hi[d] = column_ranges[d][0].second;
+      }
+      ZOrderScanStats stats;
+      memset_mt(bitmap[0], 0, bits_num_needed(N));
+      PRINT_EXCECUTION_TIME("z-order", stats = zorder->scan(bitmap[0], lo, hi));
+      printf("[ZORDER] %ld keys walked, %d jumps, %ld rows checked\n", stats.walked_keys, stats.jumps,
+             stats.checked_rows);
+    }
+    for (int bindex_id = 0; bindex_id < bindex_num && !ordered; bindex_id++) {
+      if (std::count(box_cols.begin(), box_cols.end(), bindex_id)) continue;
       for (int pi = 0; pi < target_l[bindex_id].size(); pi++) {
         printf("RUNNING %d\n", pi);
         target1 = target_l[bindex_id][pi];
@@ -2199,9 +5290,45 @@ void exp_opt(int argc, char *argv[]) {
         if (search_cmd[bindex_id] == "bt" && target1 > target2) {
           std::swap(target1, target2);
         }
+        if (ZONE_SCAN) {
+          RangeSet column_range = search_cmd[bindex_id] == "expr"
+                                      ? ranges[bindex_id]
+                                      : comparison_range(search_cmd[bindex_id], target1, target2);
+          std::vector<char> cls;
+          int mixed = classify_zones(bindexs[bindex_id], column_range, cls);
+          int all = std::count(cls.begin(), cls.end(), (char)ZONE_ALL);
+          printf("[ZONE] column %d: %d all-0, %d all-1, %d mixed of %d zones\n", bindex_id,
+                 (int)cls.size() - all - mixed, all, mixed, (int)cls.size());
+        }
 
         for (int i = 0; i < RUNS; i++) {
-          if (search_cmd[bindex_id] == "lt") {
+          if (approx_mode != APPROX_OFF) {
+            RangeSet column_range = search_cmd[bindex_id] == "expr"
+                                        ? ranges[bindex_id]
+                                        : comparison_range(search_cmd[bindex_id], target1, target2);
+            RangeScanPlan plan;
+            ApproxResult approx;
+            PRINT_EXCECUTION_TIME("approx", approx = bindex_scan_approx(bindexs[bindex_id], bitmap[bindex_id],
+                                                                        column_range, &plan));
+            printf("[APPROX] column %d: %d +- %d rows\n", bindex_id, approx.count, approx.error);
+            if (approx_mode == APPROX_PROGRESSIVE) {
+              PRINT_EXCECUTION_TIME("refine", refine_plan(bitmap[bindex_id], plan, &default_ctx));
+            } else if (pi + 1 == (int)target_l[bindex_id].size()) {
+              approx_error += approx.error;
+            }
+          } else if (search_cmd[bindex_id] == "expr") {
+            PRINT_EXCECUTION_TIME("expr", bindex_scan_ranges(bindexs[bindex_id], bitmap[bindex_id], ranges[bindex_id]));
+          } else if (ZONE_SCAN) {
+            PRINT_EXCECUTION_TIME("zoned", bindex_scan_ranges(bindexs[bindex_id], bitmap[bindex_id],
+                                                              comparison_range(search_cmd[bindex_id], target1, target2)));
+          } else if (result_cache.budget) {
+            PRINT_EXCECUTION_TIME("cached", cached_scan(bindex_id, bindexs[bindex_id], bitmap[bindex_id],
+                                                        search_cmd[bindex_id], target1, target2));
+          } else if (USE_PLANNER) {
+            PRINT_EXCECUTION_TIME("planned", bindex_scan_planned(bindexs[bindex_id], initial_data[bindex_id],
+                                                                 bitmap[bindex_id], search_cmd[bindex_id], target1,
+                                                                 target2, plan_force));
+          } else if (search_cmd[bindex_id] == "lt") {
             PRINT_EXCECUTION_TIME("lt", bindex_scan_lt(bindexs[bindex_id], bitmap[bindex_id], target1));
             // check(bindexs[bindex_id], bitmap[bindex_id], target1, 0, LT, raw_datas[bindex_id]);
           } else if (search_cmd[bindex_id] == "le") {
@@ -2239,24 +5366,70 @@ void exp_opt(int argc, char *argv[]) {
     //   printf("No enough threads, set stride to %d\n",stride);
     // }
 
-    int max_idx = (N + CODEWIDTH - 1) / CODEWIDTH;
-    int stride = (max_idx + THREAD_NUM - 1) / THREAD_NUM;
-
-    std::thread threads[THREAD_NUM];
-    for (int bindex_id = 1; bindex_id < bindex_num; bindex_id++) {
-      int start_idx = 0;
-      int end_idx = 0;
-      size_t t_id = 0;
-      while(end_idx < max_idx && t_id < THREAD_NUM) {
-        end_idx = start_idx + stride;
-        if (end_idx > max_idx) {
-          end_idx = max_idx;
+    if (bindex_num > 1 && !ordered) {
+      // Selected rows per column from the index alone, to read the sparsest column first
+      POSTYPE counts[MAX_BINDEX_NUM];
+      BITS *sources[MAX_BINDEX_NUM];
+      int source_num = 0;
+      for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+        if (std::count(box_cols.begin() + (box_cols.size() > 0), box_cols.end(), bindex_id)) continue;
+        counts[source_num] = bindex_count_ranges(bindexs[bindex_id], column_ranges[bindex_id]);
+        for (size_t i = 1; box_cols.size() && bindex_id == box_cols[0] && i < box_cols.size(); i++) {
+          counts[source_num] =
+              std::min(counts[source_num], bindex_count_ranges(bindexs[box_cols[i]], column_ranges[box_cols[i]]));
         }
-        threads[t_id] = std::thread(refine_result_bitmap, bitmap[0], bitmap[bindex_id], start_idx, end_idx, t_id);
-        start_idx += stride;
-        t_id += 1;
+        sources[source_num++] = bitmap[bindex_id];
       }
-      for (int i = 0; i < THREAD_NUM; i++) threads[i].join();
+      PRINT_EXCECUTION_TIME("merge", bitmap_merge(bitmap[0], sources, counts, source_num, N, false));
+    }
+
+    AggPasses agg_passes;
+    if (agg_specs.size()) {
+      PRINT_EXCECUTION_TIME("aggregate", run_aggregates(agg_specs, bitmap[0], visible_len, initial_data, agg_passes));
+    }
+    std::vector<std::vector<POSTYPE> > order_rows(order_specs.size());
+    std::vector<std::vector<CODE> > order_vals(order_specs.size());
+    std::vector<int> order_found(order_specs.size());
+    for (size_t i = 0; i < order_specs.size(); i++) {
+      order_rows[i].resize(order_specs[i].k);
+      order_vals[i].resize(order_specs[i].k);
+      PRINT_EXCECUTION_TIME("order by", order_found[i] = bindex_walk_ordered(
+                                            bindexs[order_specs[i].col], 0, bindexs[order_specs[i].col]->length,
+                                            order_specs[i].descending, order_specs[i].k, bitmap[0],
+                                            order_rows[i].data(), order_vals[i].data(), visible_len));
+      printf("[ORDER] c%d %s limit %d: %d rows", order_specs[i].col, order_specs[i].descending ? "desc" : "asc",
+             order_specs[i].k, order_found[i]);
+      if (order_found[i]) printf(", %u .. %u", order_vals[i][0], order_vals[i][order_found[i] - 1]);
+      printf("\n");
+    }
+    std::vector<POSTYPE> page_rows(limit_k), limit_rows(limit_k);
+    int page_found = 0, limit_found = -1;
+    if (limit_k > 0) {
+      BitmapRankIndex rank_index;
+      PRINT_EXCECUTION_TIME("rank index", rank_index.reset(bitmap[0]); rank_index.extend(bits_num_needed(visible_len)));
+      PRINT_EXCECUTION_TIME("page", page_found = bitmap_page(rank_index, visible_len, limit_offset, limit_k, page_rows.data()));
+      printf("[LIMIT] offset %d limit %d: %d rows of %u\n", limit_offset, limit_k, page_found, rank_index.count());
+      if (row_ids.size() && page_found) {
+        printf("[REORDER] page rows as original row ids:");
+        for (int i = 0; i < std::min(page_found, 8); i++) printf(" %u", row_ids[page_rows[i]]);
+        printf("%s\n", page_found > 8 ? " ..." : "");
+      }
+      if (!TEST_INSERTING) {
+        // Again from scratch, in row order with early stop
+        int tiles_done;
+        PRINT_EXCECUTION_TIME("limit scan", limit_found = bindex_limit_scan(bindexs, column_ranges, bindex_num, limit_offset,
+                                                                            limit_k, limit_rows.data(), &tiles_done));
+        printf("[LIMIT] early stop after %d/%d tiles\n", tiles_done,
+               ROUNDUP_DIVIDE(bits_num_needed(visible_len), LIMIT_TILE_WORDS));
+      }
+    }
+
+    Materialized materialized;
+    if (materialize) {
+      PRINT_EXCECUTION_TIME("materialize", bitmap_materialize(bitmap[0], visible_len, initial_data, project_cols,
+                                                              &materialized));
+      printf("[PROJECT] %d rows x %d columns, %d dense/%d sparse tiles\n", materialized.count,
+             materialized.column_num, materialized.dense_tiles, materialized.sparse_tiles);
     }
 
     timer.commonGetEndTime(11);
@@ -2267,7 +5440,7 @@ void exp_opt(int argc, char *argv[]) {
     BITS *check_bitmap[MAX_BINDEX_NUM];
     int bitmap_len;
     for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
-      bitmap_len = bits_num_needed(bindexs[bindex_id]->length);
+      bitmap_len = bits_num_needed(N);
       check_bitmap[bindex_id] = (BITS *)aligned_alloc(SIMD_ALIGEN, bitmap_len * sizeof(BITS));
       memset_mt(check_bitmap[bindex_id], 0x0, bitmap_len);
     }
@@ -2282,11 +5455,59 @@ void exp_opt(int argc, char *argv[]) {
           bindexs[bindex_id],
           check_bitmap[bindex_id],
           check_bitmap[0],
-          initial_data[bindex_id]);
+          initial_data[bindex_id],
+          &ranges[bindex_id]);
     }
 
-    compare_bitmap(check_bitmap[0], bitmap[0], bindexs[0]->length, initial_data, bindex_num);
+    if (approx_mode == APPROX_ONLY) {
+      POSTYPE wrong = 0;
+      for (int i = 0; i < bits_num_needed(visible_len); i++) {
+        BITS diff = check_bitmap[0][i] ^ bitmap[0][i];
+        if (i == bits_num_needed(visible_len) - 1 && visible_len % BITSWIDTH) diff &= ~0U << (BITSWIDTH - visible_len % BITSWIDTH);
+        wrong += __builtin_popcount(diff);
+      }
+      printf("[CHECK]approx %d wrong rows, bound %d\n", wrong, approx_error);
+      assert(wrong <= approx_error);
+    } else {
+      compare_bitmap(check_bitmap[0], bitmap[0], visible_len, initial_data, bindex_num);
+    }
+    if (agg_specs.size()) check_aggregates(agg_passes, bitmap[0], visible_len, initial_data);
+    if (limit_k > 0) {
+      std::vector<POSTYPE> truth;
+      for (POSTYPE row = 0, j = 0; row < visible_len && (int)truth.size() < limit_k; row++) {
+        if (!(check_bitmap[0][row >> BITSSHIFT] & (1U << (BITSWIDTH - 1 - row % BITSWIDTH)))) continue;
+        if (j++ >= limit_offset) truth.push_back(row);
+      }
+      bool ok = page_found == (int)truth.size() && std::equal(truth.begin(), truth.end(), page_rows.begin());
+      if (limit_found >= 0) {
+        ok = ok && limit_found == (int)truth.size() && std::equal(truth.begin(), truth.end(), limit_rows.begin());
+      }
+      printf("[CHECK]limit %d/%d\n", page_found, (int)truth.size());
+      assert(ok);
+    }
+    if (materialize) {
+      check_materialized(&materialized, bitmap[0], visible_len, initial_data);
+      free_materialized(&materialized);
+    }
+    for (size_t i = 0; i < order_specs.size(); i++) {
+      check_order_by(order_specs[i], bitmap[0], visible_len, initial_data[order_specs[i].col], order_rows[i].data(),
+                     order_vals[i].data(), order_found[i]);
+    }
     printf("[CHECK]check final result done.\n\n");
+    if (result_cache.budget) result_cache.report();
+
+    if (replicate_num && !TEST_INSERTING) {
+      // Snapshots may still be read by the appender, only replicate static indexes
+      for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+        replicate_hot_filter_vectors(bindexs[bindex_id], replicate_num);
+      }
+    }
+
+    if (TEST_INSERTING) {
+      for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
+        bindex_unpin(vbindexs[bindex_id], snapshot_slots[bindex_id]);
+      }
+    }
 
     for (int i = 0; i < bitmap_len; i++) {
       if (bitmap[0][i] != 0) {
@@ -2308,11 +5529,17 @@ void exp_opt(int argc, char *argv[]) {
   } */
 
   // clean jobs
+  for (int bindex_id = bindex_num; bindex_id < column_num; bindex_id++) {
+    free(initial_data[bindex_id]);
+  }
   for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
     free(initial_data[bindex_id]);
     free_bindex(bindexs[bindex_id], initial_data[bindex_id]);
-    free(bitmap[bindex_id]);
+    free_bitmap(bitmap[bindex_id]);
   }
+  delete grid;
+  delete kd;
+  delete zorder;
   // free(result1);
   // free(result2);
 }
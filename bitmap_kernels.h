@@ -0,0 +1,637 @@
+#ifndef BITMAP_KERNELS_H_
+#define BITMAP_KERNELS_H_
+
+// Bitmap copy/combine, masked aggregation, column scan, box test and materialization kernels with scalar, AVX2 and
+// AVX-512 variants picked at runtime from CPUID, so the binary doesn't need
+// -march=native. Large outputs that are only read once afterwards are written with non-temporal
+// stores to keep them from evicting the filter vectors.
+#include <immintrin.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+// Computes to[i] = OP(a[i], b[i]) over n words, b may be NULL for unary ops.
+// 'stream' asks for non-temporal stores, the kernel ends with a store fence.
+typedef void (*bitmap_kernel)(uint32_t *to, const uint32_t *a, const uint32_t *b, int n, bool stream);
+
+struct BitmapCopy {
+  static uint32_t scalar(uint32_t a, uint32_t) { return a; }
+  __attribute__((target("avx2"))) static __m256i avx2(__m256i a, __m256i) { return a; }
+  __attribute__((target("avx512f"))) static __m512i avx512(__m512i a, __m512i) { return a; }
+};
+
+struct BitmapNot {
+  static uint32_t scalar(uint32_t a, uint32_t) { return ~a; }
+  __attribute__((target("avx2"))) static __m256i avx2(__m256i a, __m256i) {
+    return _mm256_xor_si256(a, _mm256_set1_epi32(-1));
+  }
+  __attribute__((target("avx512f"))) static __m512i avx512(__m512i a, __m512i) {
+    return _mm512_xor_si512(a, _mm512_set1_epi32(-1));
+  }
+};
+
+struct BitmapAndNot {  // ~a & b
+  static uint32_t scalar(uint32_t a, uint32_t b) { return ~a & b; }
+  __attribute__((target("avx2"))) static __m256i avx2(__m256i a, __m256i b) { return _mm256_andnot_si256(a, b); }
+  __attribute__((target("avx512f"))) static __m512i avx512(__m512i a, __m512i b) {
+    return _mm512_andnot_si512(a, b);
+  }
+};
+
+struct BitmapXor {
+  static uint32_t scalar(uint32_t a, uint32_t b) { return a ^ b; }
+  __attribute__((target("avx2"))) static __m256i avx2(__m256i a, __m256i b) { return _mm256_xor_si256(a, b); }
+  __attribute__((target("avx512f"))) static __m512i avx512(__m512i a, __m512i b) { return _mm512_xor_si512(a, b); }
+};
+
+struct BitmapAnd {
+  static const uint32_t absorbing = 0;  // a & 0 stays 0 whatever follows
+  static uint32_t scalar(uint32_t a, uint32_t b) { return a & b; }
+  __attribute__((target("avx2"))) static __m256i avx2(__m256i a, __m256i b) { return _mm256_and_si256(a, b); }
+  __attribute__((target("avx512f"))) static __m512i avx512(__m512i a, __m512i b) { return _mm512_and_si512(a, b); }
+};
+
+struct BitmapOr {
+  static const uint32_t absorbing = ~0U;
+  static uint32_t scalar(uint32_t a, uint32_t b) { return a | b; }
+  __attribute__((target("avx2"))) static __m256i avx2(__m256i a, __m256i b) { return _mm256_or_si256(a, b); }
+  __attribute__((target("avx512f"))) static __m512i avx512(__m512i a, __m512i b) { return _mm512_or_si512(a, b); }
+};
+
+template <class OP>
+void bitmap_scalar(uint32_t *to, const uint32_t *a, const uint32_t *b, int n, bool) {
+  if (!b) b = a;
+  for (int i = 0; i < n; i++) to[i] = OP::scalar(a[i], b[i]);
+}
+
+template <class OP>
+__attribute__((target("avx2"))) void bitmap_avx2(uint32_t *to, const uint32_t *a, const uint32_t *b, int n,
+                                                 bool stream) {
+  if (!b) b = a;
+  int i = 0;
+  // Head until 'to' is 32 bytes aligned, our bitmaps already are
+  for (; i < n && ((uintptr_t)(to + i) & 31); i++) to[i] = OP::scalar(a[i], b[i]);
+  if (stream) {
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = OP::avx2(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+      _mm256_stream_si256((__m256i *)(to + i), v);
+    }
+    _mm_sfence();
+  } else {
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = OP::avx2(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+      _mm256_store_si256((__m256i *)(to + i), v);
+    }
+  }
+  for (; i < n; i++) to[i] = OP::scalar(a[i], b[i]);
+}
+
+template <class OP>
+__attribute__((target("avx512f"))) void bitmap_avx512(uint32_t *to, const uint32_t *a, const uint32_t *b, int n,
+                                                      bool stream) {
+  if (!b) b = a;
+  int i = 0;
+  for (; i < n && ((uintptr_t)(to + i) & 63); i++) to[i] = OP::scalar(a[i], b[i]);
+  if (stream) {
+    for (; i + 16 <= n; i += 16) {
+      __m512i v = OP::avx512(_mm512_loadu_si512((const void *)(a + i)), _mm512_loadu_si512((const void *)(b + i)));
+      _mm512_stream_si512((__m512i *)(to + i), v);
+    }
+    _mm_sfence();
+  } else {
+    for (; i + 16 <= n; i += 16) {
+      __m512i v = OP::avx512(_mm512_loadu_si512((const void *)(a + i)), _mm512_loadu_si512((const void *)(b + i)));
+      _mm512_store_si512((void *)(to + i), v);
+    }
+  }
+  for (; i < n; i++) to[i] = OP::scalar(a[i], b[i]);
+}
+
+// K-way merge: to[i] = OP(srcs[0][i], ..., srcs[k - 1][i]) over n words,
+// every word of 'to' written once ('to' may be one of the sources). Sources
+// are combined a chunk at a time in the given order and a chunk stops reading
+// them once all its words are OP::absorbing, so the most decisive source
+// should come first.
+#define MERGE_CHUNK_WORDS 64  // 256 bytes, held in registers
+
+typedef void (*merge_kernel)(uint32_t *to, const uint32_t *const *srcs, int k, int n);
+
+template <class OP>
+void merge_scalar(uint32_t *to, const uint32_t *const *srcs, int k, int n) {
+  int i = 0;
+  for (; i + MERGE_CHUNK_WORDS <= n; i += MERGE_CHUNK_WORDS) {
+    uint32_t acc[MERGE_CHUNK_WORDS];
+    memcpy(acc, srcs[0] + i, sizeof(acc));
+    for (int s = 1; s < k; s++) {
+      uint32_t diff = 0;
+      for (int j = 0; j < MERGE_CHUNK_WORDS; j++) diff |= acc[j] ^ OP::absorbing;
+      if (!diff) break;
+      for (int j = 0; j < MERGE_CHUNK_WORDS; j++) acc[j] = OP::scalar(acc[j], srcs[s][i + j]);
+    }
+    memcpy(to + i, acc, sizeof(acc));
+  }
+  for (; i < n; i++) {
+    uint32_t v = srcs[0][i];
+    for (int s = 1; s < k; s++) v = OP::scalar(v, srcs[s][i]);
+    to[i] = v;
+  }
+}
+
+template <class OP>
+__attribute__((target("avx2"))) void merge_avx2(uint32_t *to, const uint32_t *const *srcs, int k, int n) {
+  const int regs = MERGE_CHUNK_WORDS / 8;
+  const __m256i absorbing = _mm256_set1_epi32(OP::absorbing);
+  int i = 0;
+  for (; i + MERGE_CHUNK_WORDS <= n; i += MERGE_CHUNK_WORDS) {
+    __m256i acc[regs];
+    for (int r = 0; r < regs; r++) acc[r] = _mm256_loadu_si256((const __m256i *)(srcs[0] + i + r * 8));
+    for (int s = 1; s < k; s++) {
+      __m256i diff = _mm256_setzero_si256();
+      for (int r = 0; r < regs; r++) diff = _mm256_or_si256(diff, _mm256_xor_si256(acc[r], absorbing));
+      if (_mm256_testz_si256(diff, diff)) break;
+      for (int r = 0; r < regs; r++) {
+        acc[r] = OP::avx2(acc[r], _mm256_loadu_si256((const __m256i *)(srcs[s] + i + r * 8)));
+      }
+    }
+    for (int r = 0; r < regs; r++) _mm256_storeu_si256((__m256i *)(to + i + r * 8), acc[r]);
+  }
+  for (; i < n; i++) {
+    uint32_t v = srcs[0][i];
+    for (int s = 1; s < k; s++) v = OP::scalar(v, srcs[s][i]);
+    to[i] = v;
+  }
+}
+
+template <class OP>
+__attribute__((target("avx512f"))) void merge_avx512(uint32_t *to, const uint32_t *const *srcs, int k, int n) {
+  const int regs = MERGE_CHUNK_WORDS / 16;
+  const __m512i absorbing = _mm512_set1_epi32(OP::absorbing);
+  int i = 0;
+  for (; i + MERGE_CHUNK_WORDS <= n; i += MERGE_CHUNK_WORDS) {
+    __m512i acc[regs];
+    for (int r = 0; r < regs; r++) acc[r] = _mm512_loadu_si512((const void *)(srcs[0] + i + r * 16));
+    for (int s = 1; s < k; s++) {
+      __m512i diff = _mm512_setzero_si512();
+      for (int r = 0; r < regs; r++) diff = _mm512_or_si512(diff, _mm512_xor_si512(acc[r], absorbing));
+      if (!_mm512_test_epi32_mask(diff, diff)) break;
+      for (int r = 0; r < regs; r++) {
+        acc[r] = OP::avx512(acc[r], _mm512_loadu_si512((const void *)(srcs[s] + i + r * 16)));
+      }
+    }
+    for (int r = 0; r < regs; r++) _mm512_storeu_si512((void *)(to + i + r * 16), acc[r]);
+  }
+  for (; i < n; i++) {
+    uint32_t v = srcs[0][i];
+    for (int s = 1; s < k; s++) v = OP::scalar(v, srcs[s][i]);
+    to[i] = v;
+  }
+}
+
+// Aggregates of the rows selected by a result bitmap (row i is bit 31 - i % 32
+// of word i / 32). With a second column b, sum is the sum of a[i] * b[i]
+// (wrapping at 2^64); min and max are always over a.
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+} MaskedAgg;
+
+// Folds the full words [start_word, end_word) into 'agg', zero words are skipped
+typedef void (*masked_agg_kernel)(const uint32_t *bitmap, int start_word, int end_word, const uint32_t *a,
+                                  const uint32_t *b, MaskedAgg *agg);
+
+inline void masked_agg_word(uint32_t w, const uint32_t *a, const uint32_t *b, MaskedAgg *agg) {
+  agg->count += __builtin_popcount(w);
+  while (w) {
+    int j = __builtin_clz(w);  // MSB first
+    w &= ~(0x80000000U >> j);
+    agg->sum += b ? (uint64_t)a[j] * b[j] : a[j];
+    if (a[j] < agg->min) agg->min = a[j];
+    if (a[j] > agg->max) agg->max = a[j];
+  }
+}
+
+inline void masked_agg_scalar(const uint32_t *bitmap, int start_word, int end_word, const uint32_t *a,
+                              const uint32_t *b, MaskedAgg *agg) {
+  for (int i = start_word; i < end_word; i++) {
+    if (bitmap[i]) masked_agg_word(bitmap[i], a + i * 32, b ? b + i * 32 : NULL, agg);
+  }
+}
+
+__attribute__((target("avx2"))) inline void masked_agg_avx2(const uint32_t *bitmap, int start_word, int end_word,
+                                                            const uint32_t *a, const uint32_t *b, MaskedAgg *agg) {
+  const __m256i lane_bits = _mm256_setr_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+  const __m256i ones = _mm256_set1_epi32(-1);
+  __m256i sum = _mm256_setzero_si256();
+  __m256i vmin = ones;
+  __m256i vmax = _mm256_setzero_si256();
+  for (int i = start_word; i < end_word; i++) {
+    uint32_t w = bitmap[i];
+    if (!w) continue;
+    agg->count += __builtin_popcount(w);
+    for (int g = 0; g < 4; g++) {
+      uint32_t byte = (w >> (24 - 8 * g)) & 0xFF;
+      if (!byte) continue;
+      // lane j of group g is row i * 32 + g * 8 + j, i.e. bit 7 - j of 'byte'
+      __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(byte), lane_bits), lane_bits);
+      __m256i va = _mm256_loadu_si256((const __m256i *)(a + i * 32 + g * 8));
+      __m256i sel = _mm256_and_si256(va, mask);
+      vmin = _mm256_min_epu32(vmin, _mm256_blendv_epi8(ones, va, mask));
+      vmax = _mm256_max_epu32(vmax, sel);
+      __m256i lo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(sel));
+      __m256i hi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(sel, 1));
+      if (b) {
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i * 32 + g * 8));
+        lo = _mm256_mul_epu32(lo, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(vb)));
+        hi = _mm256_mul_epu32(hi, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(vb, 1)));
+      }
+      sum = _mm256_add_epi64(sum, _mm256_add_epi64(lo, hi));
+    }
+  }
+  uint64_t sums[4];
+  uint32_t mins[8], maxs[8];
+  _mm256_storeu_si256((__m256i *)sums, sum);
+  _mm256_storeu_si256((__m256i *)mins, vmin);
+  _mm256_storeu_si256((__m256i *)maxs, vmax);
+  agg->sum += sums[0] + sums[1] + sums[2] + sums[3];
+  for (int j = 0; j < 8; j++) {
+    if (mins[j] < agg->min) agg->min = mins[j];
+    if (maxs[j] > agg->max) agg->max = maxs[j];
+  }
+}
+
+// Full column scan: sets bit 31 - j of to[i] iff lo <= v[i * 32 + j] <= hi
+// (unsigned), for the full words [start_word, end_word)
+typedef void (*range_scan_kernel)(uint32_t *to, const uint32_t *v, uint32_t lo, uint32_t hi, int start_word,
+                                  int end_word);
+
+inline uint32_t reverse_byte(uint32_t b) {
+  b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+  b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+  return (b & 0xAA) >> 1 | (b & 0x55) << 1;
+}
+
+inline void range_scan_scalar(uint32_t *to, const uint32_t *v, uint32_t lo, uint32_t hi, int start_word,
+                              int end_word) {
+  uint32_t span = hi - lo;
+  for (int i = start_word; i < end_word; i++) {
+    uint32_t bits = 0;
+    for (int j = 0; j < 32; j++) bits |= (uint32_t)(v[i * 32 + j] - lo <= span) << (31 - j);
+    to[i] = bits;
+  }
+}
+
+__attribute__((target("avx2"))) inline void range_scan_avx2(uint32_t *to, const uint32_t *v, uint32_t lo,
+                                                            uint32_t hi, int start_word, int end_word) {
+  // lo <= x <= hi  <=>  x - lo <= hi - lo, unsigned
+  const __m256i vlo = _mm256_set1_epi32(lo);
+  const __m256i vspan = _mm256_set1_epi32(hi - lo);
+  for (int i = start_word; i < end_word; i++) {
+    uint32_t bits = 0;
+    for (int g = 0; g < 4; g++) {
+      __m256i d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(v + i * 32 + g * 8)), vlo);
+      __m256i in = _mm256_cmpeq_epi32(_mm256_min_epu32(d, vspan), d);
+      uint32_t m = _mm256_movemask_ps(_mm256_castsi256_ps(in));  // lane j at bit j
+      bits |= reverse_byte(m) << (24 - 8 * g);
+    }
+    to[i] = bits;
+  }
+}
+
+// Box test: sets bit 31 - i % 32 of to[i / 32] iff lo[d] <= cols[d][i] <=
+// lo[d] + span[d] on every one of the dims columns, for the points [0, n)
+typedef void (*box_test_kernel)(uint32_t *to, const uint32_t *const *cols, int dims, const uint32_t *lo,
+                                const uint32_t *span, int n);
+
+inline void box_test_tail(uint32_t *to, const uint32_t *const *cols, int dims, const uint32_t *lo,
+                          const uint32_t *span, int from, int n) {
+  for (int i = from; i < n; i++) {
+    bool hit = true;
+    for (int d = 0; d < dims; d++) hit &= cols[d][i] - lo[d] <= span[d];
+    to[i / 32] |= (uint32_t)hit << (31 - i % 32);
+  }
+}
+
+inline void box_test_scalar(uint32_t *to, const uint32_t *const *cols, int dims, const uint32_t *lo,
+                            const uint32_t *span, int n) {
+  memset(to, 0, (n + 31) / 32 * sizeof(uint32_t));
+  box_test_tail(to, cols, dims, lo, span, 0, n);
+}
+
+__attribute__((target("avx2"))) inline void box_test_avx2(uint32_t *to, const uint32_t *const *cols, int dims,
+                                                          const uint32_t *lo, const uint32_t *span, int n) {
+  memset(to, 0, (n + 31) / 32 * sizeof(uint32_t));
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i hit = _mm256_set1_epi32(-1);
+    for (int d = 0; d < dims; d++) {
+      __m256i x = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(cols[d] + i)), _mm256_set1_epi32(lo[d]));
+      hit = _mm256_and_si256(hit, _mm256_cmpeq_epi32(_mm256_min_epu32(x, _mm256_set1_epi32(span[d])), x));
+    }
+    uint32_t m = _mm256_movemask_ps(_mm256_castsi256_ps(hit));  // lane j at bit j
+    to[i / 32] |= reverse_byte(m) << (24 - i % 32);
+  }
+  box_test_tail(to, cols, dims, lo, span, i, n);
+}
+
+// Compress: appends values[row] of every set row of the full words
+// [start_word, end_word) to 'out' in row order, or the row ids themselves if
+// 'values' is NULL. 'count' is the number of set bits in the range, the wide
+// stores of the faster paths never reach past out[count - 1].
+typedef int (*compress_kernel)(const uint32_t *bitmap, int start_word, int end_word, const uint32_t *values,
+                               uint32_t *out, int count);
+
+inline int compress_word_exact(uint32_t w, uint32_t base, const uint32_t *values, uint32_t *out) {
+  int n = 0;
+  while (w) {
+    int j = __builtin_clz(w);  // MSB first
+    w &= ~(0x80000000U >> j);
+    out[n++] = values ? values[base + j] : base + j;
+  }
+  return n;
+}
+
+inline int compress_scalar(const uint32_t *bitmap, int start_word, int end_word, const uint32_t *values,
+                           uint32_t *out, int count) {
+  int n = 0;
+  for (int i = start_word; i < end_word; i++) {
+    uint32_t w = bitmap[i], base = i * 32;
+    if (!w) continue;
+    if (__builtin_popcount(w) >= 16 && n + 32 <= count) {
+      // Dense word, branch free: every row is written, only set ones advance
+      for (int j = 0; j < 32; j++) {
+        out[n] = values ? values[base + j] : base + j;
+        n += (w >> (31 - j)) & 1;
+      }
+    } else {
+      n += compress_word_exact(w, base, values, out + n);
+    }
+  }
+  return n;
+}
+
+// Set rows of each byte (bit 7 first) as 8 packed lane indices, for permutes
+struct CompressTable {
+  uint64_t lanes[256];
+  CompressTable() {
+    for (int b = 0; b < 256; b++) {
+      uint64_t packed = 0;
+      for (int j = 0, n = 0; j < 8; j++) {
+        if (b & (0x80 >> j)) packed |= (uint64_t)j << (8 * n++);
+      }
+      lanes[b] = packed;
+    }
+  }
+};
+
+inline const CompressTable &compress_table() {
+  static CompressTable table;
+  return table;
+}
+
+__attribute__((target("avx2"))) inline int compress_avx2(const uint32_t *bitmap, int start_word, int end_word,
+                                                         const uint32_t *values, uint32_t *out, int count) {
+  const CompressTable &table = compress_table();
+  int n = 0;
+  for (int i = start_word; i < end_word; i++) {
+    uint32_t w = bitmap[i], base = i * 32;
+    if (!w) continue;
+    if (n + 32 > count) {
+      // Near the end of the output a full 8-lane store would overrun it
+      n += compress_word_exact(w, base, values, out + n);
+      continue;
+    }
+    for (int g = 0; g < 4; g++) {
+      uint32_t byte = (w >> (24 - 8 * g)) & 0xFF;
+      if (!byte) continue;
+      __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&table.lanes[byte]));
+      __m256i v;
+      if (values) {
+        v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(values + base + g * 8)), idx);
+      } else {
+        v = _mm256_add_epi32(idx, _mm256_set1_epi32(base + g * 8));
+      }
+      _mm256_storeu_si256((__m256i *)(out + n), v);
+      n += __builtin_popcount(byte);
+    }
+  }
+  return n;
+}
+
+__attribute__((target("avx512f"))) inline int compress_avx512(const uint32_t *bitmap, int start_word, int end_word,
+                                                              const uint32_t *values, uint32_t *out, int) {
+  // Masked compress stores write exactly the selected lanes
+  const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  int n = 0;
+  for (int i = start_word; i < end_word; i++) {
+    uint32_t w = bitmap[i], base = i * 32;
+    if (!w) continue;
+    for (int h = 0; h < 2; h++) {
+      uint32_t half = (w >> (16 - 16 * h)) & 0xFFFF;
+      if (!half) continue;
+      __mmask16 m = (__mmask16)(reverse_byte(half >> 8) | reverse_byte(half & 0xFF) << 8);  // lane j: row j
+      __m512i v;
+      if (values) {
+        v = _mm512_loadu_si512((const void *)(values + base + h * 16));
+      } else {
+        v = _mm512_add_epi32(lanes, _mm512_set1_epi32(base + h * 16));
+      }
+      _mm512_mask_compressstoreu_epi32(out + n, m, v);
+      n += __builtin_popcount(half);
+    }
+  }
+  return n;
+}
+
+// Gather: out[i] = values[rows[i]] for i < n, prefetching the random reads ahead
+#define GATHER_PREFETCH 32
+
+typedef void (*gather_kernel)(const uint32_t *values, const uint32_t *rows, int n, uint32_t *out);
+
+inline void gather_scalar(const uint32_t *values, const uint32_t *rows, int n, uint32_t *out) {
+  for (int i = 0; i < n; i++) {
+    if (i + GATHER_PREFETCH < n) __builtin_prefetch(values + rows[i + GATHER_PREFETCH]);
+    out[i] = values[rows[i]];
+  }
+}
+
+__attribute__((target("avx2"))) inline void gather_avx2(const uint32_t *values, const uint32_t *rows, int n,
+                                                        uint32_t *out) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    for (int j = i + GATHER_PREFETCH; j < std::min(i + GATHER_PREFETCH + 8, n); j++) __builtin_prefetch(values + rows[j]);
+    __m256i idx = _mm256_loadu_si256((const __m256i *)(rows + i));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_i32gather_epi32((const int *)values, idx, 4));
+  }
+  for (; i < n; i++) out[i] = values[rows[i]];
+}
+
+__attribute__((target("avx512f"))) inline void gather_avx512(const uint32_t *values, const uint32_t *rows, int n,
+                                                             uint32_t *out) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    for (int j = i + GATHER_PREFETCH; j < std::min(i + GATHER_PREFETCH + 16, n); j++) __builtin_prefetch(values + rows[j]);
+    __m512i idx = _mm512_loadu_si512((const void *)(rows + i));
+    _mm512_storeu_si512((void *)(out + i), _mm512_i32gather_epi32(idx, (const void *)values, 4));
+  }
+  for (; i < n; i++) out[i] = values[rows[i]];
+}
+
+// Rank/select over an MSB-first bitmap (row i is bit 31 - i % 32 of word
+// i / 32): cumulative popcounts per superblock of RANK_SUPERBLOCK_WORDS
+// words, extended as more words of the bitmap become final
+#define RANK_SUPERBLOCK_WORDS 16  // 512 rows
+
+class BitmapRankIndex {
+  public:
+
+  const uint32_t *bitmap = NULL;
+  int words = 0;                 // words indexed so far
+  uint32_t total = 0;            // set bits in them
+  std::vector<uint32_t> before;  // set bits before each superblock
+
+  void reset(const uint32_t *bits) {
+    bitmap = bits;
+    words = 0;
+    total = 0;
+    before.assign(1, 0);
+  }
+
+  // Index words up to 'ready' (a multiple of RANK_SUPERBLOCK_WORDS unless it is the end)
+  void extend(int ready) {
+    while (words < ready) {
+      int end = std::min(words + RANK_SUPERBLOCK_WORDS, ready);
+      for (int i = words; i < end; i++) total += __builtin_popcount(bitmap[i]);
+      if (end - words == RANK_SUPERBLOCK_WORDS) before.push_back(total);  // else a partial last superblock
+      words = end;
+    }
+  }
+
+  uint32_t count() const { return total; }
+
+  // Set bits in rows [0, row), row < words * 32
+  uint32_t rank(uint32_t row) const {
+    uint32_t w = row >> 5, sb = w / RANK_SUPERBLOCK_WORDS;
+    uint32_t r = before[sb];
+    for (uint32_t i = sb * RANK_SUPERBLOCK_WORDS; i < w; i++) r += __builtin_popcount(bitmap[i]);
+    if (row & 31) r += __builtin_popcount(bitmap[w] >> (32 - (row & 31)));
+    return r;
+  }
+
+  // Row of the j-th set bit (0-based), j < count()
+  uint32_t select(uint32_t j) const {
+    int sb = std::upper_bound(before.begin(), before.end(), j) - before.begin() - 1;
+    j -= before[sb];
+    int w = sb * RANK_SUPERBLOCK_WORDS;
+    for (;; w++) {
+      uint32_t c = __builtin_popcount(bitmap[w]);
+      if (j < c) break;
+      j -= c;
+    }
+    uint32_t bits = bitmap[w];
+    for (; j; j--) bits &= ~(0x80000000U >> __builtin_clz(bits));  // drop the highest set bits
+    return w * 32 + __builtin_clz(bits);
+  }
+};
+
+enum BITMAP_ISA {
+  ISA_AUTO = 0,  // best one the cpu supports
+  ISA_SCALAR,
+  ISA_AVX2,
+  ISA_AVX512,
+};
+
+class BitmapKernels {
+  public:
+
+  BITMAP_ISA isa;
+  bitmap_kernel copy;
+  bitmap_kernel not_;
+  bitmap_kernel andnot;
+  bitmap_kernel xor_;
+  merge_kernel and_merge;
+  merge_kernel or_merge;
+  masked_agg_kernel masked_agg;  // AVX2 at most, AVX-512 machines use the AVX2 variant
+  range_scan_kernel range_scan;  // likewise
+  box_test_kernel box_test;      // likewise
+  compress_kernel compress;
+  gather_kernel gather;
+  size_t stream_min_bytes;  // outputs at least this large use non-temporal stores
+
+  BitmapKernels() {
+    select(ISA_AUTO);
+    // Streaming pays off once the output doesn't fit in the last level cache
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    stream_min_bytes = llc > 0 ? (size_t)llc : (8UL << 20);
+  }
+
+  // Returns false if the cpu lacks the requested ISA, keeping the current one
+  bool select(BITMAP_ISA want) {
+    __builtin_cpu_init();
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    bool has_avx512 = __builtin_cpu_supports("avx512f");
+    if (want == ISA_AUTO) want = has_avx512 ? ISA_AVX512 : (has_avx2 ? ISA_AVX2 : ISA_SCALAR);
+    if ((want == ISA_AVX2 && !has_avx2) || (want == ISA_AVX512 && !has_avx512)) return false;
+    isa = want;
+    switch (isa) {
+      case ISA_AVX512:
+        copy = bitmap_avx512<BitmapCopy>;
+        not_ = bitmap_avx512<BitmapNot>;
+        andnot = bitmap_avx512<BitmapAndNot>;
+        xor_ = bitmap_avx512<BitmapXor>;
+        and_merge = merge_avx512<BitmapAnd>;
+        or_merge = merge_avx512<BitmapOr>;
+        masked_agg = masked_agg_avx2;
+        range_scan = range_scan_avx2;
+        box_test = box_test_avx2;
+        compress = compress_avx512;
+        gather = gather_avx512;
+        break;
+      case ISA_AVX2:
+        copy = bitmap_avx2<BitmapCopy>;
+        not_ = bitmap_avx2<BitmapNot>;
+        andnot = bitmap_avx2<BitmapAndNot>;
+        xor_ = bitmap_avx2<BitmapXor>;
+        and_merge = merge_avx2<BitmapAnd>;
+        or_merge = merge_avx2<BitmapOr>;
+        masked_agg = masked_agg_avx2;
+        range_scan = range_scan_avx2;
+        box_test = box_test_avx2;
+        compress = compress_avx2;
+        gather = gather_avx2;
+        break;
+      default:
+        copy = bitmap_scalar<BitmapCopy>;
+        not_ = bitmap_scalar<BitmapNot>;
+        andnot = bitmap_scalar<BitmapAndNot>;
+        xor_ = bitmap_scalar<BitmapXor>;
+        and_merge = merge_scalar<BitmapAnd>;
+        or_merge = merge_scalar<BitmapOr>;
+        masked_agg = masked_agg_scalar;
+        range_scan = range_scan_scalar;
+        box_test = box_test_scalar;
+        compress = compress_scalar;
+        gather = gather_scalar;
+    }
+    return true;
+  }
+
+  bool stream(size_t output_bytes) const { return output_bytes >= stream_min_bytes; }
+
+  const char *name() const {
+    switch (isa) {
+      case ISA_AVX512:
+        return "avx512";
+      case ISA_AVX2:
+        return "avx2";
+      default:
+        return "scalar";
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef GRID_SIEVE_H_
+#define GRID_SIEVE_H_
+
+// Two-dimensional sieve for a pair of columns that are often queried
+// together: a GRID_CELLS x GRID_CELLS grid of quantile cells over (a, b) with
+// the rows of every cell, plus filter vectors at every GRID_FV_STRIDE-th cell
+// border of each axis. A box predicate on both columns takes the fv-aligned
+// part of the box from two XORs and an AND, fills the other cells inside the
+// box from their row lists and checks raw values only in the cells the box
+// borders cut through.
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <parallel/algorithm>
+#include <vector>
+
+#define GRID_CELLS 64
+#define GRID_FV_STRIDE 4  // GRID_CELLS / GRID_FV_STRIDE - 1 filter vectors per axis
+
+typedef struct {
+  int filled_cells;   // Inside the box, rows set without checks
+  int checked_cells;  // Cut by the box borders
+  long checked_rows;
+} GridScanStats;
+
+class GridSieve {
+  public:
+
+  GridSieve(const uint32_t *a, const uint32_t *b, int n) : n(n), words((n + 31) / 32) {
+    col[0] = a;
+    col[1] = b;
+    for (int axis = 0; axis < 2; axis++) build_axis(axis);
+
+    // Rows of every cell, in row order
+    std::vector<uint16_t> cell(n);
+    cell_begin.assign(GRID_CELLS * GRID_CELLS + 1, 0);
+#pragma omp parallel for
+    for (int r = 0; r < n; r++) cell[r] = cell_of(0, col[0][r]) * GRID_CELLS + cell_of(1, col[1][r]);
+    for (int r = 0; r < n; r++) cell_begin[cell[r] + 1]++;
+    for (int c = 0; c < GRID_CELLS * GRID_CELLS; c++) cell_begin[c + 1] += cell_begin[c];
+    cell_rows.resize(n);
+    std::vector<uint32_t> fill(cell_begin.begin(), cell_begin.end() - 1);
+    for (int r = 0; r < n; r++) cell_rows[fill[cell[r]]++] = r;
+  }
+
+  ~GridSieve() {
+    for (int axis = 0; axis < 2; axis++) {
+      for (size_t i = 0; i < fvs[axis].size(); i++) free(fvs[axis][i]);
+    }
+  }
+
+  size_t bytes() const {
+    return (fvs[0].size() + fvs[1].size()) * words * sizeof(uint32_t) + cell_rows.size() * sizeof(uint32_t) +
+           cell_begin.size() * sizeof(uint32_t);
+  }
+
+  // result = rows with lo[0] <= a < hi[0] and lo[1] <= b < hi[1], MSB-first
+  // bitmap of (n + 31) / 32 words
+  GridScanStats scan(uint32_t *result, const uint64_t lo[2], const uint64_t hi[2]) const {
+    GridScanStats stats = {0, 0, 0};
+    int first[2], last[2], in_first[2], in_last[2], fv_first[2], fv_last[2];
+    for (int axis = 0; axis < 2; axis++) {
+      // Cells [first, last) overlap the box, [in_first, in_last) lie inside it
+      first[axis] = lo[axis] >= hi[axis] ? 0 : cell_of(axis, lo[axis]);
+      last[axis] = lo[axis] >= hi[axis] ? 0 : cell_of(axis, hi[axis] - 1) + 1;
+      in_first[axis] = first[axis] + (lo[axis] > bounds[axis][first[axis]]);
+      in_last[axis] = last[axis] - (last[axis] > 0 && hi[axis] < cell_end(axis, last[axis] - 1));
+      in_last[axis] = std::max(in_last[axis], in_first[axis]);
+      fv_first[axis] = (in_first[axis] + GRID_FV_STRIDE - 1) / GRID_FV_STRIDE * GRID_FV_STRIDE;
+      fv_last[axis] = std::max(fv_first[axis], in_last[axis] / GRID_FV_STRIDE * GRID_FV_STRIDE);
+    }
+
+    // The fv-aligned inner box
+    const uint32_t *a_lo = fv(0, fv_first[0]), *a_hi = fv(0, fv_last[0]);
+    const uint32_t *b_lo = fv(1, fv_first[1]), *b_hi = fv(1, fv_last[1]);
+    bool empty = fv_first[0] == fv_last[0] || fv_first[1] == fv_last[1];
+#pragma omp parallel for
+    for (int w = 0; w < words; w++) {
+      if (empty) {
+        result[w] = 0;
+        continue;
+      }
+      uint32_t in_a = (a_hi ? a_hi[w] : ~0U) ^ (a_lo ? a_lo[w] : 0);
+      uint32_t in_b = (b_hi ? b_hi[w] : ~0U) ^ (b_lo ? b_lo[w] : 0);
+      result[w] = in_a & in_b;
+    }
+    if (n % 32) result[words - 1] &= ~0U << (32 - n % 32);
+
+    // The remaining overlapping cells
+    std::vector<int> todo;
+    for (int i = first[0]; i < last[0]; i++) {
+      for (int j = first[1]; j < last[1]; j++) {
+        bool in_fv = !empty && i >= fv_first[0] && i < fv_last[0] && j >= fv_first[1] && j < fv_last[1];
+        if (in_fv) continue;
+        bool inside = i >= in_first[0] && i < in_last[0] && j >= in_first[1] && j < in_last[1];
+        todo.push_back((i * GRID_CELLS + j) * 2 + !inside);
+        if (inside) {
+          stats.filled_cells++;
+        } else {
+          stats.checked_cells++;
+          stats.checked_rows += cell_begin[i * GRID_CELLS + j + 1] - cell_begin[i * GRID_CELLS + j];
+        }
+      }
+    }
+#pragma omp parallel for schedule(dynamic)
+    for (size_t t = 0; t < todo.size(); t++) {
+      // Neighbouring cells share words, set bits atomically
+      int c = todo[t] / 2;
+      bool check = todo[t] % 2;
+      for (uint32_t k = cell_begin[c]; k < cell_begin[c + 1]; k++) {
+        uint32_t r = cell_rows[k];
+        if (check && !(col[0][r] >= lo[0] && col[0][r] < hi[0] && col[1][r] >= lo[1] && col[1][r] < hi[1])) continue;
+        __atomic_fetch_or(&result[r >> 5], 1U << (31 - r % 32), __ATOMIC_RELAXED);
+      }
+    }
+    return stats;
+  }
+
+  private:
+
+  int n, words;
+  const uint32_t *col[2];
+  uint32_t bounds[2][GRID_CELLS];    // First code of every cell, quantiles of the column
+  std::vector<uint32_t *> fvs[2];    // fvs[axis][i]: rows before cell (i + 1) * GRID_FV_STRIDE
+  std::vector<uint32_t> cell_begin;  // CSR offsets into cell_rows
+  std::vector<uint32_t> cell_rows;
+
+  int cell_of(int axis, uint64_t v) const {
+    // Last cell starting at or below v
+    const uint32_t *b = bounds[axis];
+    int c = std::upper_bound(b, b + GRID_CELLS, v, [](uint64_t x, uint32_t y) { return x < y; }) - b - 1;
+    return std::max(c, 0);
+  }
+
+  uint64_t cell_end(int axis, int c) const { return c + 1 < GRID_CELLS ? bounds[axis][c + 1] : 1ULL << 32; }
+
+  const uint32_t *fv(int axis, int c) const {
+    // Rows of the cells before c, NULL for none (c == 0) or all (GRID_CELLS)
+    if (c == 0 || c == GRID_CELLS) return NULL;
+    return fvs[axis][c / GRID_FV_STRIDE - 1];
+  }
+
+  void build_axis(int axis) {
+    std::vector<uint32_t> sorted(col[axis], col[axis] + n);
+    __gnu_parallel::sort(sorted.begin(), sorted.end());
+    for (int c = 0; c < GRID_CELLS; c++) bounds[axis][c] = n ? sorted[(long)c * n / GRID_CELLS] : 0;
+    bounds[axis][0] = 0;  // Every code falls into a cell
+    const uint32_t *v = col[axis];
+    for (int c = GRID_FV_STRIDE; c < GRID_CELLS; c += GRID_FV_STRIDE) {
+      uint32_t *fv = (uint32_t *)calloc(words, sizeof(uint32_t));
+      uint32_t bound = bounds[axis][c];
+#pragma omp parallel for
+      for (int w = 0; w < words; w++) {
+        uint32_t bits = 0;
+        for (int i = 0; i < 32 && w * 32 + i < n; i++) bits |= (uint32_t)(v[w * 32 + i] < bound) << (31 - i);
+        fv[w] = bits;
+      }
+      fvs[axis].push_back(fv);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef HUGEPAGE_H_
+#define HUGEPAGE_H_
+
+// Page-size aware allocation for the large, randomly accessed structures
+// (filter vectors, result bitmaps, position blocks): explicit hugetlb pages
+// (MAP_HUGETLB), transparent huge pages (madvise) or normal pages, falling
+// back to the next smaller option when the system can't provide them
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGE_PAGE_2M (2UL << 20)
+#define HUGE_PAGE_1G (1UL << 30)
+
+enum PAGE_POLICY {
+  PAGE_NORMAL = 0,  // malloc-like, base pages
+  PAGE_THP,         // 2 MB aligned anonymous memory with MADV_HUGEPAGE
+  PAGE_HUGE_2M,     // MAP_HUGETLB 2 MB pages, falls back to PAGE_THP
+  PAGE_HUGE_1G,     // MAP_HUGETLB 1 GB pages, falls back to PAGE_HUGE_2M
+};
+
+inline const char *page_policy_name(PAGE_POLICY policy) {
+  switch (policy) {
+    case PAGE_THP:
+      return "thp";
+    case PAGE_HUGE_2M:
+      return "2m";
+    case PAGE_HUGE_1G:
+      return "1g";
+    default:
+      return "normal";
+  }
+}
+
+class PageAllocator {
+  public:
+
+  // Pointers from alloc(..) are page aligned and must be released with release(..)
+  void *alloc(size_t bytes, PAGE_POLICY policy) {
+    if (bytes == 0) bytes = 1;
+    if (policy == PAGE_HUGE_1G) {
+      void *p = map_hugetlb(bytes, HUGE_PAGE_1G, 30);
+      if (p) return p;
+      policy = PAGE_HUGE_2M;
+    }
+    if (policy == PAGE_HUGE_2M) {
+      void *p = map_hugetlb(bytes, HUGE_PAGE_2M, 21);
+      if (p) return p;
+      policy = PAGE_THP;
+    }
+    void *p = NULL;
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (policy == PAGE_THP) {
+      size_t len = (bytes + HUGE_PAGE_2M - 1) / HUGE_PAGE_2M * HUGE_PAGE_2M;
+      if (posix_memalign(&p, HUGE_PAGE_2M, len) != 0) return NULL;
+      madvise(p, len, MADV_HUGEPAGE);
+      return p;
+    }
+    if (posix_memalign(&p, page, (bytes + page - 1) / page * page) != 0) return NULL;
+    return p;
+  }
+
+  void release(void *p) {
+    if (!p) return;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      std::map<void *, size_t>::iterator it = mapped.find(p);
+      if (it != mapped.end()) {
+        munmap(p, it->second);
+        mapped.erase(it);
+        return;
+      }
+    }
+    free(p);
+  }
+
+  // Page size backing p in kB and the share of the mapping in huge pages,
+  // from /proc/self/smaps (THP promotion happens on first touch)
+  static size_t page_size_kb(void *p, double *huge_ratio) {
+    std::ifstream fin("/proc/self/smaps");
+    std::string line;
+    unsigned long addr = (unsigned long)p;
+    bool in_vma = false;
+    size_t size_kb = 0, anon_huge_kb = 0, page_kb = 0;
+    while (std::getline(fin, line)) {
+      unsigned long lo, hi;
+      if (sscanf(line.c_str(), "%lx-%lx ", &lo, &hi) == 2) {
+        if (in_vma) break;
+        in_vma = lo <= addr && addr < hi;
+        continue;
+      }
+      if (!in_vma) continue;
+      size_t kb;
+      if (sscanf(line.c_str(), "Size: %zu kB", &kb) == 1) size_kb = kb;
+      if (sscanf(line.c_str(), "AnonHugePages: %zu kB", &kb) == 1) anon_huge_kb = kb;
+      if (sscanf(line.c_str(), "KernelPageSize: %zu kB", &kb) == 1) page_kb = kb;
+    }
+    if (huge_ratio) {
+      *huge_ratio = page_kb > 4 ? 1.0 : (size_kb ? (double)anon_huge_kb / size_kb : 0.0);
+    }
+    if (page_kb <= 4 && size_kb && anon_huge_kb * 2 >= size_kb) return HUGE_PAGE_2M >> 10;
+    return page_kb;
+  }
+
+  static void report(const char *name, void *p) {
+    double huge_ratio;
+    size_t kb = page_size_kb(p, &huge_ratio);
+    printf("[PAGES] %s: %zu kB pages (%.1f%% huge)\n", name, kb, huge_ratio * 100);
+  }
+
+  private:
+
+  std::mutex lock;
+  std::map<void *, size_t> mapped;  // MAP_HUGETLB regions and their lengths
+  std::atomic<bool> fallback_warned{false};  // Builder and appender threads map concurrently
+
+  void *map_hugetlb(size_t bytes, size_t page, int page_shift) {
+    size_t len = (bytes + page - 1) / page * page;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0);
+    if (p == MAP_FAILED) {
+      if (!fallback_warned.exchange(true)) {
+        fprintf(stderr, "no %zu kB hugetlb pages available, falling back\n", page >> 10);
+      }
+      return NULL;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    mapped[p] = len;
+    return p;
+  }
+};
+
+// Fixed-size slots carved from large page-backed chunks, so thousands of
+// small position blocks share a few huge pages instead of one TLB entry per
+// 4 KB page. Slots are recycled through a free list and the chunks are only
+// returned on destruction.
+class SlabPool {
+  public:
+
+  SlabPool(size_t slot_bytes, size_t chunk_bytes) : slot_bytes(slot_bytes), chunk_bytes(chunk_bytes) {}
+
+  ~SlabPool() {
+    for (size_t i = 0; i < chunks.size(); i++) allocator->release(chunks[i]);
+  }
+
+  // Must be set before the first alloc(), PAGE_NORMAL passes through to malloc
+  void set_policy(PageAllocator *pages, PAGE_POLICY page_policy) {
+    allocator = pages;
+    policy = page_policy;
+    if (policy == PAGE_HUGE_1G) chunk_bytes = HUGE_PAGE_1G;
+  }
+
+  void *alloc() {
+    if (policy == PAGE_NORMAL) return malloc(slot_bytes);
+    std::lock_guard<std::mutex> guard(lock);
+    if (free_slots.empty()) {
+      char *chunk = (char *)allocator->alloc(chunk_bytes, policy);
+      if (!chunk) return NULL;
+      chunks.push_back(chunk);
+      for (size_t off = 0; off + slot_bytes <= chunk_bytes; off += slot_bytes) free_slots.push_back(chunk + off);
+    }
+    void *p = free_slots.back();
+    free_slots.pop_back();
+    return p;
+  }
+
+  void release(void *p) {
+    if (policy == PAGE_NORMAL) {
+      free(p);
+      return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    free_slots.push_back(p);
+  }
+
+  void *first_chunk() { return chunks.empty() ? NULL : chunks[0]; }
+
+  private:
+
+  size_t slot_bytes;
+  size_t chunk_bytes;
+  PAGE_POLICY policy = PAGE_NORMAL;
+  PageAllocator *allocator = NULL;
+  std::mutex lock;
+  std::vector<char *> chunks;
+  std::vector<void *> free_slots;
+};
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef KD_REFINE_H_
+#define KD_REFINE_H_
+
+// CPU refine engine for multi-column box predicates: a bulk-loaded k-d tree
+// over up to three columns, leaves of KD_LEAF_SIZE points packed column-wise
+// in tree order. It keeps the contract of refineWithOptix: rows with
+// predicate[2d] < col d < predicate[2d + 1] on every column get their bit set,
+// or cleared with inverse. Subtrees inside the box are set without tests,
+// leaves cut by it are tested with the box_test kernel picked from CPUID.
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "bitmap_kernels.h"
+
+#define KD_MAX_DIMS 3
+#define KD_LEAF_SIZE 64
+
+typedef struct {
+  int visited_nodes;
+  int filled_nodes;  // Inside the box, rows set without tests
+  int tested_leaves;
+  long tested_rows;
+} KdScanStats;
+
+class KdRefine {
+  public:
+
+  KdRefine(const uint32_t *const *cols, int dims, int n) : dims(dims), n(n) {
+    assert(dims >= 1 && dims <= KD_MAX_DIMS);
+    std::vector<uint32_t> idx(n);
+    for (int i = 0; i < n; i++) idx[i] = i;
+    nodes.resize(node_count(n));
+    // Subtrees are laid out in preorder, a node's left child follows it
+#pragma omp parallel
+#pragma omp single
+    build(cols, idx.data(), 0, n, 0);
+
+    for (int d = 0; d < dims; d++) {
+      points[d].resize(n);
+#pragma omp parallel for
+      for (int i = 0; i < n; i++) points[d][i] = cols[d][idx[i]];
+    }
+    rows.swap(idx);
+  }
+
+  size_t bytes() const { return nodes.size() * sizeof(Node) + (size_t)n * (dims + 1) * sizeof(uint32_t); }
+
+  KdScanStats refine(uint32_t *result, const double *predicate, bool inverse, box_test_kernel box_test) const {
+    KdScanStats stats = {0, 0, 0, 0};
+    // Open double bounds to closed code bounds
+    Box box;
+    for (int d = 0; d < dims; d++) {
+      double lo = floor(predicate[2 * d]) + 1, hi = ceil(predicate[2 * d + 1]) - 1;
+      if (lo > hi || hi < 0 || lo > UINT32_MAX) return stats;
+      box.lo[d] = lo < 0 ? 0 : (uint32_t)lo;
+      box.hi[d] = hi > UINT32_MAX ? UINT32_MAX : (uint32_t)hi;
+    }
+
+    // Node ranges inside the box (kind 0) and leaves cut by it (kind 1)
+    std::vector<std::pair<int, int> > todo;
+    std::vector<int> stack(1, 0);
+    while (!stack.empty()) {
+      const Node &node = nodes[stack.back()];
+      int id = stack.back();
+      stack.pop_back();
+      stats.visited_nodes++;
+      bool inside = true;
+      bool disjoint = false;
+      for (int d = 0; d < dims; d++) {
+        inside &= node.box.lo[d] >= box.lo[d] && node.box.hi[d] <= box.hi[d];
+        disjoint |= node.box.hi[d] < box.lo[d] || node.box.lo[d] > box.hi[d];
+      }
+      if (disjoint || node.begin == node.end) continue;
+      if (inside) {
+        todo.push_back(std::make_pair(id, 0));
+        stats.filled_nodes++;
+      } else if (node.right < 0) {
+        todo.push_back(std::make_pair(id, 1));
+        stats.tested_leaves++;
+        stats.tested_rows += node.end - node.begin;
+      } else {
+        stack.push_back(node.right);
+        stack.push_back(id + 1);
+      }
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t t = 0; t < todo.size(); t++) {
+      const Node &node = nodes[todo[t].first];
+      if (todo[t].second == 0) {
+        for (int i = node.begin; i < node.end; i++) set_row(result, rows[i], inverse);
+      } else {
+        test_leaf(result, node.begin, node.end, box, inverse, box_test);
+      }
+    }
+    return stats;
+  }
+
+  private:
+
+  typedef struct {
+    uint32_t lo[KD_MAX_DIMS], hi[KD_MAX_DIMS];  // Closed bounds
+  } Box;
+
+  typedef struct {
+    Box box;
+    int begin, end;  // Points of the subtree
+    int right;       // Right child, -1 for a leaf
+  } Node;
+
+  int dims, n;
+  std::vector<Node> nodes;
+  std::vector<uint32_t> points[KD_MAX_DIMS];
+  std::vector<uint32_t> rows;  // Row id of every point
+
+  static int node_count(int m) { return m <= KD_LEAF_SIZE ? 1 : 1 + node_count(m / 2) + node_count(m - m / 2); }
+
+  void build(const uint32_t *const *cols, uint32_t *idx, int begin, int end, int id) {
+    Node &node = nodes[id];
+    node.begin = begin;
+    node.end = end;
+    int axis = 0;
+    uint32_t widest = 0;
+    for (int d = 0; d < dims; d++) {
+      uint32_t lo = UINT32_MAX, hi = 0;
+      for (int i = begin; i < end; i++) {
+        lo = std::min(lo, cols[d][idx[i]]);
+        hi = std::max(hi, cols[d][idx[i]]);
+      }
+      node.box.lo[d] = lo;
+      node.box.hi[d] = hi;
+      if (hi >= lo && hi - lo >= widest) {
+        widest = hi - lo;
+        axis = d;
+      }
+    }
+    if (end - begin <= KD_LEAF_SIZE) {
+      node.right = -1;
+      return;
+    }
+    int m = end - begin, mid = begin + m / 2;
+    const uint32_t *v = cols[axis];
+    std::nth_element(idx + begin, idx + mid, idx + end, [v](uint32_t a, uint32_t b) { return v[a] < v[b]; });
+    node.right = id + 1 + node_count(m / 2);
+#pragma omp task if (m > 1 << 16)
+    build(cols, idx, begin, mid, id + 1);
+    build(cols, idx, mid, end, node.right);
+#pragma omp taskwait
+  }
+
+  static void set_row(uint32_t *result, uint32_t r, bool inverse) {
+    if (inverse) {
+      __atomic_fetch_and(&result[r >> 5], ~(1U << (31 - r % 32)), __ATOMIC_RELAXED);
+    } else {
+      __atomic_fetch_or(&result[r >> 5], 1U << (31 - r % 32), __ATOMIC_RELAXED);
+    }
+  }
+
+  void test_leaf(uint32_t *result, int begin, int end, const Box &box, bool inverse, box_test_kernel box_test) const {
+    // lo <= x <= hi as x - lo <= hi - lo, unsigned
+    uint32_t span[KD_MAX_DIMS];
+    const uint32_t *cols[KD_MAX_DIMS];
+    for (int d = 0; d < dims; d++) {
+      span[d] = box.hi[d] - box.lo[d];
+      cols[d] = points[d].data() + begin;
+    }
+    uint32_t hits[(KD_LEAF_SIZE + 31) / 32];
+    box_test(hits, cols, dims, box.lo, span, end - begin);
+    for (int w = 0; w < (end - begin + 31) / 32; w++) {
+      for (uint32_t bits = hits[w]; bits; bits &= bits - 1) {
+        set_row(result, rows[begin + w * 32 + 31 - __builtin_ctz(bits)], inverse);
+      }
+    }
+  }
+};
+
+#endif
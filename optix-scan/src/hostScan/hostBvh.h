@@ -0,0 +1,214 @@
+#ifndef HOSTBVH_H
+#define HOSTBVH_H
+
+// Host stand-in for the OptiX GAS over custom primitives: a binned SAH BVH
+// over the AABBs kGenAABB emits, traversed by axis-aligned rays. Every
+// primitive whose box a ray overlaps within [0, tmax] is reported, as OptiX
+// calls the intersection program for it.
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#define HOST_BVH_BINS 16
+#define HOST_BVH_LEAF 4       // Leaves at or below this size are never split
+#define HOST_BVH_MAX_LEAF 16  // Leaves above this size are split even against SAH
+#define HOST_BVH_STACK 256
+
+struct HostAabb {
+    float min[3], max[3];
+};
+
+struct HostBvhNode {
+    HostAabb box;
+    int first;  // Leaf: first primitive in order, inner: left child (right = first + 1)
+    int count;  // Primitives of a leaf, 0 for inner nodes
+};
+
+struct HostTraceStats {
+    long node_visits;
+    long intersection_tests;  // Primitive boxes overlapped by the ray
+    long hits;                // Results set
+};
+
+class HostBvh {
+  public:
+
+    HostBvh() : nodes(NULL), node_num(0) {}
+    ~HostBvh() { free(nodes); }
+
+    // order receives the primitive index of every leaf slot
+    void build(const HostAabb *boxes, int n, std::vector<int> &order) {
+        free(nodes);
+        order.resize(n);
+        for (int i = 0; i < n; i++) order[i] = i;
+        centroids.resize(n);
+        for (int i = 0; i < n; i++) {
+            for (int a = 0; a < 3; a++) centroids[i].c[a] = 0.5f * (boxes[i].min[a] + boxes[i].max[a]);
+        }
+        // A binary tree with single-primitive leaves at most, untouched pages stay unmapped
+        nodes = (HostBvhNode *) malloc(std::max(2 * n - 1, 1) * sizeof(HostBvhNode));
+        node_num = 1;
+        this->boxes = boxes;
+#pragma omp parallel
+#pragma omp single
+        split(0, order.data(), 0, n);
+        nodes = (HostBvhNode *) realloc(nodes, node_num * sizeof(HostBvhNode));
+        leaf_boxes.resize(n);
+        for (int i = 0; i < n; i++) leaf_boxes[i] = boxes[order[i]];
+        std::vector<Centroid>().swap(centroids);
+        this->boxes = NULL;
+    }
+
+    int size() const { return node_num; }
+
+    // hit(slot) for every leaf slot whose box the ray origin + t * axis, t in
+    // [0, tmax] overlaps
+    template <typename F>
+    void trace(const float origin[3], int axis, float tmax, F &&hit, HostTraceStats &stats) const {
+        int u = (axis + 1) % 3, v = (axis + 2) % 3;
+        float from = origin[axis], to = origin[axis] + tmax;
+        int stack[HOST_BVH_STACK];
+        int top = 0;
+        stack[top++] = 0;
+        while (top) {
+            const HostBvhNode &node = nodes[stack[--top]];
+            stats.node_visits++;
+            if (!overlaps(node.box, origin, axis, u, v, from, to)) continue;
+            if (node.count) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    if (!overlaps(leaf_boxes[i], origin, axis, u, v, from, to)) continue;
+                    stats.intersection_tests++;
+                    hit(i);
+                }
+            } else {
+                assert(top + 2 <= HOST_BVH_STACK);
+                stack[top++] = node.first + 1;
+                stack[top++] = node.first;
+            }
+        }
+    }
+
+  private:
+
+    struct Centroid {
+        float c[3];
+    };
+
+    HostBvhNode *nodes;
+    int node_num;
+    const HostAabb *boxes;
+    std::vector<Centroid> centroids;
+    std::vector<HostAabb> leaf_boxes;
+
+    static bool overlaps(const HostAabb &b, const float o[3], int axis, int u, int v, float from, float to) {
+        return b.min[u] <= o[u] && o[u] <= b.max[u] && b.min[v] <= o[v] && o[v] <= b.max[v] &&
+               b.max[axis] >= from && b.min[axis] <= to;
+    }
+
+    static void grow(HostAabb &b, const HostAabb &x) {
+        for (int a = 0; a < 3; a++) {
+            b.min[a] = std::min(b.min[a], x.min[a]);
+            b.max[a] = std::max(b.max[a], x.max[a]);
+        }
+    }
+
+    static HostAabb empty_box() {
+        HostAabb b;
+        for (int a = 0; a < 3; a++) {
+            b.min[a] = 3.4e38f;
+            b.max[a] = -3.4e38f;
+        }
+        return b;
+    }
+
+    static float area(const HostAabb &b) {
+        if (b.min[0] > b.max[0]) return 0.0f;
+        float dx = b.max[0] - b.min[0], dy = b.max[1] - b.min[1], dz = b.max[2] - b.min[2];
+        return dx * dy + dy * dz + dz * dx;
+    }
+
+    void split(int id, int *order, int first, int count) {
+        HostBvhNode &node = nodes[id];
+        node.box = empty_box();
+        float cmin[3] = {3.4e38f, 3.4e38f, 3.4e38f}, cmax[3] = {-3.4e38f, -3.4e38f, -3.4e38f};
+        for (int i = first; i < first + count; i++) {
+            grow(node.box, boxes[order[i]]);
+            for (int a = 0; a < 3; a++) {
+                cmin[a] = std::min(cmin[a], centroids[order[i]].c[a]);
+                cmax[a] = std::max(cmax[a], centroids[order[i]].c[a]);
+            }
+        }
+        node.first = first;
+        node.count = count;
+        if (count <= HOST_BVH_LEAF) return;
+
+        int axis = 0;
+        for (int a = 1; a < 3; a++) {
+            if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis]) axis = a;
+        }
+        float extent = cmax[axis] - cmin[axis];
+        int mid;
+        if (extent > 0.0f) {
+            // Binned SAH over the centroids
+            int bin_count[HOST_BVH_BINS] = {0};
+            HostAabb bin_box[HOST_BVH_BINS];
+            for (int b = 0; b < HOST_BVH_BINS; b++) bin_box[b] = empty_box();
+            float scale = HOST_BVH_BINS / extent;
+            for (int i = first; i < first + count; i++) {
+                int b = std::min(HOST_BVH_BINS - 1, (int) ((centroids[order[i]].c[axis] - cmin[axis]) * scale));
+                bin_count[b]++;
+                grow(bin_box[b], boxes[order[i]]);
+            }
+            float right_area[HOST_BVH_BINS];
+            int right_count[HOST_BVH_BINS];
+            HostAabb acc = empty_box();
+            int n = 0;
+            for (int b = HOST_BVH_BINS - 1; b > 0; b--) {
+                grow(acc, bin_box[b]);
+                n += bin_count[b];
+                right_area[b] = area(acc);
+                right_count[b] = n;
+            }
+            acc = empty_box();
+            n = 0;
+            int best = -1;
+            float best_cost = 3.4e38f;
+            for (int b = 1; b < HOST_BVH_BINS; b++) {
+                grow(acc, bin_box[b - 1]);
+                n += bin_count[b - 1];
+                if (n == 0 || right_count[b] == 0) continue;
+                float cost = area(acc) * n + right_area[b] * right_count[b];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best = b;
+                }
+            }
+            // Splitting pays off when it beats testing every primitive of the node
+            bool leaf_cheaper = best < 0 || best_cost >= area(node.box) * count;
+            if (leaf_cheaper && count <= HOST_BVH_MAX_LEAF) return;
+            if (best > 0) {
+                int *it = std::partition(order + first, order + first + count, [&](int p) {
+                    return std::min(HOST_BVH_BINS - 1, (int) ((centroids[p].c[axis] - cmin[axis]) * scale)) < best;
+                });
+                mid = it - order;
+            } else {
+                mid = first + count / 2;
+            }
+        } else {
+            // Duplicate centroids, halve the list
+            mid = first + count / 2;
+        }
+
+        int left = __atomic_fetch_add(&node_num, 2, __ATOMIC_RELAXED);
+        node.first = left;
+        node.count = 0;
+#pragma omp task if (count > (1 << 14))
+        split(left, order, first, mid - first);
+        split(left + 1, order, mid, first + count - mid);
+#pragma omp taskwait
+    }
+};
+
+#endif
@@ -0,0 +1,593 @@
+// Host backend for the OptiX entry points of every RT variant (optixScan,
+// rtc3, rtc1, rtscan_2c, rtscan_interval_spacing), for machines without an
+// RTX GPU. The scene is the cube primitives kGenAABB emits in a host BVH,
+// rays take the origin and stride math of each variant's computeRay, and
+// hits go through the same intersection test and set_result. Result bitmaps
+// are host memory here.
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "hostBvh.h"
+#include "../optixScan/timer.h"
+
+#ifndef DEBUG_INFO
+#define DEBUG_INFO 0
+#endif
+#ifndef SMALL_DATA_RANGE
+#define SMALL_DATA_RANGE 0 // 2^6
+#endif
+
+typedef uint32_t CODE;
+typedef uint32_t BITS;
+
+struct HostParams {
+    int                     direction;          // direction = (x = 0, y = 1, z = 2)
+    double                  aabb_width;
+    double                  ray_interval;
+    double                  ray_space;
+    double                  ray_length;         // length of each ray
+    double                  ray_last_length;    // length of the last ray
+    double                  ray_stride;         // ray_stride = ray_length + ray_space
+    const double*           predicate;
+    BITS*                   result;             // record scan result
+    bool                    inverse;
+};
+
+struct HostScanState {
+    int                     length;
+    int                     width;
+    int                     height;
+    int                     column_num;
+    int                     epsilon;
+    CODE*                   range;
+    int                     dims;               // Columns the intersection test reads
+    std::vector<double>     points;             // dims values per BVH leaf slot
+    std::vector<int>        prim_ids;           // Row of every BVH leaf slot
+    HostBvh                 bvh;
+    HostParams              params;
+    int                     launch_width;
+    int                     launch_height;
+    int                     depth;
+};
+
+//
+//  variable
+//
+static Timer            timer_;
+static HostScanState    state;                  // optixScan
+static HostScanState    state_rtc3;
+static HostScanState    state_rtc1;
+static HostScanState    state_2c;
+static HostScanState    state_interval_spacing;
+
+static void gen_aabb(const double *xyz, unsigned int numPrims, double radius, HostAabb *aabb) {
+    // kGenAABB_t: a float cube around every point
+#pragma omp parallel for
+    for (unsigned int i = 0; i < numPrims; i++) {
+        for (int a = 0; a < 3; a++) {
+            float center = (float) xyz[3 * i + a];
+            aabb[i].min[a] = center - (float) radius;
+            aabb[i].max[a] = center + (float) radius;
+        }
+    }
+}
+
+static void make_gas(HostScanState &state, const double *values, int dims, const HostAabb *aabb) {
+    // values holds dims columns per row, moved to BVH leaf order
+    timer_.commonGetStartTime(0);
+    state.bvh.build(aabb, state.length, state.prim_ids);
+    state.dims = dims;
+    state.points.resize((size_t) state.length * dims);
+#pragma omp parallel for
+    for (int i = 0; i < state.length; i++) {
+        for (int d = 0; d < dims; d++) {
+            state.points[(size_t) i * dims + d] = values[(size_t) state.prim_ids[i] * dims + d];
+        }
+    }
+    timer_.commonGetEndTime(0);
+    printf("[HostRT] bvh nodes: %d\n", state.bvh.size());
+}
+
+static void log_common_info(HostScanState &state) {
+    printf("data num:                   %d\n", state.length);
+    printf("aabb_width                  %f\n", state.params.aabb_width);
+    printf("ray_interval                %f\n", state.params.ray_interval);
+    if (state.range) {
+        printf("[HostRT] range: ");
+        for (int i = 0; i < 2 * state.column_num; i++) {
+            printf("%u ", state.range[i]);
+        }
+        printf("\n");
+    }
+}
+
+static inline void set_result(const HostParams &params, int idx) {
+    int pos = idx / 32;
+    int pos_in_size = idx & 31;
+    if (params.inverse) {
+        __atomic_fetch_and(params.result + pos, ~(1U << (31 - pos_in_size)), __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_or(params.result + pos, 1U << (31 - pos_in_size), __ATOMIC_RELAXED);
+    }
+}
+
+static void compute_ray(const HostParams &params, unsigned int x, unsigned int y, unsigned int z,
+                        double space_factor, double offset, float origin[3]) {
+    // computeRay: along the direction from predicate lower bound, across it
+    // offset ray intervals into the cell. computeRay_ray_interval_1 takes
+    // space_factor = offset = 1.
+    int a = params.direction;
+    int u = a == 0 ? 1 : 0;
+    int v = a == 2 ? 1 : 2;
+    origin[a] = float((params.predicate[2 * a] + space_factor * params.ray_space) + z * params.ray_stride);
+    origin[u] = float(params.predicate[2 * u] + (x + offset) * params.ray_interval);
+    origin[v] = float(params.predicate[2 * v] + (y + offset) * params.ray_interval);
+}
+
+// ray(x, y, z, origin, axis, tmax) sets up the ray of every launch index,
+// as the raygen program does
+template <typename RayGen>
+static void launch(HostScanState &state, RayGen ray) {
+    timer_.commonGetStartTime(2);
+    const HostParams &params = state.params;
+    HostTraceStats total = {0, 0, 0};
+    int rows = state.launch_height * state.depth;
+    if (state.launch_width <= 0 || rows <= 0) rows = 0;
+#pragma omp parallel
+    {
+        HostTraceStats stats = {0, 0, 0};
+#pragma omp for schedule(dynamic, 1)
+        for (int row = 0; row < rows; row++) {
+            unsigned int y = row % state.launch_height, z = row / state.launch_height;
+            for (unsigned int x = 0; x < (unsigned int) state.launch_width; x++) {
+                float origin[3];
+                int axis;
+                float tmax;
+                ray(x, y, z, origin, axis, tmax);
+                state.bvh.trace(origin, axis, tmax, [&](int slot) {
+                    // __intersection__cube
+                    const double *point = &state.points[(size_t) slot * state.dims];
+                    for (int d = 0; d < state.dims; d++) {
+                        if (!(point[d] > params.predicate[2 * d] && point[d] < params.predicate[2 * d + 1])) return;
+                    }
+                    set_result(params, state.prim_ids[slot]);
+                    stats.hits++;
+                }, stats);
+            }
+        }
+        __atomic_fetch_add(&total.node_visits, stats.node_visits, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total.intersection_tests, stats.intersection_tests, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total.hits, stats.hits, __ATOMIC_RELAXED);
+    }
+    timer_.commonGetEndTime(2);
+#if DEBUG_INFO == 1
+    printf("[HostRT] launch_width = %d, launch_height = %d, depth = %d, total ray num = %ld\n",
+           state.launch_width, state.launch_height, state.depth,
+           (long) state.launch_width * state.launch_height * state.depth);
+    printf("[HostRT] node visits: %ld, intersection tests: %ld, hits: %ld\n",
+           total.node_visits, total.intersection_tests, total.hits);
+    timer_.showTime(2, "hostLaunch");
+    timer_.clear();
+#endif
+}
+
+static void set_ray_segments(HostScanState &state, double predicate_range, int ray_length, int ray_segment_num,
+                             int ray_mode, double ray_space_with_length, double min_last_length) {
+    // Ray length, space and stride of refineWithOptix, shared by the variants
+    // launching segmented rays. A zero last length becomes min_last_length.
+    // With ray_segment_num the last ray is set as in rtc1, the OptiX build of
+    // optixScan leaves it at 0 and its last segment finds nothing.
+    if (ray_length == -1) { // Launch rays based on ray_segment_num
+        if (ray_mode == 0) {
+            state.params.ray_stride = predicate_range / ray_segment_num;
+            state.params.ray_space  = 0.0;
+            state.params.ray_length = state.params.ray_stride - state.params.ray_space;
+            state.depth             = ray_segment_num;
+            state.params.ray_last_length = predicate_range - (state.depth - 1) * state.params.ray_stride;
+        } else if (ray_mode == 1) {
+            state.params.ray_stride = predicate_range / ray_segment_num;
+            state.depth             = ray_segment_num;
+            if (state.params.ray_stride <= state.params.aabb_width) {
+                state.params.ray_length = 1e-5;
+                state.params.ray_space  = predicate_range / state.depth;
+            } else {
+                state.params.ray_length = state.params.ray_stride - state.params.aabb_width;
+                state.params.ray_space  = state.params.aabb_width;
+            }
+            state.params.ray_last_length = state.params.ray_length;
+        } else if (ray_mode == 2) {
+            // Recalculate ray segment with fixed ray stride
+            state.params.ray_length = 1e-5;
+            state.params.ray_space  = state.params.aabb_width;
+            state.params.ray_stride = state.params.ray_length + state.params.ray_space;
+            state.depth             = (int) (predicate_range / state.params.ray_stride) + 1;
+            state.params.ray_last_length = state.params.ray_length;
+        } else {
+            printf("ray_mode(%d) is not valid!\n", ray_mode);
+            fflush(stdout);
+            exit(1);
+        }
+    } else { // Launch rays based on ray_length
+        if (ray_mode == 0) { // Continuous rays
+            state.params.ray_space  = 0.0;
+        } else if (ray_mode == 1) { // Rays with space
+            state.params.ray_space  = ray_space_with_length;
+        } else {
+            printf("ray_mode(%d) is not valid for launching rays based on 'ray_length'\n", ray_mode);
+            fflush(stdout);
+            exit(1);
+        }
+        state.params.ray_length = ray_length;
+        state.params.ray_stride = state.params.ray_length + state.params.ray_space;
+        state.depth             = (int) (predicate_range / state.params.ray_stride);
+        if (state.depth * state.params.ray_stride < predicate_range) {
+            double last_stride = predicate_range - state.depth * state.params.ray_stride;
+            state.params.ray_last_length = std::max(last_stride - state.params.ray_space, 0.0);
+            if (state.params.ray_last_length == 0.0) {
+                state.params.ray_last_length = min_last_length;
+            }
+            state.depth++;
+        } else {
+            state.params.ray_last_length = state.params.ray_length;
+        }
+    }
+}
+
+static void set_launch_size(HostScanState &state, const double prange[3], int direction, double &predicate_range) {
+    int u = direction == 0 ? 1 : 0;
+    int v = direction == 2 ? 1 : 2;
+    predicate_range     = prange[direction];
+    state.launch_width  = (int) (prange[u] / state.params.ray_interval) + 1;
+    state.launch_height = (int) (prange[v] / state.params.ray_interval) + 1;
+}
+
+static void uint32_to_double3(std::vector<double> &xyz, CODE **data, int length) {
+    xyz.resize((size_t) 3 * length);
+    for (int i = 0; i < length; i++) {
+        for (int a = 0; a < 3; a++) xyz[(size_t) 3 * i + a] = static_cast<double>(data[a][i]);
+    }
+}
+
+static void data_range(const CODE *range, int column_num, CODE &data_min, CODE &data_max) {
+    data_min = range[0];
+    data_max = range[1];
+    for (int i = 1; i < column_num; i++) {
+        if (range[2 * i] < data_min) {
+            data_min = range[2 * i];
+        }
+        if (range[2 * i + 1] > data_max) {
+            data_max = range[2 * i + 1];
+        }
+    }
+}
+
+static void get_epsilon(int &epsilon, CODE data_max) {
+    if (epsilon <= (1 << 23)) {
+        epsilon = 0;
+    } else {
+        epsilon = data_max >> 23;
+    }
+}
+
+//
+//  optixScan
+//
+void initializeOptix(CODE **raw_data, int length, int density_width, int density_height, int column_num, CODE *range,
+                     int cube_width) {
+    fprintf(stdout, "[HostRT]initializeOptix begin...\n");
+    state.length = length;
+    state.width = density_width;
+    state.height = density_height;
+    state.column_num = column_num;
+    state.range = range;
+    CODE data_min, data_max;
+    data_range(range, column_num, data_min, data_max);
+    if (cube_width == -1) { // for 2^6
+        state.params.aabb_width = 1.0 * (data_max - data_min) / state.width;
+        state.params.ray_interval = 1.0 * (data_max - data_min) / state.width;
+    } else if (cube_width == 0) {
+        state.params.aabb_width = ((data_max - data_min) - 1) / state.width + 1.0f;
+        state.params.ray_interval = ((data_max - data_min) - 1) / state.width + 1.0f;
+    } else {
+        state.params.aabb_width = cube_width;
+        state.params.ray_interval = state.params.aabb_width;
+    }
+    get_epsilon(state.epsilon, data_max);
+    log_common_info(state);
+
+    std::vector<double> vertices;
+    uint32_to_double3(vertices, raw_data, length);
+    std::vector<HostAabb> aabb(length);
+    gen_aabb(vertices.data(), length, state.params.aabb_width / 2 + state.epsilon / 2, aabb.data());
+    make_gas(state, vertices.data(), 3, aabb.data());
+    timer_.showTime(0, "initializeOptix");
+    fprintf(stdout, "[HostRT]initializeOptix end\n");
+}
+
+void refineWithOptix(BITS *dev_result_bitmap, double *predicate, int column_num, int ray_length, int ray_segment_num,
+                     bool inverse, int direction, int ray_mode) {
+    double prange[3] = {
+        predicate[1] - predicate[0],
+        predicate[3] - predicate[2],
+        predicate[5] - predicate[4]
+    };
+    double predicate_range;
+    set_launch_size(state, prange, direction, predicate_range);
+    if (state.params.ray_interval <= 1.0) { // for data range 2^8|2^6
+        state.launch_width -= 2;
+        state.launch_height -= 2;
+    }
+    set_ray_segments(state, predicate_range, ray_length, ray_segment_num, ray_mode, state.params.aabb_width, 1e-5);
+
+    state.params.result = dev_result_bitmap;
+    state.params.direction = direction;
+    state.params.inverse = inverse;
+    state.params.predicate = predicate;
+    launch(state, [&](unsigned int x, unsigned int y, unsigned int z, float origin[3], int &axis, float &tmax) {
+#if SMALL_DATA_RANGE == 1
+        compute_ray(state.params, x, y, z, 1.0, 1.0, origin);
+#else
+        compute_ray(state.params, x, y, z, 0.5, 0.5, origin);
+#endif
+        axis = state.params.direction;
+        tmax = (float) (z == (unsigned int) state.depth - 1 ? state.params.ray_last_length : state.params.ray_length);
+    });
+}
+
+//
+//  rtc3
+//
+void initializeOptixRTc3(CODE **raw_data, int length, int density_width, int density_height, int column_num,
+                         CODE *range, uint32_t cube_width, int direction) {
+    fprintf(stdout, "[HostRT]initializeOptix begin...\n");
+    HostScanState &state = state_rtc3;
+    state.length = length;
+    state.width = density_width;
+    state.height = density_height;
+    state.column_num = column_num;
+    state.range = range;
+    CODE data_min, data_max;
+    data_range(range, column_num, data_min, data_max);
+    if (cube_width > 0) {
+        state.params.aabb_width = cube_width;
+        state.params.ray_interval = state.params.aabb_width;
+    } else {
+        state.params.aabb_width = 1.0 * (data_max - data_min) / state.width;
+        state.params.ray_interval = state.params.aabb_width;
+    }
+    log_common_info(state);
+
+    std::vector<double> vertices;
+    uint32_to_double3(vertices, raw_data, length);
+    std::vector<HostAabb> aabb(length);
+    gen_aabb(vertices.data(), length, state.params.aabb_width / 2, aabb.data());
+    make_gas(state, vertices.data(), 3, aabb.data());
+    timer_.showTime(0, "initializeOptix");
+    fprintf(stdout, "[HostRT]initializeOptix end\n");
+}
+
+void refineWithOptixRTc3(BITS *dev_result_bitmap, double *predicate, int column_num, int ray_length,
+                         int ray_segment_num, bool inverse, int direction, int ray_mode) {
+    HostScanState &state = state_rtc3;
+    double prange[3] = {
+        predicate[1] - predicate[0],
+        predicate[3] - predicate[2],
+        predicate[5] - predicate[4]
+    };
+    double predicate_range;
+    set_launch_size(state, prange, direction, predicate_range);
+    set_ray_segments(state, predicate_range, ray_length, ray_segment_num, ray_mode, state.params.aabb_width, 0.0);
+
+    state.params.result = dev_result_bitmap;
+    state.params.direction = direction;
+    state.params.inverse = inverse;
+    state.params.predicate = predicate;
+    launch(state, [&](unsigned int x, unsigned int y, unsigned int z, float origin[3], int &axis, float &tmax) {
+        compute_ray(state.params, x, y, z, 0.5, 0.5, origin);
+        axis = state.params.direction;
+        tmax = (float) state.params.ray_length;
+    });
+}
+
+//
+//  rtc1, cube primitives (PRIMITIVE_TYPE 1)
+//
+void initializeOptixRTc1(CODE **raw_data, int length, int density_width, int density_height, int column_num,
+                         CODE *range, int cube_width_factor, int ray_interval, int prim_size) {
+    fprintf(stdout, "[HostRT]initializeOptix begin...\n");
+    HostScanState &state = state_rtc1;
+    state.column_num = column_num;
+    state.length = length;
+    state.width = density_width;
+    state.height = density_height;
+    state.range = range;
+    CODE data_min, data_max;
+    data_range(range, column_num, data_min, data_max);
+    if (ray_interval == -1) {
+        if (cube_width_factor == -1) {
+            state.params.aabb_width = (data_max - data_min) / state.width + 1.0f;
+        } else {
+            state.params.aabb_width = (data_max - data_min) / cube_width_factor + 1.0f;
+        }
+        state.params.ray_interval = (data_max - data_min) / state.width + 1.0f;
+    } else {
+        if (prim_size == -1) {
+            state.params.aabb_width = ray_interval;
+        } else {
+            state.params.aabb_width = prim_size;
+        }
+        state.params.ray_interval = ray_interval;
+    }
+    log_common_info(state);
+
+    // One column on the x axis
+    std::vector<double> vertices((size_t) 3 * length, 0.0);
+    for (int i = 0; i < length; i++) vertices[(size_t) 3 * i] = static_cast<double>(raw_data[0][i]);
+    std::vector<HostAabb> aabb(length);
+    gen_aabb(vertices.data(), length, state.params.aabb_width / 2, aabb.data());
+    std::vector<double> values(raw_data[0], raw_data[0] + length);
+    make_gas(state, values.data(), 1, aabb.data());
+    timer_.showTime(0, "initializeOptix");
+    fprintf(stdout, "[HostRT]initializeOptix end\n");
+}
+
+void refineWithOptixRTc1(BITS *dev_result_bitmap, double *predicate, int column_num, int ray_length,
+                         int ray_segment_num, bool inverse, int direction, int ray_mode) {
+    HostScanState &state = state_rtc1;
+    for (int i = 0; i < 3; i++) {
+        if (predicate[i * 2] >= predicate[i * 2 + 1]) {
+            return;
+        }
+    }
+    double prange[3] = {
+        predicate[1] - predicate[0],
+        predicate[3] - predicate[2],
+        predicate[5] - predicate[4]
+    };
+    double predicate_range;
+    set_launch_size(state, prange, direction, predicate_range);
+    if (direction == 1) {
+        state.launch_width++; // +2 is for without sieve
+    }
+    set_ray_segments(state, predicate_range, ray_length, ray_segment_num, ray_mode, state.params.aabb_width, 0.0);
+
+    state.params.result = dev_result_bitmap;
+    state.params.direction = direction;
+    state.params.inverse = inverse;
+    state.params.predicate = predicate;
+    launch(state, [&](unsigned int x, unsigned int y, unsigned int z, float origin[3], int &axis, float &tmax) {
+        compute_ray(state.params, x, y, z, 0.5, 0.5, origin);
+        axis = state.params.direction;
+        tmax = (float) state.params.ray_length;
+    });
+}
+
+//
+//  rtscan_2c, two columns on the y-z plane
+//
+void initializeOptixRTScan_2c(CODE **raw_data, int length, int density_width, int density_height, int column_num) {
+    fprintf(stdout, "[HostRT]initializeOptix begin...\n");
+    assert(column_num == 2); // The OptiX build only fills the 2-column scene
+    int epi = 32;
+    HostScanState &state = state_2c;
+    state.length = length;
+    state.width = density_width;
+    state.height = density_height;
+    state.column_num = column_num;
+    state.range = NULL;
+    state.params.aabb_width = (state.length - 1) / state.width + 1.0f + epi;
+    log_common_info(state);
+
+    // kGenAABB_t for column_num == 2: x spans [1, 1 + width]
+    double radius = state.params.aabb_width / 2;
+    std::vector<HostAabb> aabb(length);
+    std::vector<double> values((size_t) 2 * length);
+#pragma omp parallel for
+    for (int i = 0; i < length; i++) {
+        values[(size_t) 2 * i] = static_cast<double>(raw_data[0][i]);
+        values[(size_t) 2 * i + 1] = static_cast<double>(raw_data[1][i]);
+        aabb[i].min[0] = 1.0f;
+        aabb[i].max[0] = 1.0f + float(2 * radius);
+        for (int a = 1; a < 3; a++) {
+            float center = (float) values[(size_t) 2 * i + a - 1];
+            aabb[i].min[a] = center - (float) radius;
+            aabb[i].max[a] = center + (float) radius;
+        }
+    }
+    make_gas(state, values.data(), 2, aabb.data());
+    timer_.showTime(0, "initializeOptix");
+    fprintf(stdout, "[HostRT]initializeOptix end\n");
+}
+
+void refineWithOptixRTScan_2c(BITS *dev_result_bitmap, double *predicate, unsigned *range, int column_num,
+                              int ray_segment_num, bool inverse) {
+    HostScanState &state = state_2c;
+    state.params.result     = dev_result_bitmap;
+    state.depth             = ray_segment_num;
+    state.params.inverse    = inverse;
+    state.params.ray_stride = 2.0 + state.params.aabb_width;
+    state.params.predicate  = predicate;
+    state.launch_width      = static_cast<int>((predicate[1] - predicate[0]) / state.params.aabb_width) + 1;
+    state.launch_height     = static_cast<int>((predicate[3] - predicate[2]) / state.params.aabb_width) + 1;
+    launch(state, [&](unsigned int x, unsigned int y, unsigned int z, float origin[3], int &axis, float &tmax) {
+        origin[0] = 0.0f;
+        origin[1] = float(state.params.predicate[0] + (x + 0.5) * state.params.aabb_width);
+        origin[2] = float(state.params.predicate[2] + (y + 0.5) * state.params.aabb_width);
+        axis = 0;
+        tmax = float(state.params.ray_stride);
+    });
+}
+
+//
+//  rtscan_interval_spacing, cube primitives (PRIMITIVE_TYPE 2)
+//
+void initializeOptixRTScan_interval_spacing(CODE **raw_data, int length, int density_width, int density_height,
+                                            int column_num, CODE *range, double ray_interval_ratio) {
+    fprintf(stdout, "[HostRT]initializeOptix begin...\n");
+    HostScanState &state = state_interval_spacing;
+    state.length = length;
+    state.width = density_width;
+    state.height = density_height;
+    state.column_num = column_num;
+    state.range = range;
+    CODE data_min, data_max;
+    data_range(range, column_num, data_min, data_max);
+    state.params.aabb_width = ((data_max - data_min) - 1) / state.width + 1.0f;
+    state.params.ray_interval = ((data_max - data_min) - 1) / state.width * ray_interval_ratio + 1.0f;
+    log_common_info(state);
+
+    std::vector<double> vertices;
+    uint32_to_double3(vertices, raw_data, length);
+    std::vector<HostAabb> aabb(length);
+    gen_aabb(vertices.data(), length, state.params.aabb_width / 2, aabb.data());
+    make_gas(state, vertices.data(), 3, aabb.data());
+    timer_.showTime(0, "initializeOptix");
+    fprintf(stdout, "[HostRT]initializeOptix end\n");
+}
+
+void refineWithOptixRTScan_interval_spacing(BITS *dev_result_bitmap, double *predicate, int column_num,
+                                            int ray_length, int ray_segment_num, bool inverse, int direction,
+                                            int ray_mode, double ray_distance_ratio) {
+    HostScanState &state = state_interval_spacing;
+    CODE range[3] = {
+        state.range[1] - state.range[0],
+        state.range[3] - state.range[2],
+        state.range[5] - state.range[4]
+    };
+    double prange[3] = {
+        predicate[1] - predicate[0],
+        predicate[3] - predicate[2],
+        predicate[5] - predicate[4]
+    };
+    double predicate_range;
+    if (direction == 0) {
+        predicate_range = prange[0];
+        state.launch_width  = (int) (prange[1] * state.width / range[1]) + 1;
+        state.launch_height = (int) (prange[2] * state.height / range[2]) + 1;
+    } else if (direction == 1) {
+        predicate_range = prange[1];
+        state.launch_width  = (int) (prange[0] / state.params.ray_interval) + 1;
+        state.launch_height = (int) (prange[2] / state.params.ray_interval) + 1;
+    } else {
+        predicate_range = prange[2];
+        state.launch_width  = (int) (prange[0] * state.width / range[0]) + 1;
+        state.launch_height = (int) (prange[1] * state.height / range[1]) + 1;
+    }
+    set_ray_segments(state, predicate_range, ray_length, ray_segment_num, ray_mode,
+                     state.params.aabb_width * ray_distance_ratio, 0.0);
+
+    state.params.result = dev_result_bitmap;
+    state.params.direction = direction;
+    state.params.inverse = inverse;
+    state.params.predicate = predicate;
+    launch(state, [&](unsigned int x, unsigned int y, unsigned int z, float origin[3], int &axis, float &tmax) {
+        compute_ray(state.params, x, y, z, 0.5, 0.5, origin);
+        axis = state.params.direction;
+        tmax = (float) (z == (unsigned int) state.depth - 1 ? state.params.ray_last_length : state.params.ray_length);
+    });
+}
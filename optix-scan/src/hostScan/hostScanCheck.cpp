@@ -0,0 +1,110 @@
+// Checks the host backend of refineWithOptix against a raw scan: random
+// three-column data, box predicates launched along every direction with
+// segmented rays (ray_segment_num, ray_mode 0/1/2) and fixed ray lengths.
+// Exits with 1 on the first mismatching row.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+typedef uint32_t CODE;
+typedef uint32_t BITS;
+
+// Entry points of libhost_scan.a, as declared in rt.h
+void initializeOptix(CODE **raw_data, int length, int density_width, int density_height, int column_num, CODE *range,
+                     int cube_width);
+void refineWithOptix(BITS *dev_result_bitmap, double *predicate, int column_num, int ray_length, int ray_segment_num,
+                     bool inverse, int direction, int ray_mode);
+
+static int check(const char *name, const BITS *result, CODE **data, int length, const double *predicate) {
+    int expected = 0, found = 0;
+    for (int i = 0; i < length; i++) {
+        bool hit = true;
+        for (int d = 0; d < 3; d++) hit &= data[d][i] > predicate[2 * d] && data[d][i] < predicate[2 * d + 1];
+        bool set = (result[i / 32] >> (31 - i % 32)) & 1;
+        expected += hit;
+        found += set && hit;
+        if (hit != set) {
+            printf("[ERROR] %s: row %d (%u, %u, %u) is %s\n", name, i, data[0][i], data[1][i], data[2][i],
+                   set ? "set" : "missing");
+            return 1;
+        }
+    }
+    printf("[CHECK] %s: hit %d/%d\n", name, found, expected);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int length = 200000;
+    int density_width = 100;
+    CODE max_code = 1U << 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                length = atoi(optarg);
+                break;
+            case 'w':
+                density_width = atoi(optarg);
+                break;
+            case 'm':
+                max_code = (CODE) strtoul(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: %s [-n <rows>] [-w <density width>] [-m <largest code>]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    std::mt19937 mt(12345);
+    std::uniform_int_distribution<CODE> dist(0, max_code);
+    CODE *data[3];
+    CODE range[6];
+    for (int d = 0; d < 3; d++) {
+        data[d] = (CODE *) malloc(length * sizeof(CODE));
+        range[2 * d] = max_code;
+        range[2 * d + 1] = 0;
+        for (int i = 0; i < length; i++) {
+            data[d][i] = dist(mt);
+            range[2 * d] = std::min(range[2 * d], data[d][i]);
+            range[2 * d + 1] = std::max(range[2 * d + 1], data[d][i]);
+        }
+    }
+    initializeOptix(data, length, density_width, density_width, 3, range, 0);
+
+    // Open bounds, as the drivers pass them
+    double predicate[6] = {
+        0.1 * max_code, 0.6 * max_code,
+        0.3 * max_code, 0.9 * max_code,
+        0.2 * max_code, 0.5 * max_code
+    };
+    std::vector<BITS> result((length + 31) / 32);
+    int wrong = 0;
+    char name[128];
+    for (int direction = 0; direction < 3; direction++) {
+        for (int ray_mode = 0; ray_mode < 3; ray_mode++) {
+            int segment_nums[2] = {1, 4};
+            for (int s = 0; s < 2; s++) {
+                memset(result.data(), 0, result.size() * sizeof(BITS));
+                refineWithOptix(result.data(), predicate, 3, -1, segment_nums[s], false, direction, ray_mode);
+                sprintf(name, "direction %d, ray_mode %d, %d segments", direction, ray_mode, segment_nums[s]);
+                wrong += check(name, result.data(), data, length, predicate);
+            }
+        }
+        for (int ray_mode = 0; ray_mode < 2; ray_mode++) {
+            int ray_length = max_code / 7;
+            memset(result.data(), 0, result.size() * sizeof(BITS));
+            refineWithOptix(result.data(), predicate, 3, ray_length, 1, false, direction, ray_mode);
+            sprintf(name, "direction %d, ray_mode %d, ray length %d", direction, ray_mode, ray_length);
+            wrong += check(name, result.data(), data, length, predicate);
+        }
+    }
+
+    for (int d = 0; d < 3; d++) free(data[d]);
+    printf("[CHECK] %d mismatching launches\n", wrong);
+    return wrong ? 1 : 0;
+}
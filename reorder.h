@@ -0,0 +1,116 @@
+#ifndef REORDER_H_
+#define REORDER_H_
+
+// Row clustering for tables we may physically reorder: a permutation sorting
+// the rows by one column, or by the Z-order (Morton code) of several, applied
+// to every column. Clustered rows turn the refine positions of an area into
+// near-contiguous runs and let a multi-column scan touch fewer cache lines.
+// Shared by bindex (-W) and tools/reorder_rows.cpp.
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <parallel/algorithm>
+#include <utility>
+#include <vector>
+
+#define MAX_CLUSTER_COLUMNS 8
+
+class MortonCoder {
+  // Interleave the high bits of k columns, column 0 most significant in
+  // every group of k bits. Byte-wise spread tables, 64 / k bits per column.
+  // Each column is shifted to fill 32 bits first, so a column of small codes
+  // still takes its share of the key.
+  public:
+
+  MortonCoder(const uint32_t *const *cols, int k, size_t n) : k(k), bits(k == 1 ? 32 : 64 / k) {
+    assert(k >= 1 && k <= MAX_CLUSTER_COLUMNS);
+    for (int c = 0; c < k; c++) {
+      uint32_t hi = 0;
+      lo[c] = UINT32_MAX;
+      for (size_t i = 0; i < n; i++) {
+        lo[c] = std::min(lo[c], cols[c][i]);
+        hi = std::max(hi, cols[c][i]);
+      }
+      if (n == 0) lo[c] = 0;
+      shift[c] = hi > lo[c] ? __builtin_clz(hi - lo[c]) : 0;
+    }
+    for (int b = 0; b < 256; b++) {
+      spread[b] = 0;
+      for (int i = 0; i < 8; i++) {
+        if (b >> i & 1) spread[b] |= 1ULL << (i * k);
+      }
+    }
+  }
+
+  uint64_t key(const uint32_t *const *cols, size_t row) const {
+    uint32_t coords[MAX_CLUSTER_COLUMNS];
+    for (int c = 0; c < k; c++) coords[c] = coord(c, cols[c][row]);
+    return interleave(coords);
+  }
+
+  // Bit b (0 = lowest) of the coordinate of column c is key bit b * k + k - 1 - c
+  uint64_t interleave(const uint32_t *coords) const {
+    uint64_t key = 0;
+    for (int c = 0; c < k; c++) {
+      uint64_t s = 0;
+      for (int j = 0; j * 8 < bits; j++) s |= spread[coords[c] >> (j * 8) & 0xFF] << (j * 8 * k);
+      key |= s << (k - 1 - c);
+    }
+    return key;
+  }
+
+  uint32_t coord(int c, uint32_t v) const {
+    // Monotone in v, codes outside the build range clamp to the ends
+    if (v < lo[c]) return 0;
+    uint32_t d = v - lo[c];
+    if (shift[c] && d >> (32 - shift[c])) return max_coord();
+    return (d << shift[c]) >> (32 - bits);
+  }
+
+  uint32_t max_coord() const { return bits == 32 ? UINT32_MAX : (1U << bits) - 1; }
+  int columns() const { return k; }
+  int coord_bits() const { return bits; }
+
+  private:
+
+  int k, bits;
+  uint32_t lo[MAX_CLUSTER_COLUMNS];
+  int shift[MAX_CLUSTER_COLUMNS];
+  uint64_t spread[256];
+};
+
+inline std::vector<uint32_t> cluster_order(const uint32_t *const *cols, int k, size_t n) {
+  // Original row id of every row after clustering, ties keep the row order
+  MortonCoder coder(cols, k, n);
+  std::vector<std::pair<uint64_t, uint32_t> > keyed(n);
+#pragma omp parallel for
+  for (size_t i = 0; i < n; i++) keyed[i] = std::make_pair(coder.key(cols, i), (uint32_t)i);
+  __gnu_parallel::sort(keyed.begin(), keyed.end());
+  std::vector<uint32_t> order(n);
+#pragma omp parallel for
+  for (size_t i = 0; i < n; i++) order[i] = keyed[i].second;
+  return order;
+}
+
+inline void permute_column(uint32_t *col, const std::vector<uint32_t> &order, uint32_t *tmp) {
+  // col[i] = old col[order[i]] for the first order.size() rows, tmp holds as many
+  size_t n = order.size();
+#pragma omp parallel for
+  for (size_t i = 0; i < n; i++) tmp[i] = col[order[i]];
+  memcpy(col, tmp, n * sizeof(uint32_t));
+}
+
+inline double row_locality(const uint32_t *col, size_t n) {
+  // Share of rows whose successor in value order is the next row, 1 for a
+  // sorted column
+  std::vector<uint32_t> idx(n);
+  for (size_t i = 0; i < n; i++) idx[i] = i;
+  __gnu_parallel::sort(idx.begin(), idx.end(),
+                       [col](uint32_t a, uint32_t b) { return col[a] < col[b] || (col[a] == col[b] && a < b); });
+  size_t adjacent = 0;
+  for (size_t i = 1; i < n; i++) adjacent += idx[i] == idx[i - 1] + 1;
+  return n > 1 ? (double)adjacent / (n - 1) : 1.0;
+}
+
+#endif
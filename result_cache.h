@@ -0,0 +1,153 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+// Bounded LRU cache of compressed result bitmaps, keyed by column and value
+// range. Entries are found by cost (e.g. positions to refine to turn a cached
+// range into the requested one), not only by exact key, so shifted or nested
+// ranges can be answered from a cached bitmap plus a delta.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <list>
+#include <mutex>
+#include <vector>
+
+// Word-aligned run-length encoding of 32-bit bitmap words: a header word
+// (bit 31: fill bit, bits 16-30: fill words, bits 0-15: literal words)
+// followed by its literal words
+#define RLE_MAX_FILL ((1U << 15) - 1)
+#define RLE_MAX_LITERALS ((1U << 16) - 1)
+
+inline void rle_compress(const uint32_t *words, int n, std::vector<uint32_t> &out) {
+  out.clear();
+  int i = 0;
+  while (i < n) {
+    uint32_t fill_bit = words[i] == ~0U;
+    uint32_t fill = 0;
+    while (i < n && fill < RLE_MAX_FILL && (words[i] == 0 || words[i] == ~0U) && (words[i] == ~0U) == fill_bit) {
+      fill++;
+      i++;
+    }
+    size_t header = out.size();
+    out.push_back(0);
+    uint32_t literals = 0;
+    while (i < n && literals < RLE_MAX_LITERALS && words[i] != 0 && words[i] != ~0U) {
+      out.push_back(words[i++]);
+      literals++;
+    }
+    out[header] = (fill_bit << 31) | (fill << 16) | literals;
+  }
+}
+
+inline void rle_decompress(const std::vector<uint32_t> &in, uint32_t *words, int n) {
+  int w = 0;
+  size_t i = 0;
+  while (i < in.size() && w < n) {
+    uint32_t header = in[i++];
+    uint32_t fill = (header >> 16) & RLE_MAX_FILL, literals = header & RLE_MAX_LITERALS;
+    memset(words + w, header >> 31 ? 0xFF : 0, fill * sizeof(uint32_t));
+    w += fill;
+    memcpy(words + w, &in[i], literals * sizeof(uint32_t));
+    w += literals;
+    i += literals;
+  }
+}
+
+class ResultCache {
+  public:
+
+  struct Entry {
+    int column;
+    const void *owner;  // Index the bitmap was computed on, a new snapshot never matches
+    uint32_t rows;
+    uint64_t lo, hi;    // Cached value range [lo, hi)
+    std::vector<uint32_t> words;  // rle_compress(..)ed result bitmap
+    size_t bytes() const { return sizeof(Entry) + words.size() * sizeof(uint32_t); }
+  };
+
+  size_t budget;  // Bytes, 0 disables the cache
+  size_t lookups = 0, exact_hits = 0, delta_hits = 0, misses = 0, evictions = 0, rejected = 0;
+
+  ResultCache(size_t budget_bytes = 0) : budget(budget_bytes) {}
+
+  // Find the entry of (column, owner, rows) with the smallest cost(lo, hi) >= 0,
+  // negative costs are not usable. Decompresses it into 'bitmap' and returns
+  // its range, false on a miss.
+  template <class COST>
+  bool lookup(int column, const void *owner, uint32_t rows, COST cost, uint32_t *bitmap, int words, uint64_t *lo,
+              uint64_t *hi) {
+    std::lock_guard<std::mutex> guard(lock);
+    lookups++;
+    std::list<Entry>::iterator best = entries.end();
+    double best_cost = 0;
+    for (std::list<Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+      if (it->column != column || it->owner != owner || it->rows != rows) continue;
+      double c = cost(it->lo, it->hi);
+      if (c >= 0 && (best == entries.end() || c < best_cost)) {
+        best = it;
+        best_cost = c;
+      }
+    }
+    if (best == entries.end()) {
+      misses++;
+      return false;
+    }
+    entries.splice(entries.begin(), entries, best);  // Most recently used first
+    rle_decompress(best->words, bitmap, words);
+    *lo = best->lo;
+    *hi = best->hi;
+    if (best_cost == 0) {
+      exact_hits++;
+    } else {
+      delta_hits++;
+    }
+    return true;
+  }
+
+  void insert(int column, const void *owner, uint32_t rows, uint64_t lo, uint64_t hi, const uint32_t *bitmap,
+              int words) {
+    if (!budget) return;
+    Entry entry;
+    entry.column = column;
+    entry.owner = owner;
+    entry.rows = rows;
+    entry.lo = lo;
+    entry.hi = hi;
+    rle_compress(bitmap, words, entry.words);
+    std::lock_guard<std::mutex> guard(lock);
+    if (entry.bytes() > budget) {
+      rejected++;
+      return;
+    }
+    for (std::list<Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+      if (it->column == column && it->owner == owner && it->rows == rows && it->lo == lo && it->hi == hi) {
+        used -= it->bytes();
+        entries.erase(it);
+        break;
+      }
+    }
+    while (used + entry.bytes() > budget) {
+      used -= entries.back().bytes();
+      entries.pop_back();
+      evictions++;
+    }
+    used += entry.bytes();
+    entries.push_front(std::move(entry));
+  }
+
+  void report() {
+    std::lock_guard<std::mutex> guard(lock);
+    printf("[CACHE] %zu lookups: %zu exact hits, %zu delta hits, %zu misses (hit rate %.1f%%)\n", lookups,
+           exact_hits, delta_hits, misses, lookups ? 100.0 * (exact_hits + delta_hits) / lookups : 0.0);
+    printf("[CACHE] %zu entries, %.2f/%.2f MB, %zu evictions, %zu too large\n", entries.size(), used / 1048576.0,
+           budget / 1048576.0, evictions, rejected);
+  }
+
+  private:
+
+  std::mutex lock;
+  std::list<Entry> entries;  // LRU order, most recent first
+  size_t used = 0;
+};
+
+#endif
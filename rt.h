@@ -139,7 +139,14 @@ CODE encodeQuery(int column_id, CODE old_query);
 bool ifEncodeEqual(const CODE val1, const CODE val2, int bindex_id);
 CODE findKeyByValue(const CODE Val, std::map<CODE, int>& map_);
 
+#define MAX_MERGE_BITMAPS 16
+typedef struct {
+  BITS *bitmaps[MAX_MERGE_BITMAPS];  // Device pointers, the struct is passed to kernels by value
+  int num;
+} MergeSources;
+
 cudaError_t GPUbitAndWithCuda(BITS* dev_bitmap_a, BITS* dev_bitmap_b, unsigned int n);
+cudaError_t GPUbitAndMultiWithCuda(BITS* dev_result, BITS** dev_bitmaps, int num, unsigned int n);
 cudaError_t GPUbitCopyWithCuda(BITS* dev_bitmap_a, BITS* dev_bitmap_b, unsigned int n);
 cudaError_t GPUbitCopyNegationWithCuda(BITS* dev_bitmap_a, BITS* dev_bitmap_b, unsigned int n);
 cudaError_t GPUbitCopySIMDWithCuda(BITS* result, BITS* dev_bitmap_a, BITS* dev_bitmap_b, unsigned int bitnum);
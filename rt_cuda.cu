@@ -10,6 +10,21 @@ void bit_andKernel(BITS* bitmap_a, BITS* bitmap_b, int n)
         bitmap_a[i] &= bitmap_b[i];
 }
 
+// result = bitmaps[0] & bitmaps[1] & ..., every word written once,
+// a word stops reading further bitmaps once it is 0
+__global__ 
+void bit_andMultiKernel(BITS* result, MergeSources srcs, int n)
+{
+    int index = threadIdx.x + blockIdx.x * blockDim.x;
+    int stride = blockDim.x * gridDim.x;
+    for (int i = index; i < n; i += stride) {
+        BITS v = srcs.bitmaps[0][i];
+        for (int j = 1; j < srcs.num && v; j++)
+            v &= srcs.bitmaps[j][i];
+        result[i] = v;
+    }
+}
+
 // copy bitmap_b to bitmap_a
 // bitmap_a = bitmap_b
 __global__ 
@@ -76,6 +91,56 @@ cudaError_t GPUbitAndWithCuda(BITS* dev_bitmap_a, BITS* dev_bitmap_b, unsigned i
     timer.commonGetEndTime(2);
 
 
+Error:
+    return cudaStatus;
+}
+
+cudaError_t GPUbitAndMultiWithCuda(BITS* dev_result, BITS** dev_bitmaps, int num, unsigned int n)
+{
+    cudaError_t cudaStatus;
+
+    int bitnum = bits_num_needed(n);
+    dim3 blockSize(1024);
+    dim3 gridSize((bitnum + blockSize.x - 1) / blockSize.x);
+    MergeSources srcs;
+    int next = 0;
+    assert(num >= 1);
+
+    // Choose which GPU to run on, change this on a multi-GPU system.
+    cudaStatus = cudaSetDevice(0);
+    if (cudaStatus != cudaSuccess) {
+        fprintf(stderr, "cudaSetDevice failed!  Do you have a CUDA-capable GPU installed?");
+        goto Error;
+    }
+
+    // Launch a kernel on the GPU with one thread for each element.
+    // Fold the sources in groups of MAX_MERGE_BITMAPS, every group after the
+    // first one ANDs into the partial result read back as its srcs[0].
+    timer.commonGetStartTime(2);
+    while (next < num) {
+        srcs.num = 0;
+        if (next > 0) srcs.bitmaps[srcs.num++] = dev_result;
+        while (next < num && srcs.num < MAX_MERGE_BITMAPS)
+            srcs.bitmaps[srcs.num++] = dev_bitmaps[next++];
+        bit_andMultiKernel <<<gridSize, blockSize>>> (dev_result, srcs, bitnum);
+        // Check for any errors launching the kernel
+
+        cudaStatus = cudaGetLastError();
+        if (cudaStatus != cudaSuccess) {
+            fprintf(stderr, "bit_andMultiKernel launch failed: %s\n", cudaGetErrorString(cudaStatus));
+            goto Error;
+        }
+    }
+    // cudaDeviceSynchronize waits for the kernel to finish, and returns
+    // any errors encountered during the launch.
+    cudaStatus = cudaDeviceSynchronize();
+    if (cudaStatus != cudaSuccess) {
+        fprintf(stderr, "cudaDeviceSynchronize returned error code %d after launching bit_andMultiKernel!\n", cudaStatus);
+        goto Error;
+    }
+    timer.commonGetEndTime(2);
+
+
 Error:
     return cudaStatus;
 }
@@ -782,7 +782,7 @@ Over:
   return;
 }
 
-void merge_with_GPU(BITS *merge_bitmap, BITS **dev_bitmaps, const int bindex_num, const int bindex_len)
+void merge_with_GPU(BITS *merge_bitmap, BITS **dev_bitmaps, BinDex **bindexs, const int bindex_num, const int bindex_len)
 {
   timer.commonGetStartTime(15);
 
@@ -813,18 +813,32 @@ void merge_with_GPU(BITS *merge_bitmap, BITS **dev_bitmaps, const int bindex_num
     }
   }
 
-  // int skip_num = 0;
+  // AND all taking part bitmaps in one pass instead of pairwise
+  int order[MAX_BINDEX_NUM];
+  int order_num = 0;
   for (int bindex_id = 0; bindex_id < bindex_num; bindex_id++) {
     if (!scan_skip_this_face[bindex_id]) {
       if (merge_bitmap != dev_bitmaps[bindex_id]) {
-        GPUbitAndWithCuda(merge_bitmap, dev_bitmaps[bindex_id], bindex_len);
+        order[order_num++] = bindex_id;
       }
     }
     else {
       if(DEBUG_INFO) printf("[INFO] %d face merge skipped.\n",bindex_id);
-      // skip_num++;
     }
   }
+  // Sparsest column first, estimated by the share of its domain the predicate keeps
+  auto hit_estimate = [bindexs](int bindex_id) {
+    return double(scan_max_compares[bindex_id][1] - scan_max_compares[bindex_id][0]) /
+           (double(bindexs[bindex_id]->data_max) - double(bindexs[bindex_id]->data_min) + 1);
+  };
+  std::stable_sort(order, order + order_num, [&hit_estimate](int a, int b) {
+    return hit_estimate(a) < hit_estimate(b);
+  });
+  BITS *srcs[MAX_BINDEX_NUM + 1];
+  int src_num = 0;
+  srcs[src_num++] = merge_bitmap;
+  for (int i = 0; i < order_num; i++) srcs[src_num++] = dev_bitmaps[order[i]];
+  if (src_num > 1) GPUbitAndMultiWithCuda(merge_bitmap, srcs, src_num, bindex_len);
 
   timer.commonGetEndTime(15);
   return;
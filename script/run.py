@@ -236,6 +236,43 @@ def BinDex_uniform_2p32(column_num=3):
     print(cmd)
     os.system(cmd)
 
+def BinDex_hugepage(column_num=3):
+    # refine latency with normal pages vs. transparent / explicit huge pages
+    logtime = time.strftime("%y%m%d-%H%M%S")
+    os.system('make clean')
+    os.system('make bindex DATA_N=1e8 VAREA_N=128')
+    for page in ['normal', 'thp', '2m', '1g']:
+        output_file = f"log/bindex/hugepage/{logtime}-uniform2p32-{column_num}c-{page}.log"
+        args = f"-b {column_num} -H {page} -p test/scan_cmd_32_{column_num}c.txt"
+        cmd = f"./bin/bindex {args} -f data/uniform_data_1e8_3.dat > {output_file}"
+        print(cmd)
+        os.system(cmd)
+        refine = []
+        with open(output_file) as f:
+            for line in f:
+                if line.startswith('refine time:'):
+                    refine.append(float(line.split()[2]))
+                elif line.startswith('[PAGES]'):
+                    print(line.strip())
+        if refine:
+            print(f"{page}: refine avg {np.mean(refine):.3f} ms, p50 {np.median(refine):.3f} ms over {len(refine)} scans")
+
+def BinDex_batch(column_num=1):
+    # per-query latency of shared scans vs. one scan per query, by batch size
+    logtime = time.strftime("%y%m%d-%H%M%S")
+    os.system('make clean')
+    os.system('make bindex DATA_N=1e8 VAREA_N=128')
+    for batch in [1, 4, 16, 64, 256]:
+        output_file = f"log/bindex/batch/{logtime}-uniform2p32-{column_num}c-b{batch}.log"
+        args = f"-b {column_num} -B {batch} -p test/scan_cmd_32_{column_num}c.txt"
+        cmd = f"./bin/bindex {args} -f data/uniform_data_1e8_3.dat > {output_file}"
+        print(cmd)
+        os.system(cmd)
+        with open(output_file) as f:
+            for line in f:
+                if line.startswith('[BATCH] batched') or line.startswith('[BATCH] sequential'):
+                    print(f"b{batch} {line.strip()}")
+
 def BinDex_skewed():
     logtime = time.strftime("%y%m%d-%H%M%S")
     os.system('make clean')
@@ -383,4 +420,6 @@ RTScan_3c_unique_1e8()
 # BinDex_uniform_2p32(column_num=2)
 # BinDex_uniform_2p32(column_num=3)
 # BinDex_uniform_2p32(column_num=4)
+# BinDex_hugepage(column_num=3)
+# BinDex_batch(column_num=1)
 # BinDex_skewed()
\ No newline at end of file
@@ -0,0 +1,136 @@
+// Offline row clustering: reorder a column-major data file by one column, or
+// by the Z-order of several, and save the original row id of every row.
+// g++ -std=c++11 -O2 -fopenmp reorder_rows.cpp -o reorder_rows
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+
+#include "../reorder.h"
+
+typedef uint32_t CODE;
+
+CODE **loadData(const char *path, int data_len, int col_num)
+{
+    FILE *fp;
+    if (!(fp = fopen(path, "rb")))
+    {
+        printf("[ERROR] load: fopen(%s) faild\n", path);
+        exit(-1);
+    }
+    printf("[INFO] loading %d columns from %s\n", col_num, path);
+
+    CODE **data = (CODE **)malloc(col_num * sizeof(CODE *));
+    for (int col_id = 0; col_id < col_num; col_id++) {
+        data[col_id] = (CODE *)malloc(data_len * sizeof(CODE));
+        if (fread(data[col_id], sizeof(CODE), data_len, fp) != (size_t)data_len)
+        {
+            printf("[ERROR] load col %d: fread faild.\n", col_id);
+            exit(-1);
+        }
+    }
+    fclose(fp);
+    return data;
+}
+
+void saveData(const char *path, CODE **data, int data_len, int col_num)
+{
+    FILE *fp;
+    if (!(fp = fopen(path, "wb")))
+    {
+        printf("[ERROR] save: fopen(%s) faild\n", path);
+        exit(-1);
+    }
+    for (int col_id = 0; col_id < col_num; col_id++) {
+        if (fwrite(data[col_id], sizeof(CODE), data_len, fp) != (size_t)data_len)
+        {
+            printf("[ERROR] save col %d: fwrite faild.\n", col_id);
+            exit(-1);
+        }
+    }
+    fclose(fp);
+    printf("[+] saved %s\n", path);
+}
+
+int main(int argc, char *argv[])
+{
+    char opt;
+    int col_num = 0;
+    int data_len = 1e8;
+    char in_path[256] = "\0";
+    char out_path[256] = "./reordered.dat";
+    char map_path[256] = "./reordered.rowid";
+    std::vector<int> key_cols;
+    while ((opt = getopt(argc, argv, "hc:n:f:o:m:k:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            printf(
+                "Usage: %s \n"
+                "[-f <input file>][-c <col num>][-n <data len>]"
+                "[-k <key columns, e.g. 0 or 0,2 for z-order>]"
+                "[-o <output file>][-m <row id mapping file>] \n",
+                argv[0]);
+            exit(0);
+        case 'f':
+            snprintf(in_path, sizeof(in_path), "%s", optarg);
+            break;
+        case 'o':
+            snprintf(out_path, sizeof(out_path), "%s", optarg);
+            break;
+        case 'm':
+            snprintf(map_path, sizeof(map_path), "%s", optarg);
+            break;
+        case 'n':
+            data_len = atoi(optarg);
+            break;
+        case 'c':
+            col_num = atoi(optarg);
+            break;
+        case 'k': {
+            std::string s = optarg;
+            size_t i = 0;
+            while (i <= s.size()) {
+                size_t end = s.find(',', i);
+                if (end == std::string::npos) end = s.size();
+                key_cols.push_back(atoi(s.substr(i, end - i).c_str()));
+                i = end + 1;
+            }
+            break;
+        }
+        default:
+            printf("Error: unknown option %c\n", (char)opt);
+            exit(-1);
+        }
+    }
+
+    assert(strlen(in_path));
+    assert(col_num > 0);
+    assert(data_len > 0);
+    assert(key_cols.size() >= 1 && key_cols.size() <= MAX_CLUSTER_COLUMNS);
+
+    CODE **data = loadData(in_path, data_len, col_num);
+    const CODE *keys[MAX_CLUSTER_COLUMNS];
+    for (size_t i = 0; i < key_cols.size(); i++) {
+        assert(key_cols[i] >= 0 && key_cols[i] < col_num);
+        keys[i] = data[key_cols[i]];
+    }
+    for (int col_id = 0; col_id < col_num; col_id++) {
+        printf("[INFO] col %d locality before: %.3f\n", col_id, row_locality(data[col_id], data_len));
+    }
+
+    std::vector<uint32_t> order = cluster_order(keys, key_cols.size(), data_len);
+    CODE *tmp = (CODE *)malloc(data_len * sizeof(CODE));
+    for (int col_id = 0; col_id < col_num; col_id++) {
+        permute_column(data[col_id], order, tmp);
+        printf("[INFO] col %d locality after: %.3f\n", col_id, row_locality(data[col_id], data_len));
+    }
+    free(tmp);
+
+    saveData(out_path, data, data_len, col_num);
+    CODE *row_ids = order.data();
+    saveData(map_path, &row_ids, data_len, 1);
+}
@@ -0,0 +1,190 @@
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+// CPU / NUMA topology read from /sys, thread-affinity policies and NUMA
+// memory placement (mbind without a libnuma dependency)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define MAX_NUMA_NODES 8
+
+// mbind(2) modes, see <numaif.h>
+#define TOPO_MPOL_BIND 2
+#define TOPO_MPOL_INTERLEAVE 3
+
+enum AFFINITY_POLICY {
+  AFFINITY_LEGACY = 0,  // worker t on cpu t * 2 (one SMT sibling per core on our old boxes)
+  AFFINITY_COMPACT,     // fill the physical cores of node 0 first, then node 1, ...
+  AFFINITY_SPREAD,      // round-robin over the nodes, physical cores first
+  AFFINITY_NONE,        // leave placement to the OS
+};
+
+enum MEM_POLICY {
+  MEM_LOCAL = 0,   // first touch, pages land on the node of the touching worker
+  MEM_INTERLEAVE,  // pages interleaved over all nodes
+  MEM_BIND,        // all pages on one node
+};
+
+class Topology {
+  public:
+
+  int node_num;
+  int node_id[MAX_NUMA_NODES];                 // id of each node in /sys and for mbind(2)
+  std::vector<int> node_cpus[MAX_NUMA_NODES];  // online cpus of each node
+  std::vector<int> cpu_node;                   // node of each cpu, -1: offline
+  std::vector<int> cpu_primary;                // first SMT sibling of each cpu
+
+  Topology() {
+    std::vector<int> online = parse_cpulist(read_line("/sys/devices/system/cpu/online"));
+    if (online.empty()) {
+      for (int i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); i++) online.push_back(i);
+    }
+    int cpu_max = 0;
+    for (size_t i = 0; i < online.size(); i++) cpu_max = std::max(cpu_max, online[i] + 1);
+    cpu_node.assign(cpu_max, -1);
+    cpu_primary.assign(cpu_max, -1);
+
+    node_num = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+      std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+      std::vector<int> cpus = parse_cpulist(read_line(path.c_str()));
+      if (cpus.empty()) continue;
+      for (size_t i = 0; i < cpus.size(); i++) {
+        if (cpus[i] < cpu_max && cpu_node[cpus[i]] == -1 && std::find(online.begin(), online.end(), cpus[i]) != online.end()) {
+          cpu_node[cpus[i]] = node_num;
+          node_cpus[node_num].push_back(cpus[i]);
+        }
+      }
+      node_id[node_num++] = node;
+    }
+    if (node_num == 0) {
+      // No NUMA information (e.g. containers), one node owning every cpu
+      node_num = 1;
+      node_id[0] = 0;
+      for (size_t i = 0; i < online.size(); i++) {
+        cpu_node[online[i]] = 0;
+        node_cpus[0].push_back(online[i]);
+      }
+    }
+
+    for (size_t i = 0; i < online.size(); i++) {
+      int cpu = online[i];
+      std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list";
+      std::vector<int> siblings = parse_cpulist(read_line(path.c_str()));
+      cpu_primary[cpu] = siblings.empty() ? cpu : siblings[0];
+    }
+  }
+
+  int node_of_cpu(int cpu) const {
+    if (cpu < 0 || cpu >= (int)cpu_node.size() || cpu_node[cpu] < 0) return 0;
+    return cpu_node[cpu];
+  }
+
+  int affinity_cores(AFFINITY_POLICY policy, int *cores, int max_num) const {
+    // Fill cores[0, ret) with the cpu of each worker, -1 for unpinned workers
+    int n = 0;
+    if (policy == AFFINITY_LEGACY) {
+      for (; n < max_num; n++) cores[n] = n * 2;
+      return n;
+    }
+    if (policy == AFFINITY_NONE) {
+      for (; n < max_num; n++) cores[n] = -1;
+      return n;
+    }
+    // Physical cores before their SMT siblings, per node
+    std::vector<int> order[MAX_NUMA_NODES];
+    for (int node = 0; node < node_num; node++) {
+      for (int smt = 0; smt < 2; smt++) {
+        for (size_t i = 0; i < node_cpus[node].size(); i++) {
+          int cpu = node_cpus[node][i];
+          if ((cpu_primary[cpu] == cpu) == (smt == 0)) order[node].push_back(cpu);
+        }
+      }
+    }
+    if (policy == AFFINITY_COMPACT) {
+      for (int node = 0; node < node_num; node++) {
+        for (size_t i = 0; i < order[node].size() && n < max_num; i++) cores[n++] = order[node][i];
+      }
+    } else {
+      for (size_t i = 0; n < max_num; i++) {
+        bool any = false;
+        for (int node = 0; node < node_num && n < max_num; node++) {
+          if (i < order[node].size()) {
+            cores[n++] = order[node][i];
+            any = true;
+          }
+        }
+        if (!any) break;
+      }
+    }
+    return n;
+  }
+
+  void show() const {
+    printf("[TOPOLOGY] %d node(s)\n", node_num);
+    for (int node = 0; node < node_num; node++) {
+      int physical = 0;
+      for (size_t i = 0; i < node_cpus[node].size(); i++) {
+        if (cpu_primary[node_cpus[node][i]] == node_cpus[node][i]) physical++;
+      }
+      printf("[TOPOLOGY] node %d: %d cpus, %d physical cores\n", node, (int)node_cpus[node].size(), physical);
+    }
+  }
+
+  private:
+
+  static std::string read_line(const char *path) {
+    std::ifstream fin(path);
+    std::string line;
+    if (fin.is_open()) std::getline(fin, line);
+    return line;
+  }
+
+  static std::vector<int> parse_cpulist(const std::string &s) {
+    // "0-3,8-11" -> 0,1,2,3,8,9,10,11
+    std::vector<int> cpus;
+    size_t i = 0;
+    while (i < s.size()) {
+      size_t end = s.find(',', i);
+      if (end == std::string::npos) end = s.size();
+      std::string item = s.substr(i, end - i);
+      size_t dash = item.find('-');
+      if (!item.empty() && item[0] >= '0' && item[0] <= '9') {
+        int lo = atoi(item.c_str());
+        int hi = dash == std::string::npos ? lo : atoi(item.c_str() + dash + 1);
+        for (int c = lo; c <= hi; c++) cpus.push_back(c);
+      }
+      i = end + 1;
+    }
+    return cpus;
+  }
+};
+
+inline bool numa_place(void *p, size_t bytes, MEM_POLICY policy, int node, const Topology &topo) {
+  // Set the placement of not yet touched pages, p must be page aligned
+  // (see PageAllocator in hugepage.h)
+  if (policy == MEM_LOCAL || topo.node_num <= 1) return true;
+  unsigned long nodemask = 0;
+  int mode;
+  if (policy == MEM_INTERLEAVE) {
+    mode = TOPO_MPOL_INTERLEAVE;
+    for (int i = 0; i < topo.node_num; i++) nodemask |= 1UL << topo.node_id[i];
+  } else {
+    mode = TOPO_MPOL_BIND;
+    nodemask = 1UL << topo.node_id[node];
+  }
+  if (syscall(SYS_mbind, p, bytes, mode, &nodemask, sizeof(nodemask) * 8, 0) != 0) {
+    fprintf(stderr, "mbind failed, falling back to first touch\n");
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef ZORDER_INDEX_H_
+#define ZORDER_INDEX_H_
+
+// Space-filling-curve layout for box predicates on up to ZORDER_MAX_DIMS
+// columns: row ids sorted by the Morton key of their coordinates, with every
+// ZORDER_SPARSE-th key kept in a sparse index over the curve. A box query
+// walks the keys between the box corners and, on the first key that leaves
+// the box, jumps to the next key back inside it (BIGMIN) instead of reading
+// on. Coordinates are the columns as given, normalEncode output in rtscan;
+// MortonCoder quantizes them, so rows inside the key box are checked against
+// the codes.
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "reorder.h"
+
+#define ZORDER_MAX_DIMS 4
+#define ZORDER_SPARSE 256  // Keys per sparse index entry
+#define ZORDER_CHUNKS 64   // Curve pieces walked in parallel
+
+typedef struct {
+  int jumps;          // BIGMIN jumps taken
+  long walked_keys;   // Keys read between the box corners
+  long checked_rows;  // Inside the key box, checked against the codes
+} ZOrderScanStats;
+
+class ZOrderIndex {
+  public:
+
+  ZOrderIndex(const uint32_t *const *cols, int dims, int n) : dims(dims), n(n), coder(cols, dims, n) {
+    assert(dims >= 1 && dims <= ZORDER_MAX_DIMS);
+    std::vector<std::pair<uint64_t, uint32_t> > keyed(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) keyed[i] = std::make_pair(coder.key(cols, i), (uint32_t)i);
+    __gnu_parallel::sort(keyed.begin(), keyed.end());
+    keys.resize(n);
+    rows.resize(n);
+    for (int d = 0; d < dims; d++) values[d].resize(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+      keys[i] = keyed[i].first;
+      rows[i] = keyed[i].second;
+      for (int d = 0; d < dims; d++) values[d][i] = cols[d][rows[i]];
+    }
+    for (int i = 0; i < n; i += ZORDER_SPARSE) sparse.push_back(keys[i]);
+
+    int bits = coder.coord_bits();
+    for (int d = 0; d < dims; d++) {
+      dim_mask[d] = 0;
+      for (int b = 0; b < bits; b++) dim_mask[d] |= 1ULL << (b * dims + dims - 1 - d);
+    }
+  }
+
+  size_t bytes() const {
+    return (size_t)n * (sizeof(uint64_t) + (dims + 1) * sizeof(uint32_t)) + sparse.size() * sizeof(uint64_t);
+  }
+
+  // result |= rows with lo[d] <= col d < hi[d] on every column, MSB-first
+  // bitmap of (n + 31) / 32 words
+  ZOrderScanStats scan(uint32_t *result, const uint64_t *lo, const uint64_t *hi) const {
+    ZOrderScanStats stats = {0, 0, 0};
+    uint32_t corner[2][ZORDER_MAX_DIMS];
+    for (int d = 0; d < dims; d++) {
+      if (lo[d] >= hi[d] || lo[d] > UINT32_MAX) return stats;
+      corner[0][d] = coder.coord(d, lo[d]);
+      corner[1][d] = coder.coord(d, std::min(hi[d] - 1, (uint64_t)UINT32_MAX));
+    }
+    uint64_t zmin = coder.interleave(corner[0]), zmax = coder.interleave(corner[1]);
+    int first = seek(zmin, 0), last = seek(zmax + 1, first);
+    if (zmax == UINT64_MAX) last = n;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int chunk = 0; chunk < ZORDER_CHUNKS; chunk++) {
+      int from = first + (long)(last - first) * chunk / ZORDER_CHUNKS;
+      int to = first + (long)(last - first) * (chunk + 1) / ZORDER_CHUNKS;
+      ZOrderScanStats local = {0, 0, 0};
+      for (int i = from; i < to;) {
+        local.walked_keys++;
+        if (!in_key_box(keys[i], zmin, zmax)) {
+          // Next key on the curve inside the box, past the last row of the chunk when none is
+          i = seek(bigmin(keys[i], zmin, zmax), i + 1);
+          local.jumps++;
+          continue;
+        }
+        local.checked_rows++;
+        bool hit = true;
+        for (int d = 0; d < dims; d++) hit &= values[d][i] >= lo[d] && values[d][i] < hi[d];
+        if (hit) __atomic_fetch_or(&result[rows[i] >> 5], 1U << (31 - rows[i] % 32), __ATOMIC_RELAXED);
+        i++;
+      }
+      __atomic_fetch_add(&stats.jumps, local.jumps, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&stats.walked_keys, local.walked_keys, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&stats.checked_rows, local.checked_rows, __ATOMIC_RELAXED);
+    }
+    return stats;
+  }
+
+  private:
+
+  int dims, n;
+  MortonCoder coder;
+  uint64_t dim_mask[ZORDER_MAX_DIMS];  // Key bits of every column
+  std::vector<uint64_t> keys;          // Sorted
+  std::vector<uint32_t> rows;          // Row id of every key
+  std::vector<uint32_t> values[ZORDER_MAX_DIMS];
+  std::vector<uint64_t> sparse;        // keys[i * ZORDER_SPARSE]
+
+  bool in_key_box(uint64_t z, uint64_t zmin, uint64_t zmax) const {
+    // The key bits of one column keep the order of its coordinates
+    for (int d = 0; d < dims; d++) {
+      uint64_t v = z & dim_mask[d];
+      if (v < (zmin & dim_mask[d]) || v > (zmax & dim_mask[d])) return false;
+    }
+    return true;
+  }
+
+  uint64_t bigmin(uint64_t z, uint64_t zmin, uint64_t zmax) const {
+    // Smallest key above z inside the box [zmin, zmax], for z outside it
+    // (Tropf and Herzog). UINT64_MAX when there is none.
+    uint64_t result = UINT64_MAX;
+    for (int b = 63; b >= 0; b--) {
+      uint64_t bit = 1ULL << b;
+      int d = dims - 1 - b % dims;
+      if (!(dim_mask[d] & bit)) continue;
+      uint64_t lower = dim_mask[d] & (bit - 1);
+      int state = (z & bit ? 4 : 0) | (zmin & bit ? 2 : 0) | (zmax & bit ? 1 : 0);
+      switch (state) {
+        case 0:  // 000
+        case 7:  // 111
+          break;
+        case 1:  // 001
+          result = (zmin & ~lower) | bit;
+          zmax = (zmax & ~bit) | lower;
+          break;
+        case 3:  // 011
+          return zmin;
+        case 4:  // 100
+          return result;
+        case 5:  // 101
+          zmin = (zmin & ~lower) | bit;
+          break;
+        default:  // zmin > zmax on this column
+          assert(false);
+      }
+    }
+    return result;
+  }
+
+  int seek(uint64_t z, int from) const {
+    // First key at or above z, from on, through the sparse index
+    if (from >= n || keys[from] >= z) return from;
+    int page = std::upper_bound(sparse.begin() + from / ZORDER_SPARSE, sparse.end(), z) - sparse.begin() - 1;
+    int begin = std::max(from, page * ZORDER_SPARSE);
+    int end = std::min(n, (page + 1) * ZORDER_SPARSE);
+    return std::lower_bound(keys.begin() + begin, keys.begin() + end, z) - keys.begin();
+  }
+};
+
+#endif